@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "protocol.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Load generator for the whole broker: starts mbroker, creates the boxes
+// and then drives publishers and subscribers from threads of this process,
+// speaking protocol.h over named pipes like pub and sub do. Prints one
+// key=value line of results, so runs can be compared by scripts.
+//
+// Publisher i publishes to box i%boxes, subscriber j reads box j%boxes from
+// its start and expects every message published to it.
+
+#define BENCH_BATCH 32
+
+typedef struct {
+    size_t boxes, publishers, subscribers, messages, min_size, max_size;
+    const char* broker;
+} bench_config;
+
+typedef struct {
+    size_t id;
+    char pipe_name[MAX_PIPE_NAME_LEN];
+    char box_name[MAX_BOX_NAME_LEN];
+    size_t expected;        // messages a subscriber waits for
+    u64* latencies;         // end to end, one per message received
+    u64 first_ns, last_ns;
+    bool failed;
+} bench_client;
+
+bench_config config = { 1, 1, 1, 10000, 16, 256, "mbroker/mbroker" };
+const char* register_pipe = "register";
+
+void print_usage(){
+    fprintf(stderr, "usage: bench_broker [--boxes n] [--publishers n] [--subscribers n] [--messages n_per_publisher]\n"
+                    "                    [--min-size bytes] [--max-size bytes] [--broker path]\n");
+}
+
+bool parse_options(int argc, char** argv){
+    for(int i=1;i<argc;i+=2){
+        if(i+1>=argc) return false;
+        if(strcmp(argv[i], "--broker")==0){
+            config.broker = argv[i+1];
+            continue;
+        }
+
+        size_t* value = NULL;
+        if(strcmp(argv[i], "--boxes")==0) value = &config.boxes;
+        else if(strcmp(argv[i], "--publishers")==0) value = &config.publishers;
+        else if(strcmp(argv[i], "--subscribers")==0) value = &config.subscribers;
+        else if(strcmp(argv[i], "--messages")==0) value = &config.messages;
+        else if(strcmp(argv[i], "--min-size")==0) value = &config.min_size;
+        else if(strcmp(argv[i], "--max-size")==0) value = &config.max_size;
+        if(value==NULL || sscanf(argv[i+1], "%zu", value)!=1) return false;
+    }
+    return config.boxes>0 && config.min_size<=config.max_size && config.max_size<MSG_LEN-sizeof(message_timestamps);
+}
+
+int cmp_u64(const void* a, const void* b){
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return (x>y) - (x<y);
+}
+
+// Reads exactly size bytes, the broker may split its writes
+bool read_full(int fd, void* buffer, size_t size){
+    size_t got = 0;
+    while(got<size){
+        ssize_t rread = read(fd, (u8*)buffer + got, size - got);
+        if(rread<=0) return false;
+        got += (size_t)rread;
+    }
+    return true;
+}
+
+// Same steps as the manager's create command
+bool create_box(const char* box_name){
+    char pipe_name[MAX_PIPE_NAME_LEN];
+    snprintf(pipe_name, sizeof(pipe_name), "create_%s", box_name);
+    if(mkfifo(pipe_name, 0666)!=0) return false;
+
+    create_msg_box_packet packet;
+    write_packet_create(&packet, pipe_name, box_name);
+    {
+        OPEN_FILE_FD(register_fifo, register_pipe, O_WRONLY);
+        if(write(register_fifo, &packet, sizeof(packet))!=sizeof(packet)) return false;
+    }
+
+    response_create_msg_box_packet response;
+    bool ok;
+    {
+        OPEN_FILE_FD(response_fifo, pipe_name, O_RDONLY);
+        ok = read_full(response_fifo, &response, sizeof(response)) && response.error_code==0;
+    }
+    unlink(pipe_name);
+    return ok;
+}
+
+// Registers a session and opens its fifo, -1 on failure
+int open_session(const void* packet, size_t size, const char* pipe_name, int flags){
+    if(mkfifo(pipe_name, 0666)!=0) return -1;
+    {
+        OPEN_FILE_FD(register_fifo, register_pipe, O_WRONLY);
+        if(write(register_fifo, packet, size)!=(ssize_t)size) return -1;
+    }
+    int fd = open(pipe_name, flags);
+    unlink(pipe_name);
+    return fd;
+}
+
+void* publisher_main(void* client_void){
+    bench_client* client = client_void;
+
+    register_publisher_packet packet;
+    write_packet_register_pub(&packet, client->pipe_name, client->box_name);
+    int fd AUTO_CLOSE_FD = open_session(&packet, sizeof(packet), client->pipe_name, O_WRONLY);
+    if(fd==-1){
+        client->failed = true;
+        return NULL;
+    }
+
+    unsigned int seed = (unsigned int)client->id + 1;
+    size_t spread = config.max_size - config.min_size + 1;
+
+    message_packet batch[BENCH_BATCH];
+    memset(batch, 0, sizeof(batch));
+    for(size_t sent=0; sent<config.messages;){
+        size_t count = config.messages - sent < BENCH_BATCH ? config.messages - sent : BENCH_BATCH;
+        for(size_t i=0;i<count;i++){
+            size_t size = config.min_size + (size_t)rand_r(&seed) % spread;
+            // Timed, for the latencies
+            batch[i].code = (u8)ID_SEND_TIMED_MSG_SERVER;
+            char* text = message_text(&batch[i]);
+            memset(text, 'x', size);
+            text[size] = '\0';
+            message_times(&batch[i])->sent_ns = message_clock_ns();
+        }
+
+        ssize_t bytes = (ssize_t)(count*sizeof(message_packet));
+        if(write(fd, batch, (size_t)bytes)!=bytes){
+            client->failed = true;
+            return NULL;
+        }
+        sent += count;
+    }
+    return NULL;
+}
+
+void* subscriber_main(void* client_void){
+    bench_client* client = client_void;
+
+    register_subscriber_packet packet;
+    write_packet_register_sub(&packet, client->pipe_name, client->box_name);
+    int fd AUTO_CLOSE_FD = open_session(&packet, sizeof(packet), client->pipe_name, O_RDONLY);
+    if(fd==-1){
+        client->failed = true;
+        return NULL;
+    }
+
+    message_packet batch[BENCH_BATCH];
+    size_t received = 0;
+    while(received<client->expected){
+        ssize_t rread = read(fd, batch, sizeof(batch));
+        if(rread<=0){
+            client->failed = true;
+            return NULL;
+        }
+
+        size_t partial = (size_t)rread%sizeof(message_packet);
+        if(partial!=0 && !read_full(fd, (u8*)batch + rread, sizeof(message_packet) - partial)){
+            client->failed = true;
+            return NULL;
+        }
+
+        u64 now = message_clock_ns();
+        if(client->first_ns==0) client->first_ns = now;
+        client->last_ns = now;
+
+        size_t count = ((size_t)rread + sizeof(message_packet) - 1)/sizeof(message_packet);
+        for(size_t i=0;i<count && received<client->expected;i++){
+            client->latencies[received++] = now - message_times(&batch[i])->sent_ns;
+        }
+    }
+    return NULL;
+}
+
+pid_t start_broker(size_t sessions){
+    pid_t broker = fork();
+    ALWAYS_ASSERT(broker!=-1, "FAILED TO FORK!");
+    if(broker==0){
+        char sessions_str[32];
+        snprintf(sessions_str, sizeof(sessions_str), "%zu", sessions);
+        execl(config.broker, "mbroker", register_pipe, sessions_str, (char*)NULL);
+        PANIC("FAILED TO START BROKER: %s (%i)", config.broker, errno);
+    }
+
+    // The register pipe shows up once the broker is ready
+    struct stat st;
+    for(int i=0; stat(register_pipe, &st)!=0; i++){
+        ALWAYS_ASSERT(i<500 && waitpid(broker, NULL, WNOHANG)==0, "BROKER DID NOT START!");
+        struct timespec pause = {0, 10000000};
+        nanosleep(&pause, NULL);
+    }
+    return broker;
+}
+
+u64 cpu_ns(const struct rusage* usage){
+    return ((u64)usage->ru_utime.tv_sec + (u64)usage->ru_stime.tv_sec)*1000000000ull +
+           ((u64)usage->ru_utime.tv_usec + (u64)usage->ru_stime.tv_usec)*1000ull;
+}
+
+int main(int argc, char** argv){
+    if(!parse_options(argc, argv)){
+        print_usage();
+        return -1;
+    }
+
+    char broker_path[PATH_MAX];
+    ALWAYS_ASSERT(realpath(config.broker, broker_path)!=NULL, "BROKER NOT FOUND: %s", config.broker);
+    config.broker = broker_path;
+
+    // The broker keeps its boxes in its working directory
+    char dir[] = "/tmp/bench_broker_XXXXXX";
+    ALWAYS_ASSERT(mkdtemp(dir)!=NULL, "FAILED TO CREATE TEMP DIR!");
+    ALWAYS_ASSERT(chdir(dir)==0, "FAILED TO ENTER TEMP DIR!");
+
+    // Every session holds a worker, plus one for the create requests
+    pid_t broker = start_broker(config.publishers + config.subscribers + 1);
+
+    for(size_t i=0;i<config.boxes;i++){
+        char box_name[MAX_BOX_NAME_LEN];
+        snprintf(box_name, sizeof(box_name), "box%zu", i);
+        ALWAYS_ASSERT(create_box(box_name), "FAILED TO CREATE %s!", box_name);
+    }
+
+    size_t n_clients = config.publishers + config.subscribers;
+    bench_client* clients = calloc(n_clients, sizeof(bench_client));
+    pthread_t* threads = calloc(n_clients, sizeof(pthread_t));
+    ALWAYS_ASSERT(clients!=NULL && threads!=NULL, "NO MEMORY!");
+
+    struct rusage self_before;
+    getrusage(RUSAGE_SELF, &self_before);
+    u64 start_ns = message_clock_ns();
+
+    // Subscribers go first, they replay whatever they missed anyway
+    size_t total_received = 0;
+    for(size_t i=0;i<n_clients;i++){
+        bench_client* client = &clients[i];
+        bool is_publisher = i>=config.subscribers;
+        size_t index = is_publisher ? i - config.subscribers : i;
+        size_t box = index%config.boxes;
+
+        client->id = i;
+        snprintf(client->pipe_name, sizeof(client->pipe_name), "%s%zu", is_publisher ? "pub" : "sub", index);
+        snprintf(client->box_name, sizeof(client->box_name), "box%zu", box);
+
+        if(!is_publisher){
+            // Publishers box, box+boxes, box+2*boxes... write to this box
+            size_t box_publishers = config.publishers/config.boxes + (box < config.publishers%config.boxes);
+            client->expected = box_publishers*config.messages;
+            client->latencies = malloc((client->expected+1)*sizeof(u64));
+            ALWAYS_ASSERT(client->latencies!=NULL, "NO MEMORY!");
+            total_received += client->expected;
+        }
+
+        ALWAYS_ASSERT(pthread_create(&threads[i], NULL, is_publisher ? publisher_main : subscriber_main, client)==0,
+            "FAILED TO SPAWN THREAD!");
+    }
+
+    bool failed = false;
+    for(size_t i=0;i<n_clients;i++){
+        pthread_join(threads[i], NULL);
+        failed = failed || clients[i].failed;
+    }
+    u64 elapsed = message_clock_ns() - start_ns;
+
+    struct rusage self_after, broker_usage;
+    getrusage(RUSAGE_SELF, &self_after);
+    kill(broker, SIGINT);
+    ALWAYS_ASSERT(waitpid(broker, NULL, 0)==broker, "FAILED TO WAIT FOR BROKER!");
+    // The broker is our only child
+    getrusage(RUSAGE_CHILDREN, &broker_usage);
+
+    u64* latencies = malloc((total_received+1)*sizeof(u64));
+    ALWAYS_ASSERT(latencies!=NULL, "NO MEMORY!");
+    size_t n = 0;
+    for(size_t i=0;i<config.subscribers;i++){
+        memcpy(latencies+n, clients[i].latencies, clients[i].expected*sizeof(u64));
+        n += clients[i].expected;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, n, sizeof(u64), cmp_u64);
+
+    size_t published = config.publishers*config.messages;
+    size_t moved = published + n;
+    double seconds = (double)elapsed/1e9;
+    fprintf(stdout, "bench=broker boxes=%zu publishers=%zu subscribers=%zu messages=%zu min_size=%zu max_size=%zu "
+                    "ok=%i seconds=%.3f published_per_s=%.0f delivered_per_s=%.0f mb_per_s=%.1f "
+                    "p50_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu "
+                    "broker_cpu_ns_per_msg=%.0f client_cpu_ns_per_msg=%.0f broker_max_rss_kb=%li\n",
+        config.boxes, config.publishers, config.subscribers, published, config.min_size, config.max_size,
+        !failed, seconds, (double)published/seconds, (double)n/seconds,
+        (double)moved*sizeof(message_packet)/1e6/seconds,
+        n>0 ? latencies[n/2] : 0, n>0 ? latencies[n*99/100] : 0,
+        n>0 ? latencies[n*999/1000] : 0, n>0 ? latencies[n-1] : 0,
+        moved>0 ? (double)cpu_ns(&broker_usage)/(double)moved : 0.0,
+        moved>0 ? (double)(cpu_ns(&self_after) - cpu_ns(&self_before))/(double)moved : 0.0,
+        broker_usage.ru_maxrss);
+
+    free(latencies);
+    free(clients);
+    free(threads);
+
+    // Leave nothing behind but the results
+    for(size_t i=0;i<config.boxes;i++){
+        char path[MAX_BOX_NAME_LEN+8];
+        snprintf(path, sizeof(path), "box%zu", i);
+        unlink(path);
+        snprintf(path, sizeof(path), "box%zu.idx", i);
+        unlink(path);
+    }
+    unlink(register_pipe);
+    ALWAYS_ASSERT(chdir("/")==0, "FAILED TO LEAVE TEMP DIR!");
+    rmdir(dir);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+#include "common.h"
+#include "protocol.h"
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Moves message_packets between two processes over a fifo and over a
+// shm_ring and reports throughput and one way latency for each of them.
+//
+// usage: bench_transport [messages]
+
+#define DEFAULT_MESSAGES 200000
+
+static int cmp_u64(const void* a, const void* b){
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return (x>y) - (x<y);
+}
+
+// Messages are timed, see message_timestamps
+static void stamp(message_packet* packet){
+    packet->code = (u8)ID_SEND_TIMED_MSG_SERVER;
+    message_times(packet)->sent_ns = message_clock_ns();
+}
+
+static u64 latency_of(message_packet* packet){
+    return message_clock_ns() - message_times(packet)->sent_ns;
+}
+
+static void report(const char* transport, u64* latencies, size_t n, u64 elapsed){
+    qsort(latencies, n, sizeof(u64), cmp_u64);
+    fprintf(stdout, "transport=%s messages=%zu msgs_per_s=%.0f mb_per_s=%.1f "
+                    "p50_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu\n",
+        transport, n,
+        (double)n*1e9/(double)elapsed,
+        (double)n*sizeof(message_packet)*1e3/(double)elapsed,
+        latencies[n/2], latencies[n*99/100], latencies[n*999/1000], latencies[n-1]);
+    fflush(stdout);
+}
+
+static void bench_fifo(size_t n){
+    char fifo_name[] = "/tmp/bench_transport_fifo_XXXXXX";
+    ALWAYS_ASSERT(mkdtemp(fifo_name)!=NULL, "FAILED TO CREATE TEMP DIR!");
+    char path[sizeof(fifo_name)+8];
+    snprintf(path, sizeof(path), "%s/fifo", fifo_name);
+    ALWAYS_ASSERT(mkfifo(path, 0600)==0, "FAILED TO CREATE FIFO!");
+
+    pid_t child = fork();
+    ALWAYS_ASSERT(child!=-1, "FAILED TO FORK!");
+
+    if(child==0){
+        OPEN_FILE_FD(fifo, path, O_RDONLY);
+        u64* latencies = malloc(n*sizeof(u64));
+        ALWAYS_ASSERT(latencies!=NULL, "NO MEMORY!");
+
+        message_packet packet;
+        u64 start = 0;
+        for(size_t i=0;i<n;i++){
+            if(read(fifo, &packet, sizeof(packet))!=sizeof(packet)) PANIC("SHORT READ!");
+            if(i==0) start = message_clock_ns();
+            latencies[i] = latency_of(&packet);
+        }
+        report("fifo", latencies, n, message_clock_ns()-start);
+        free(latencies);
+        exit(0);
+    }
+
+    {
+        OPEN_FILE_FD(fifo, path, O_WRONLY);
+        message_packet packet;
+        memset(&packet, 0, sizeof(packet));
+        for(size_t i=0;i<n;i++){
+            stamp(&packet);
+            if(write(fifo, &packet, sizeof(packet))!=sizeof(packet)) PANIC("SHORT WRITE!");
+        }
+    }
+
+    waitpid(child, NULL, 0);
+    unlink(path);
+    rmdir(fifo_name);
+}
+
+static void bench_shm(size_t n){
+    char ring_name[MAX_PIPE_NAME_LEN];
+    char pipe_name[64];
+    snprintf(pipe_name, sizeof(pipe_name), "bench_transport_%i", (int)getpid());
+    shm_ring_name(ring_name, pipe_name);
+
+    shm_ring* ring AUTO_DETACH_RING = shm_ring_create(ring_name);
+    ALWAYS_ASSERT(ring!=NULL, "FAILED TO CREATE RING!");
+
+    pid_t child = fork();
+    ALWAYS_ASSERT(child!=-1, "FAILED TO FORK!");
+
+    if(child==0){
+        // The child plays the broker's part
+        shm_ring* consumer AUTO_DETACH_RING = shm_ring_attach(ring_name);
+        ALWAYS_ASSERT(consumer!=NULL, "FAILED TO ATTACH RING!");
+        u64* latencies = malloc(n*sizeof(u64));
+        ALWAYS_ASSERT(latencies!=NULL, "NO MEMORY!");
+
+        // Takes what the ring has per wakeup, as the broker does
+        u64 start = 0;
+        for(size_t i=0;i<n;){
+            size_t count;
+            message_packet* slots = shm_ring_peek_batch(consumer, SHM_RING_SLOTS, &count);
+            if(slots==NULL) PANIC("RING CLOSED EARLY!");
+            if(i==0) start = message_clock_ns();
+            for(size_t j=0;j<count && i<n;j++, i++){
+                latencies[i] = latency_of(&slots[j]);
+            }
+            shm_ring_release_batch(consumer, count);
+        }
+        report("shm", latencies, n, message_clock_ns()-start);
+        free(latencies);
+        exit(0);
+    }
+
+    ALWAYS_ASSERT(shm_ring_wait_broker(ring, 5000)==0, "CHILD DID NOT ATTACH!");
+    for(size_t i=0;i<n;i++){
+        message_packet* slot = shm_ring_reserve(ring);
+        if(slot==NULL) PANIC("RING CLOSED EARLY!");
+        stamp(slot);
+        shm_ring_commit(ring);
+    }
+    shm_ring_close(ring);
+
+    waitpid(child, NULL, 0);
+}
+
+int main(int argc, char** argv){
+    size_t n = DEFAULT_MESSAGES;
+    if(argc>2 || (argc==2 && (sscanf(argv[1], "%zu", &n)!=1 || n==0))){
+        fprintf(stderr, "usage: bench_transport [messages]\n");
+        return -1;
+    }
+
+    bench_fifo(n);
+    bench_shm(n);
+
+    return 0;
+}
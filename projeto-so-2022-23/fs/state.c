@@ -305,8 +305,15 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
     ALWAYS_ASSERT(dir_entry != NULL,
                   "clear_dir_entry: directory must have a data block");
 
+    char key[MAX_FILE_NAME];
+    if (!name_key_pad(key, sub_name, MAX_FILE_NAME)) {
+        return -1; // sub_name can't be in the directory
+    }
+    u32 hash = name_key_hash(key, MAX_FILE_NAME);
+
     for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
+        if (dir_entry[i].d_inumber != -1 && dir_entry[i].d_hash == hash &&
+            name_key_equal(dir_entry[i].d_name, key, MAX_FILE_NAME)) {
             dir_entry[i].d_inumber = -1;
             memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
             return 0;
@@ -349,8 +356,9 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
     for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
         if (dir_entry[i].d_inumber == -1) {
             dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+            name_key_pad(dir_entry[i].d_name, sub_name, MAX_FILE_NAME);
+            dir_entry[i].d_hash =
+                name_key_hash(dir_entry[i].d_name, MAX_FILE_NAME);
 
             return 0;
         }
@@ -386,11 +394,17 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
     ALWAYS_ASSERT(dir_entry != NULL,
                   "find_in_dir: directory inode must have a data block");
 
+    char key[MAX_FILE_NAME];
+    if (!name_key_pad(key, sub_name, MAX_FILE_NAME)) {
+        return -1; // sub_name can't be in the directory
+    }
+    u32 hash = name_key_hash(key, MAX_FILE_NAME);
+
     // Iterates over the directory entries looking for one that has the target
     // name
     for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+        if ((dir_entry[i].d_inumber != -1) && (dir_entry[i].d_hash == hash) &&
+            name_key_equal(dir_entry[i].d_name, key, MAX_FILE_NAME)) {
 
             int sub_inumber = dir_entry[i].d_inumber;
             return sub_inumber;
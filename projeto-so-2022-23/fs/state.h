@@ -2,6 +2,7 @@
 #define STATE_H
 
 #include "config.h"
+#include "name_key.h"
 #include "operations.h"
 
 #include <stdbool.h>
@@ -11,10 +12,14 @@
 
 /**
  * Directory entry
+ *
+ * d_name is zero padded (a name_key) and d_hash caches its hash, so lookups
+ * only compare the names of entries whose hashes match
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
     int d_inumber;
+    u32 d_hash;
 } dir_entry_t;
 
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
@@ -17,13 +17,15 @@ static void print_usage();
 char* commands_str[] = {
     "create",
     "remove",
-    "list"
+    "list",
+    "stats"
 };
 
 enum command {
     cmd_create,
     cmd_remove,
-    cmd_list
+    cmd_list,
+    cmd_stats
 };
 
 //#define DEBUG_MSG
@@ -36,10 +38,59 @@ void print_debug(const char* what){
 #endif
 }
 
-int msg_cmp_func(const void* m1, const void* m2){
-    list_msg_box_response_packet* msg1 = *(list_msg_box_response_packet**)m1;
-    list_msg_box_response_packet* msg2 = *(list_msg_box_response_packet**)m2;
-    return strcmp(msg1->box_name, msg2->box_name);
+// The list is sorted through an index of (name bytes, row) keys, with an
+// LSD radix sort on 8 bytes of the name at a time: the first 8, then the
+// next 8 within each run of keys that share them, and so on
+typedef struct{
+    u64 prefix;     // 8 bytes of the name, big endian so it orders like them
+    u32 row;
+} list_sort_key;
+
+void sort_list_keys(list_sort_key* keys, list_sort_key* scratch, size_t n, const flat_vector* rows, size_t offset){
+    if(n<2) return;
+
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for(size_t i=0;i<n;i++){
+        const list_msg_box_response_packet* row = flat_vector_at(rows, keys[i].row);
+        u64 prefix = 0;
+        for(size_t b=0;b<8;b++) prefix = prefix<<8 | (u8)row->box_name[offset+b];
+        keys[i].prefix = prefix;
+        for(size_t b=0;b<8;b++) counts[b][(prefix>>(8*b)) & 0xFF]++;
+    }
+
+    // Least significant byte first, skipping the bytes every key shares
+    list_sort_key* from = keys;
+    list_sort_key* to = scratch;
+    for(size_t b=0;b<8;b++){
+        size_t* count = counts[b];
+        if(count[(from[0].prefix>>(8*b)) & 0xFF]==n) continue;
+
+        size_t start = 0;
+        for(size_t digit=0;digit<256;digit++){
+            size_t digit_count = count[digit];
+            count[digit] = start;
+            start += digit_count;
+        }
+        for(size_t i=0;i<n;i++){
+            to[count[(from[i].prefix>>(8*b)) & 0xFF]++] = from[i];
+        }
+        list_sort_key* swap = from;
+        from = to;
+        to = swap;
+    }
+    if(from!=keys) memcpy(keys, from, n*sizeof(list_sort_key));
+
+    if(offset+8>=MAX_BOX_NAME_LEN) return;
+    for(size_t i=0;i<n;){
+        size_t end = i+1;
+        while(end<n && keys[end].prefix==keys[i].prefix) end++;
+        // Names are zero padded, ending in a 0 means they ended here
+        if((keys[i].prefix & 0xFF)!=0){
+            sort_list_keys(keys+i, scratch+i, end-i, rows, offset+8);
+        }
+        i = end;
+    }
 }
 
 // The sig handler has to be registered
@@ -49,12 +100,40 @@ void sig_int_handler(int sig){
     return;
 }
 
-void execute_command_create(int* register_fifo, const char* pipe_name, const char* msg_box);
+// Set when the broker is reached through its socket instead of a fifo
+const char* broker_socket = NULL;
+
+int send_request(int* register_fifo, const char* pipe_name, const void* packet, size_t size);
+void execute_command_create(int* register_fifo, const char* pipe_name, const char* msg_box, const create_msg_box_packet* options);
 void execute_command_remove(int* register_fifo, const char* pipe_name, const char* msg_box);
 void execute_command_list  (int* register_fifo, const char* pipe_name);
+void execute_command_stats (int* register_fifo, const char* pipe_name);
+
+// Parses the optional retention and compression flags of the create
+// command into options
+bool parse_create_options(int argc, char** argv, create_msg_box_packet* options){
+    box_retention* retention = &options->retention;
+    memset(options, 0, sizeof(create_msg_box_packet));
+    for(int i=0;i<argc;i+=2){
+        u64* limit = NULL;
+        if(strcmp(argv[i], "--compress")==0){
+            options->compression = BOX_COMPRESSION_LZ77;
+            i--;
+            continue;
+        }else if(strcmp(argv[i], "--max-bytes")==0){
+            limit = &retention->max_bytes;
+        }else if(strcmp(argv[i], "--max-messages")==0){
+            limit = &retention->max_messages;
+        }else if(strcmp(argv[i], "--max-age")==0){
+            limit = &retention->max_age_seconds;
+        }
+        if(limit==NULL || i+1>=argc || sscanf(argv[i+1], "%lu", limit)!=1) return false;
+    }
+    return true;
+}
 
 int main(int argc, char **argv) {
-    if(!(argc==4 || argc==5)){
+    if(argc<4){
         print_usage();
         return -1;
     }
@@ -78,22 +157,33 @@ int main(int argc, char **argv) {
         }
     }
 
+    create_msg_box_packet options;
+
     // Verify that the correct number of argc is present for each command
-    if(command == -1 || ((command==cmd_create || command==cmd_remove) && argc!=5) || (command == cmd_list && argc!=4)){
+    if(command == -1 ||
+        (command==cmd_create && (argc<5 || !parse_create_options(argc-5, argv+5, &options))) ||
+        (command==cmd_remove && argc!=5) || (command == cmd_list && argc!=4) || (command == cmd_stats && argc!=4)){
         print_usage();
         return -1;
     }
 
     ALWAYS_ASSERT(signal(SIGINT, sig_int_handler)!=SIG_ERR, "FAILED TO REGISTER SIG HANDLER");
 
-    OPEN_FILE_FD(register_pipe, register_pipe_name, O_WRONLY);
+    int register_pipe AUTO_CLOSE_FD = -1;
 
-    ALWAYS_ASSERT(mkfifo(pipe_name, 0666)==0, "FAILED TO CREATE FIFO!");
+    if(is_broker_socket(register_pipe_name)){
+        broker_socket = register_pipe_name;
+    }else{
+        register_pipe = open(register_pipe_name, O_WRONLY);
+        ALWAYS_ASSERT(register_pipe!=-1, "FAILED TO OPEN FILE: %s (%i)", register_pipe_name, errno);
+
+        ALWAYS_ASSERT(mkfifo(pipe_name, 0666)==0, "FAILED TO CREATE FIFO!");
+    }
 
 
     switch (command){
     case cmd_create:
-        execute_command_create(&register_pipe, pipe_name, argv[4]);
+        execute_command_create(&register_pipe, pipe_name, argv[4], &options);
         break;
     case cmd_remove:
         execute_command_remove(&register_pipe, pipe_name, argv[4]);
@@ -101,6 +191,9 @@ int main(int argc, char **argv) {
     case cmd_list:
         execute_command_list(&register_pipe, pipe_name);
         break;
+    case cmd_stats:
+        execute_command_stats(&register_pipe, pipe_name);
+        break;
     default:
         fprintf(stdout, "Unkown command: %s\n", cmd);
         print_usage();
@@ -115,21 +208,26 @@ int main(int argc, char **argv) {
 void print_usage() {
     fprintf(stderr, "usage: \n"
                     "   manager <register_pipe_name> <pipe_name> create <box_name>\n"
+                    "           [--max-bytes <n>] [--max-messages <n>] [--max-age <seconds>] [--compress]\n"
                     "   manager <register_pipe_name> <pipe_name> remove <box_name>\n"
-                    "   manager <register_pipe_name> <pipe_name> list\n");
+                    "   manager <register_pipe_name> <pipe_name> list\n"
+                    "   manager <register_pipe_name> <pipe_name> stats\n");
 }
 
 
-void execute_command_create(int* register_fifo, const char* pipe_name, const char* msg_box){
-    fprintf(stdout, "run create box command!\n");
-    create_msg_box_packet packet;
-    write_packet_create(&packet, pipe_name, msg_box);
+// Sends a request to the broker, and returns the channel the answer comes on
+int send_request(int* register_fifo, const char* pipe_name, const void* packet, size_t size){
+    if(broker_socket!=NULL){
+        int connection = connect_broker_socket(broker_socket, packet, size);
+        ALWAYS_ASSERT(connection!=-1, "ERROR WRITING PACKET TO BROKER!");
+        return connection;
+    }
 
-    if(write(*register_fifo, &packet, sizeof(packet))!=sizeof(packet)){
+    if(write(*register_fifo, packet, size)!=size){
         PANIC("ERROR WRITING PACKET TO BROKER!");
     }
 
-    int own_fifo AUTO_CLOSE_FD = open(pipe_name, O_RDONLY);
+    int own_fifo = open(pipe_name, O_RDONLY);
 
     unlink(pipe_name);
 
@@ -139,6 +237,18 @@ void execute_command_create(int* register_fifo, const char* pipe_name, const cha
         }
         PANIC("FAILED TO OPEN OWN FIFO!\n");
     }
+
+    return own_fifo;
+}
+
+void execute_command_create(int* register_fifo, const char* pipe_name, const char* msg_box, const create_msg_box_packet* options){
+    fprintf(stdout, "run create box command!\n");
+    create_msg_box_packet packet;
+    write_packet_create(&packet, pipe_name, msg_box);
+    packet.retention = options->retention;
+    packet.compression = options->compression;
+
+    int own_fifo AUTO_CLOSE_FD = send_request(register_fifo, pipe_name, &packet, sizeof(packet));
     
     response_create_msg_box_packet response_packet;
     
@@ -167,20 +277,7 @@ void execute_command_remove(int* register_fifo, const char* pipe_name, const cha
     remove_msg_box_packet packet;
     write_packet_remove(&packet, pipe_name, msg_box);
 
-    if(write(*register_fifo, &packet, sizeof(packet))!=sizeof(packet)){
-        PANIC("ERROR WRITING PACKET TO BROKER!");
-    }
-
-    int own_fifo AUTO_CLOSE_FD = open(pipe_name, O_RDONLY);
-    
-    unlink(pipe_name);
-
-    if(own_fifo == -1){
-        if(errno == EINTR){
-            exit(0);
-        }
-        PANIC("FAILED TO OPEN OWN FIFO!\n");
-    }
+    int own_fifo AUTO_CLOSE_FD = send_request(register_fifo, pipe_name, &packet, sizeof(packet));
     
     response_create_msg_box_packet response_packet;
     
@@ -214,38 +311,23 @@ void execute_command_list(int* register_fifo, const char* pipe_name){
     strcpy(packet.client_named_pipe, pipe_name);
 
 
-    if(write(*register_fifo, &packet, sizeof(packet))!=sizeof(packet)){
-        PANIC("ERROR WRITING PACKET TO BROKER!");
-    }
-
-    int own_fifo AUTO_CLOSE_FD = open(pipe_name, O_RDONLY);
-    
-    unlink(pipe_name);
-
-    if(own_fifo == -1){
-        if(errno == EINTR){
-            exit(0);
-        }
-        PANIC("FAILED TO OPEN OWN FIFO!\n");
-    }
-
-    list_msg_box_response_packet* response_packet = NULL;
-    
-    vector v __attribute__((cleanup(vector_destory)));
-    vector_create(&v, 5);
+    int own_fifo AUTO_CLOSE_FD = send_request(register_fifo, pipe_name, &packet, sizeof(packet));
 
-    do{
-        response_packet = malloc(sizeof(list_msg_box_response_packet));
-        ALWAYS_ASSERT(response_packet!=NULL, "NO MEMORY!");
-        
-        vector_push(&v, response_packet);
+    // Rows are read a batch at a time straight into the vector, and a read
+    // may end partway through a row, which the next one finishes
+    flat_vector rows __attribute__((cleanup(flat_vector_destroy)));
+    flat_vector_create(&rows, sizeof(list_msg_box_response_packet), LIST_BATCH_ROWS);
+    size_t partial = 0;
+    bool last = false;
 
-        ssize_t fifo_read = read(own_fifo, response_packet, sizeof(list_msg_box_response_packet));
+    while(!last){
+        char* batch = flat_vector_reserve(&rows, LIST_BATCH_ROWS);
+        ssize_t fifo_read = read(own_fifo, batch+partial, LIST_BATCH_ROWS*sizeof(list_msg_box_response_packet)-partial);
 
         if(fifo_read == 0){
             print_debug("SERVER DISCONNECTED!\n");
             return;
-        }else if(fifo_read==-1 || fifo_read!=sizeof(list_msg_box_response_packet)){
+        }else if(fifo_read==-1){
             if(errno == EINTR){
                 print_debug("DISCONNECTED!\n");
                 exit(0);
@@ -254,21 +336,64 @@ void execute_command_list(int* register_fifo, const char* pipe_name){
             return;
         }
 
-        if(response_packet->box_name[0]=='\0' && response_packet->is_last){
-            fprintf(stdout, "NO BOXES FOUND\n");
-            return;
+        size_t bytes = partial + (size_t)fifo_read;
+        size_t count = bytes/sizeof(list_msg_box_response_packet);
+        partial = bytes%sizeof(list_msg_box_response_packet);
+        for(size_t i=0;i<count && !last;i++){
+            list_msg_box_response_packet* row = (list_msg_box_response_packet*)batch + i;
+            if(row->box_name[0]=='\0' && row->is_last){
+                fprintf(stdout, "NO BOXES FOUND\n");
+                return;
+            }
+            last = row->is_last;
         }
-        
-    }while(!response_packet->is_last);
+        rows.size += count;
+    }
 
-    vector_sort(&v, msg_cmp_func);
+    list_sort_key* keys = malloc(2*rows.size*sizeof(list_sort_key));
+    ALWAYS_ASSERT(keys!=NULL, "NO MEMORY!");
+    for(size_t i=0;i<rows.size;i++) keys[i].row = (u32)i;
+    sort_list_keys(keys, keys+rows.size, rows.size, &rows, 0);
 
-    for(int i=0;i<v.size;i++){
-        list_msg_box_response_packet* curr = (list_msg_box_response_packet*)v.buff[i];
+    for(size_t i=0;i<rows.size;i++){
+        list_msg_box_response_packet* curr = flat_vector_at(&rows, keys[i].row);
         fprintf(stdout, "%s %zu %zu %zu\n",
             curr->box_name,
             curr->box_size,
             curr->n_publishers,
             curr->n_subscribers);
     }
-}
\ No newline at end of file
+    free(keys);
+}
+
+void execute_command_stats(int* register_fifo, const char* pipe_name){
+    stats_packet packet;
+    memset(&packet, 0, sizeof(packet));
+
+    packet.code = (u8)ID_STATS;
+
+    strcpy(packet.client_named_pipe, pipe_name);
+
+    int own_fifo AUTO_CLOSE_FD = send_request(register_fifo, pipe_name, &packet, sizeof(packet));
+
+    stats_response_packet response_packet;
+
+    do{
+        ssize_t fifo_read = read(own_fifo, &response_packet, sizeof(response_packet));
+
+        if(fifo_read == 0){
+            print_debug("SERVER DISCONNECTED!\n");
+            return;
+        }else if(fifo_read==-1 || fifo_read!=sizeof(response_packet)){
+            if(errno == EINTR){
+                print_debug("DISCONNECTED!\n");
+                exit(0);
+            }
+            PANIC("UNKNOWN ERROR OCURRED!\n");
+            return;
+        }
+
+        response_packet.line[STATS_LINE_LEN-1] = '\0';
+        fprintf(stdout, "%s\n", response_packet.line);
+    }while(!response_packet.is_last);
+}
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "box_index.h"
+#include "protocol.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+void box_index_path(char* path, size_t size, const char* box_name){
+    snprintf(path, size, "%s.idx", box_name);
+}
+
+static void push_entry(box_index* index, box_index_entry entry){
+    if(index->n_entries == index->capacity){
+        size_t capacity = index->capacity==0 ? 16 : index->capacity*2;
+        index->entries = realloc(index->entries, capacity*sizeof(box_index_entry));
+        ALWAYS_ASSERT(index->entries!=NULL, "NO MEMORY!");
+        index->capacity = capacity;
+    }
+    index->entries[index->n_entries++] = entry;
+}
+
+// Size of the record starting at offset, or -1 past the end of the box
+static ssize_t record_len_at(int fd, u64 offset){
+    box_record_header header;
+    ssize_t got = pread(fd, &header, sizeof(header), (off_t)offset);
+    if(got<=0) return -1;
+    if(header.code!=BOX_RECORD_COMPRESSED) return id_size_lookup(header.code);
+    if(got!=sizeof(header)) return -1;
+    return (ssize_t)(sizeof(header) + header.bytes);
+}
+
+int box_index_open(box_index* index, const char* box_name, int box_fd, bool truncate){
+    char path[MAX_BOX_NAME_LEN+8];
+    box_index_path(path, sizeof(path), box_name);
+
+    memset(index, 0, sizeof(box_index));
+
+    index->fd = open(path, O_RDWR | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+    if(index->fd==-1) return -1;
+
+    // Dropped entries were punched out of the file and read back as zeros
+    box_index_entry entry;
+    while(read(index->fd, &entry, sizeof(entry))==sizeof(entry)){
+        if(entry.time==0 && index->n_entries==0){
+            index->dropped++;
+            continue;
+        }
+        push_entry(index, entry);
+    }
+
+    // Recover the messages after the last entry by scanning the box
+    if(index->n_entries>0){
+        index->messages = (index->dropped + index->n_entries - 1)*BOX_INDEX_INTERVAL;
+        index->end = index->entries[index->n_entries-1].offset;
+    }
+    ssize_t record_len;
+    while((record_len = record_len_at(box_fd, index->end))>0){
+        if(index->messages % BOX_INDEX_INTERVAL == 0 &&
+            index->messages/BOX_INDEX_INTERVAL >= index->dropped + index->n_entries){
+            box_index_append(index, (size_t)record_len);
+        }else{
+            index->messages++;
+            index->end += (u64)record_len;
+        }
+    }
+
+    return 0;
+}
+
+void box_index_close(box_index* index, const char* box_name, bool unlink_file){
+    close_fd(&index->fd);
+    free(index->entries);
+    index->entries = NULL;
+    index->n_entries = index->capacity = 0;
+
+    if(unlink_file){
+        char path[MAX_BOX_NAME_LEN+8];
+        box_index_path(path, sizeof(path), box_name);
+        unlink(path);
+    }
+}
+
+void box_index_append(box_index* index, size_t record_len){
+    if(index->messages % BOX_INDEX_INTERVAL == 0){
+        box_index_entry entry = { index->end, (u64)time(NULL) };
+        push_entry(index, entry);
+        ssize_t _temp_ = write(index->fd, &entry, sizeof(entry));
+        (void) _temp_;
+    }
+    index->messages++;
+    index->end += record_len;
+}
+
+u64 box_index_first(const box_index* index){
+    return index->dropped*BOX_INDEX_INTERVAL;
+}
+
+u64 box_index_head(const box_index* index){
+    return index->n_entries>0 ? index->entries[0].offset : index->end;
+}
+
+u64 box_index_lookup(const box_index* index, int fd, u64 seq){
+    if(seq>=index->messages) return index->end;
+    if(seq<box_index_first(index)) seq = box_index_first(index);
+
+    u64 offset = index->entries[seq/BOX_INDEX_INTERVAL - index->dropped].offset;
+
+    // Walk the records between the entry and the message
+    for(u64 i=seq - seq%BOX_INDEX_INTERVAL; i<seq; i++){
+        ssize_t record_len = record_len_at(fd, offset);
+        if(record_len<=0) return index->end;
+        offset += (u64)record_len;
+    }
+    return offset;
+}
+
+bool box_index_drop_head(box_index* index, int box_fd){
+    if(index->n_entries<2) return false;
+
+    // Offsets stay valid, the space is only given back to the file system
+    u64 from = index->entries[0].offset, to = index->entries[1].offset;
+    fallocate(box_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)from, (off_t)(to-from));
+    fallocate(index->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        (off_t)(index->dropped*sizeof(box_index_entry)), sizeof(box_index_entry));
+
+    memmove(index->entries, index->entries+1, (index->n_entries-1)*sizeof(box_index_entry));
+    index->n_entries--;
+    index->dropped++;
+    return true;
+}
+
+size_t box_index_trim(box_index* index, int box_fd, const box_retention* retention, u64 keep_from, u64 now){
+    size_t dropped = 0;
+    while(index->n_entries>=2 && index->entries[1].offset<=keep_from){
+        // What the box holds past the head segment: a limit only gives the
+        // segment away if that alone still meets it
+        u64 bytes_left = index->end - index->entries[1].offset;
+        u64 messages_left = index->messages - (index->dropped+1)*BOX_INDEX_INTERVAL;
+        bool droppable =
+            (retention->max_bytes!=0 && bytes_left>=retention->max_bytes) ||
+            (retention->max_messages!=0 && messages_left>=retention->max_messages) ||
+            // entries[1] is newer than anything in the head segment
+            (retention->max_age_seconds!=0 && now-index->entries[1].time>retention->max_age_seconds);
+        if(!droppable || !box_index_drop_head(index, box_fd)) break;
+        dropped++;
+    }
+    return dropped;
+}
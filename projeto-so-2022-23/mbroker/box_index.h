@@ -0,0 +1,87 @@
+#pragma once
+
+#include "common.h"
+#include "protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// One index entry is kept every BOX_INDEX_INTERVAL messages
+#define BOX_INDEX_INTERVAL 64
+
+// Compressed boxes store a message as this header followed by the
+// message_packet compressed with lz77, unless it doesn't come out smaller.
+// Every other record is a packet from protocol.h, sized by its code
+#define BOX_RECORD_COMPRESSED 0xC0
+
+#pragma pack(push, 1)
+typedef struct {
+    u8 code;
+    u16 bytes;  // compressed bytes that follow
+} box_record_header;
+#pragma pack(pop)
+
+typedef struct {
+    u64 offset; // byte offset of the entry's message in the box file
+    u64 time;   // when the message was appended (seconds since the epoch)
+} box_index_entry;
+
+// Sparse message index of a box: maps the sequence number of every
+// BOX_INDEX_INTERVAL-th message to its byte offset in the box file.
+// Looking up any other message is the entry before it plus a short scan
+// over the record headers in between, so boxes can hold records of
+// different sizes.
+//
+// The messages between two entries form a segment, which is also the unit
+// retention drops from the head of the box (see box_index_drop_head).
+//
+// The entries are kept in memory and appended to "<box>.idx" as they are
+// created, next to the box file itself.
+typedef struct {
+    box_index_entry* entries;   // live entries, entries[0] is the head
+    size_t n_entries, capacity;
+    u64 dropped;    // entries dropped from the head so far
+    u64 messages;   // messages appended to the box, including dropped ones
+    u64 end;        // byte offset right after the last message
+    int fd;         // the persisted copy of the entries
+} box_index;
+
+// box_index_path: name of the file the index of a box is persisted to
+void box_index_path(char* path, size_t size, const char* box_name);
+
+// box_index_open: open and load the persisted index of a box, scanning the
+// messages in box_fd past its last entry
+//
+// With truncate set, starts a new empty index instead
+int box_index_open(box_index* index, const char* box_name, int box_fd, bool truncate);
+
+// box_index_close: release the index, removing its file if unlink_file is set
+void box_index_close(box_index* index, const char* box_name, bool unlink_file);
+
+// box_index_append: account for a message of record_len bytes appended at
+// the end of the box
+void box_index_append(box_index* index, size_t record_len);
+
+// box_index_lookup: byte offset of message seq in the box read through fd
+//
+// Messages that were dropped map to the head, and seq past index->messages
+// maps to index->end
+u64 box_index_lookup(const box_index* index, int fd, u64 seq);
+
+// box_index_first: sequence number of the oldest message still in the box
+u64 box_index_first(const box_index* index);
+
+// box_index_head: byte offset of the oldest message still in the box
+u64 box_index_head(const box_index* index);
+
+// box_index_drop_head: drop the oldest segment, releasing its disk space
+// in both the box and index files
+//
+// Only complete segments are dropped, returns false if there is none
+bool box_index_drop_head(box_index* index, int box_fd);
+
+// box_index_trim: drop head segments, see box_index_drop_head, while the
+// rest of the box is still within the retention limits without them and
+// they end at or before keep_from (what subscribers have yet to read).
+// Returns how many were dropped
+size_t box_index_trim(box_index* index, int box_fd, const box_retention* retention, u64 keep_from, u64 now);
@@ -0,0 +1,124 @@
+#include "box_trie.h"
+
+#include <stdlib.h>
+
+static box_trie_node* find_child(box_trie_node* node, char c){
+    for(box_trie_node* it=node->children;it!=NULL;it=it->sibling){
+        if(it->c==c) return it;
+    }
+    return NULL;
+}
+
+void box_trie_insert(box_trie* trie, const char* name, size_t len, void* value){
+    box_trie_node* node = &trie->root;
+    for(size_t i=0;i<len;i++){
+        box_trie_node* child = find_child(node, name[i]);
+        if(child==NULL){
+            child = calloc(1, sizeof(box_trie_node));
+            ALWAYS_ASSERT(child!=NULL, "NO MEMORY!");
+            child->c = name[i];
+            child->sibling = node->children;
+            node->children = child;
+        }
+        node = child;
+    }
+
+    box_trie_value* entry = malloc(sizeof(box_trie_value));
+    ALWAYS_ASSERT(entry!=NULL, "NO MEMORY!");
+    entry->value = value;
+    entry->next = node->values;
+    node->values = entry;
+}
+
+// Removes value below node and frees the nodes left empty on the way back up
+static bool remove_below(box_trie_node* node, const char* name, size_t len, void* value){
+    if(len==0){
+        for(box_trie_value** it=&node->values;*it!=NULL;it=&(*it)->next){
+            if((*it)->value==value){
+                box_trie_value* entry = *it;
+                *it = entry->next;
+                free(entry);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    for(box_trie_node** it=&node->children;*it!=NULL;it=&(*it)->sibling){
+        box_trie_node* child = *it;
+        if(child->c!=name[0]) continue;
+
+        bool removed = remove_below(child, name+1, len-1, value);
+        if(child->values==NULL && child->children==NULL){
+            *it = child->sibling;
+            free(child);
+        }
+        return removed;
+    }
+    return false;
+}
+
+bool box_trie_remove(box_trie* trie, const char* name, size_t len, void* value){
+    return remove_below(&trie->root, name, len, value);
+}
+
+static void visit_values(box_trie_node* node, box_trie_visit_fn visit, void* context){
+    // The visit may be what removes the value
+    box_trie_value* next;
+    for(box_trie_value* it=node->values;it!=NULL;it=next){
+        next = it->next;
+        visit(it->value, context);
+    }
+}
+
+void box_trie_visit_prefixes(box_trie* trie, const char* name, box_trie_visit_fn visit, void* context){
+    box_trie_node* node = &trie->root;
+    visit_values(node, visit, context);
+    for(size_t i=0;name[i]!='\0' && node!=NULL;i++){
+        node = find_child(node, name[i]);
+        if(node!=NULL) visit_values(node, visit, context);
+    }
+}
+
+static void visit_subtree(box_trie_node* node, box_trie_visit_fn visit, void* context){
+    visit_values(node, visit, context);
+    for(box_trie_node* it=node->children;it!=NULL;it=it->sibling){
+        visit_subtree(it, visit, context);
+    }
+}
+
+void box_trie_visit_below(box_trie* trie, const char* prefix, size_t len, box_trie_visit_fn visit, void* context){
+    box_trie_node* node = &trie->root;
+    for(size_t i=0;i<len && node!=NULL;i++){
+        node = find_child(node, prefix[i]);
+    }
+    if(node!=NULL) visit_subtree(node, visit, context);
+}
+
+size_t box_pattern_prefix(const char* pattern){
+    size_t len = 0;
+    while(pattern[len]!='\0' && pattern[len]!='*' && pattern[len]!='?') len++;
+    return len;
+}
+
+bool box_pattern_matches(const char* pattern, const char* name){
+    // Backtracks to the last '*' only, which is enough for globs
+    const char* star = NULL;
+    const char* resume = NULL;
+    while(*name!='\0'){
+        if(*pattern=='*'){
+            star = pattern++;
+            resume = name;
+        }else if(*pattern=='?' || *pattern==*name){
+            pattern++;
+            name++;
+        }else if(star!=NULL){
+            pattern = star+1;
+            name = ++resume;
+        }else{
+            return false;
+        }
+    }
+    while(*pattern=='*') pattern++;
+    return *pattern=='\0';
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Patterns over box names: '*' matches any run of characters, '?' any
+// single one, everything else only itself. "sensors/*" is a prefix pattern
+typedef struct box_trie_value{
+    void* value;
+    struct box_trie_value* next;
+} box_trie_value;
+
+typedef struct box_trie_node{
+    char c;
+    struct box_trie_node* children;
+    struct box_trie_node* sibling;
+    box_trie_value* values;     // stored under the name spelled out down to here
+} box_trie_node;
+
+// Trie over box names, or name prefixes, each node holding the values
+// stored under the name that leads to it. The broker keeps the boxes in
+// one, by name, and the pattern subscriptions in another, by the literal
+// prefix of their pattern, so it only ever looks at the part of either
+// that a new pattern or a new box could match. Not thread safe
+typedef struct{
+    box_trie_node root;
+} box_trie;
+
+typedef void (*box_trie_visit_fn)(void* value, void* context);
+
+// box_trie_insert: store value under the first len characters of name
+void box_trie_insert(box_trie* trie, const char* name, size_t len, void* value);
+
+// box_trie_remove: remove value from under the first len characters of
+// name, returns false if it wasn't there
+bool box_trie_remove(box_trie* trie, const char* name, size_t len, void* value);
+
+// box_trie_visit_prefixes: visit the values stored under every prefix of
+// name, name itself included
+void box_trie_visit_prefixes(box_trie* trie, const char* name, box_trie_visit_fn visit, void* context);
+
+// box_trie_visit_below: visit the values stored under every name that
+// starts with the first len characters of prefix
+void box_trie_visit_below(box_trie* trie, const char* prefix, size_t len, box_trie_visit_fn visit, void* context);
+
+// box_pattern_prefix: how many characters the pattern starts with before
+// its first wildcard
+size_t box_pattern_prefix(const char* pattern);
+
+// box_pattern_matches: whether name matches the whole of pattern
+bool box_pattern_matches(const char* pattern, const char* name);
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool handoff_path(char* path, size_t size, const char* pipe_name){
+    int len = snprintf(path, size, "%s" HANDOFF_SUFFIX, pipe_name);
+    return len>0 && (size_t)len<size;
+}
+
+static struct sockaddr_un socket_address(const char* path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    return addr;
+}
+
+int handoff_listen(const char* path){
+    struct sockaddr_un addr = socket_address(path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock==-1) return -1;
+
+    // Whoever connects is handed every session, the socket is created 0600.
+    // One left behind by a broker that didn't exit cleanly is replaced
+    unlink(path);
+    mode_t mask = umask(0077);
+    int bound = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if(bound!=0 || listen(sock, 1)!=0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int handoff_connect(const char* path){
+    struct sockaddr_un addr = socket_address(path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock==-1) return -1;
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr))!=0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+typedef union {
+    char buffer[CMSG_SPACE(sizeof(int)*HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+} fd_control;
+
+bool handoff_send(int channel, const handoff_record* record, const int* fds, size_t n_fds){
+    ALWAYS_ASSERT(n_fds<=HANDOFF_MAX_FDS, "TOO MANY FDS FOR A HANDOFF RECORD!");
+    struct iovec iov = { (void*)record, sizeof(*record) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    fd_control control;
+    if(n_fds>0){
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int)*n_fds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int)*n_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*n_fds);
+    }
+    return sendmsg(channel, &msg, MSG_NOSIGNAL)==(ssize_t)sizeof(*record);
+}
+
+bool handoff_recv(int channel, handoff_record* record, int* fds, size_t* n_fds){
+    struct iovec iov = { record, sizeof(*record) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    fd_control control;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    *n_fds = 0;
+    ssize_t got = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if(got<0) return false;
+
+    for(struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg);cmsg!=NULL;cmsg=CMSG_NXTHDR(&msg, cmsg)){
+        if(cmsg->cmsg_level!=SOL_SOCKET || cmsg->cmsg_type!=SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+        memcpy(fds + *n_fds, CMSG_DATA(cmsg), sizeof(int)*count);
+        *n_fds += count;
+    }
+
+    if(got!=(ssize_t)sizeof(*record) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))){
+        for(size_t i=0;i<*n_fds;i++) close(fds[i]);
+        *n_fds = 0;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+#include "protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+// Hot restart: a new broker started with MBROKER_TAKEOVER set connects to
+// the handoff socket of the one running, "<register pipe>.handoff", and is
+// sent everything it needs to carry on in its place, a record at a time
+// with the fds that go with it. The running broker first parks its
+// sessions between two batches, so the new one picks each of them up right
+// where it was left, and exits once the new broker acknowledged the last
+// record. Nothing a client sent is lost on the way: what wasn't read yet
+// is still in the client's end, which the new broker reads from next.
+//
+// Records are only ever exchanged between brokers of the same build
+#define HANDOFF_SUFFIX ".handoff"
+#define HANDOFF_PATH_LEN sizeof(((struct sockaddr_un*)0)->sun_path)
+
+// Most fds sent along with a record
+#define HANDOFF_MAX_FDS 4
+
+enum HandoffKind {
+    HANDOFF_BROKER=1,   // register pipe read and write ends, the handoff socket, the socket listener if any
+    HANDOFF_BOX,        // the box file
+    HANDOFF_PUBLISHER,  // the client's end, and its credit pipe if it's a named pipe one with flow control
+    HANDOFF_SUBSCRIBER, // the client's end
+    HANDOFF_DONE        // no records left, sent back by the new broker once it has them all
+};
+
+typedef struct {
+    u8 kind;
+    u8 is_socket;
+    u8 compression;
+    u8 lag_policy;
+    u32 box_id;         // of the box, for HANDOFF_BROKER the next one to give out
+    u32 credit_window;
+    u32 owed_credits;   // for messages taken in and not credited back yet
+    u64 seq;            // next message of a subscriber
+    u64 lag_budget;
+    box_retention retention;
+    char box_name[MAX_BOX_NAME_LEN];
+    char client_named_pipe[MAX_PIPE_NAME_LEN];
+} handoff_record;
+
+// handoff_path: name of the handoff socket of the broker of pipe_name,
+// returns false if it doesn't fit in size bytes
+bool handoff_path(char* path, size_t size, const char* pipe_name);
+
+// handoff_listen: bind and listen on the handoff socket, which only the
+// broker's own user can connect to. Returns the socket or -1
+int handoff_listen(const char* path);
+
+// handoff_connect: connect to the handoff socket of a running broker
+int handoff_connect(const char* path);
+
+// handoff_send: send a record along with n_fds fds, at most HANDOFF_MAX_FDS
+bool handoff_send(int channel, const handoff_record* record, const int* fds, size_t n_fds);
+
+// handoff_recv: receive a record and the fds that came with it, which are
+// close on exec. Returns false on errors, with no fds then
+bool handoff_recv(int channel, handoff_record* record, int* fds, size_t* n_fds);
@@ -1,6 +1,16 @@
+#define _GNU_SOURCE
 #include "common.h"
-#include "producer-consumer.h"
 #include "protocol.h"
+#include "shm_ring.h"
+#include "box_index.h"
+#include "stats.h"
+#include "worker_pool.h"
+#include "uring.h"
+#include "box_trie.h"
+#include "lz77.h"
+#include "name_key.h"
+#include "hash_map.h"
+#include "handoff.h"
 
 #include <sys/stat.h>
 #include <stdio.h>
@@ -10,264 +20,2033 @@
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
-
-typedef struct{
+#include <sched.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <stdarg.h>
+#include <time.h>
+
+// How many packets a session moves per syscall when batching
+#define SESSION_BATCH 32
+
+// Lag budget of subscribers that don't ask for one, in messages
+#define SUB_DEFAULT_LAG_BUDGET 65536
+
+// A subscriber whose end stays full is polled in SUB_POLL_MS steps, and
+// disconnected after SUB_STALL_TIMEOUT_MS without taking a single byte
+#define SUB_POLL_MS 100
+#define SUB_STALL_TIMEOUT_MS 30000
+
+// How long a client has to open its end of its named pipe once it has
+// registered, MBROKER_HANDSHAKE_MS overrides it. Until then the broker
+// checks back, starting HANDSHAKE_RETRY_MIN_US later and backing off
+#define HANDSHAKE_TIMEOUT_MS 2000
+#define HANDSHAKE_RETRY_MIN_US 100
+#define HANDSHAKE_RETRY_MAX_US 20000
+
+// How many times a publisher polls for the commits before its own one
+// before yielding the cpu to them
+#define BOX_COMMIT_SPIN 256
+
+// Largest credit window a flow controlled publisher is granted, in messages
+#define PUB_MAX_CREDIT_WINDOW 4096
+
+// The worker pool grows from WORKERS_MIN threads up to max_sessions, see
+// worker_pool.h. MBROKER_MIN_WORKERS, MBROKER_WORKER_IDLE_MS and
+// MBROKER_WORKER_STACK_KB override these
+#define WORKERS_MIN 2
+#define WORKERS_IDLE_MS 10000
+#define WORKERS_STACK_KB 256
+
+// Control requests (create, remove, list, stats) run on a few workers of
+// their own, so they never wait behind sessions, which hold a session
+// worker for as long as they last. MBROKER_CONTROL_WORKERS overrides it
+#define CONTROL_WORKERS 2
+#define CONTROL_QUEUE 64
+
+// A broker draining or handing off gives its sessions DRAIN_TIMEOUT_MS to
+// stop, nudging them every DRAIN_POLL_MS. MBROKER_DRAIN_MS overrides it
+#define DRAIN_TIMEOUT_MS 5000
+#define DRAIN_POLL_MS 10
+
+// Boxes with an age limit have their expired messages dropped at least
+// every RETENTION_SWEEP_MS, even while nobody publishes to or reads them
+#define RETENTION_SWEEP_MS 1000
+
+typedef struct unknown_packet{
     u8 id;
     void* packet_data;
+    int connection; // accepted socket, -1 when the client uses a named pipe
+    u64 received_ns;
+    int client_fd;      // the client's named pipe, opened by the handshake
+    u64 deadline_ns;    // for the handshake
+    // Sessions another broker handed over, see resume_session
+    bool resumed;
+    int credit_fd;
+    u32 owed_credits;
+    struct unknown_packet* next;    // in the handshake list or admission queue
 } unknown_packet;
 
 pthread_mutex_t messages_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// Where a subscriber session is in its box, retention never drops
+// messages at or after the slowest cursor
+typedef struct subscriber_cursor{
+    u64 offset;
+    u64 seq;        // sequence number of the next message to deliver
+    u64 lag;        // messages behind the end of the box, as of the last delivery
+    u64 dropped;    // messages skipped by the lag policy
+    u8 lag_policy;
+    u64 lag_budget;
+    struct subscriber_cursor* next;
+} subscriber_cursor;
+
+typedef struct publisher_session{
+    u64 messages;
+    pthread_t thread;   // interrupted by kick_sessions
+    struct publisher_session* next;
+} publisher_session;
+
 // Built in simple linked list
+//
+// Publishers append by reserving space past tail with a fetch-add and
+// copying into it in parallel. The copies are then committed in
+// reservation order, committed being the end of what subscribers may read
 typedef struct message_box{
-    char name[MAX_BOX_NAME_LEN];
-    u64 publishers, subscribers, size;
-    int fd_internal_w;
+    char name[MAX_BOX_NAME_LEN];    // zero padded, a name_key
+    u32 name_hash;
+    u32 id;     // tags the box's messages to pattern subscribers
+    u64 publishers, subscribers;
+    _Atomic u64 tail, committed;
+    _Atomic bool timed;     // whether any of its messages is timed, see record_deliveries
+    int fd_internal;
+    box_retention retention;
+    u8 compression;     // enum BoxCompression
+    // guarded by wait_mutex
+    box_index index;
+    subscriber_cursor* cursors;
+    publisher_session* sessions;
+    struct pattern_box* watchers;   // pattern sessions the box belongs to
     struct message_box* next;
+    struct message_box* previous;
     pthread_cond_t write_wait;
+    pthread_cond_t room_wait;   // publishers waiting for subscribers to drain
     pthread_mutex_t wait_mutex;
 } message_box;
 
-void add_msg_box(const char* name);
+// A box a pattern subscription matched, with the session's cursor in it
+typedef struct pattern_box{
+    message_box* msg;
+    struct pattern_session* session;
+    int fd;
+    subscriber_cursor cursor;
+    struct pattern_box* next;           // in the session's list
+    struct pattern_box* next_watcher;   // in the box's watchers
+} pattern_box;
+
+// A subscriber of every box whose name matches its pattern. New boxes are
+// matched by whoever creates them, and handed over to the session's worker
+// through added
+typedef struct pattern_session{
+    const register_subscriber_pattern_packet* request;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // guarded by lock
+    u64 doorbell;           // rung on commits to any of its boxes
+    pattern_box* added;     // matched and not picked up by the worker yet
+} pattern_session;
+
+bool box_name_matches(const void* box, const void* key);
+void add_msg_box(const char* name, const box_retention* retention, u8 compression);
 void remove_msg_box(const char* name);
 message_box* get_msg_box(const char* name);
 
 
+// In creation order, which is the order they're listed in
 message_box* msg_boxes = NULL;
+message_box* msg_boxes_tail = NULL;
+// The same boxes by name, guarded by messages_lock like msg_boxes
+hash_map box_registry;
+u32 next_box_id = 0;
+// Boxes by name, and pattern sessions by the literal prefix of their
+// pattern, guarded by messages_lock like msg_boxes
+box_trie box_names;
+box_trie pattern_sessions;
 char* pipe_name = NULL;
+char* socket_name = NULL;
+int socket_listener = -1;
+worker_pool workers;
+worker_pool control_workers;
+
+// Session requests wait here, in order, while the session pool is full, so
+// the threads reading requests never block on it and the control requests
+// read after them still get through
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admission_ready = PTHREAD_COND_INITIALIZER;
+unknown_packet* admission_head = NULL;
+unknown_packet* admission_tail = NULL;
+size_t admission_waiting = 0;
+u64 handshake_timeout_ms = HANDSHAKE_TIMEOUT_MS;
+
+// Requests of named pipe clients wait here for the handshake thread to
+// open the client's pipe, so a client that never opens its end ties up a
+// list entry until it times out instead of a worker
+pthread_mutex_t handshake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t handshake_ready = PTHREAD_COND_INITIALIZER;
+unknown_packet* handshake_incoming = NULL;
+bool admitting = false;     // a request left the queue and isn't in the pool yet
+
+// Sessions wind down at the points where they can stop once the broker
+// leaves BROKER_RUNNING, see drain_broker and hand_off_broker
+enum BrokerState {
+    BROKER_RUNNING=0,
+    BROKER_DRAINING,    // nothing new comes in, publishers take in what their clients already sent
+    BROKER_CLOSING,     // subscribers deliver what is left in their boxes and leave
+    BROKER_HANDING_OFF  // sessions park between batches, for the broker taking over
+};
+_Atomic enum BrokerState broker_state = BROKER_RUNNING;
+
+// Requests read and not finished yet, publishers also on their own
+_Atomic size_t requests_in_flight = 0;
+_Atomic size_t publishers_in_flight = 0;
+u64 drain_timeout_ms = DRAIN_TIMEOUT_MS;
+
+char handoff_name[HANDOFF_PATH_LEN];
+int handoff_listener = -1;
+pthread_t listener_thread;
+int listener_stop = -1;     // eventfd, stops the socket listener thread
+
+// A session parked for the broker taking over, with the fds it hands on
+typedef struct parked_session{
+    handoff_record record;
+    int fds[HANDOFF_MAX_FDS];
+    size_t n_fds;
+    struct parked_session* next;
+} parked_session;
+
+pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+parked_session* parked_sessions = NULL;
+// Resumed subscribers that haven't claimed their box yet, see resume_parked_sessions
+_Atomic size_t subscribers_resuming = 0;
 
 
 void print_usage();
 void process_packet(unknown_packet packet);
-void* worker_main(void* queue_void);
-
-
+bool read_register_packet(int fifo);
+unknown_packet* new_request(void* data, int connection);
+void enqueue_packet(void* data, int connection);
+void request_done(unknown_packet* packet);
+bool is_publisher_packet(u8 id);
+int client_channel(unknown_packet upacket);
+void run_packet(void* packet_void);
+bool is_control_packet(u8 id);
+const char* client_pipe(const unknown_packet* packet);
+void dispatch_packet(unknown_packet* packet);
+void* handshake_main(void* arg);
+int open_client_fifo(const char* client_named_pipe, int flags);
+void* session_admission_main(void* arg);
+void* socket_listener_main(void* arg);
+void ring_pattern_session(pattern_session* session);
+void match_new_box(void* session_void, void* msg_void);
+void insert_msg_box(const char* name, const box_retention* retention, u8 compression, u32 id, int box_fd);
+void start_listener();
+void stop_listener();
+void drain_broker(int fifo);
+void leave_broker();
+void sweep_retention();
+void hand_off_broker(int fifo, int fifo_internal);
+void take_over_broker(int* fifo, int* fifo_internal);
+void park_session(const handoff_record* record, const int* fds, size_t n_fds);
+void park_publisher(message_box* msg, const register_publisher_packet* request, bool is_socket,
+                    int connection, int credit_fifo, u32 window, u32 owed);
+void park_subscriber(message_box* msg, const register_subscriber_packet* request, bool is_socket,
+                     int connection, const subscriber_cursor* cursor);
+void resume_parked_sessions();
+
+
+// SIGINT leaves at once, SIGTERM drains the broker first (see drain_broker)
 void sig_pipe_handler(int sig){
     if(sig==SIGINT){
         if(pipe_name!=NULL)
             unlink(pipe_name);
         pipe_name=NULL;
+        if(socket_name!=NULL)
+            unlink(socket_name);
+        socket_name=NULL;
+        if(handoff_name[0]!='\0')
+            unlink(handoff_name);
     }
-    exit(0);
+    _exit(0);
+}
+
+// Only there to interrupt the syscall a session is blocked in, see kick_sessions
+void kick_session_handler(int sig){
+    (void) sig;
+}
+
+// Value of a numeric environment variable, fallback if unset or invalid
+u64 env_u64(const char* name, u64 fallback){
+    const char* value = getenv(name);
+    u64 parsed;
+    if(value==NULL || sscanf(value, "%lu", &parsed)!=1) return fallback;
+    return parsed;
 }
 
 int main(int argc, char **argv) {
     int num_sessions=0;
 
-    if(argc != 3 || sscanf(argv[2], "%i", &num_sessions)!=1 || strlen(argv[1])==0){
+    if((argc != 3 && argc != 4) || sscanf(argv[2], "%i", &num_sessions)!=1 || strlen(argv[1])==0){
         print_usage();
         return -1;
     }
 
-    ALWAYS_ASSERT(signal(SIGINT, sig_pipe_handler)!=SIG_ERR, "FAILED TO REGISTER SIGNAL HANDLER!");
+    log_level_from_env("MBROKER_LOG");
+    ALWAYS_ASSERT(signal(SIGINT, sig_pipe_handler)!=SIG_ERR, "FAILED TO REGISTER SIGNAL HANDLER!");
+
+    // No SA_RESTART, the kick has to interrupt the syscall it lands in
+    struct sigaction kick;
+    memset(&kick, 0, sizeof(kick));
+    kick.sa_handler = kick_session_handler;
+    ALWAYS_ASSERT(sigaction(SIGUSR1, &kick, NULL)==0, "FAILED TO REGISTER SIGNAL HANDLER!");
+
+    // SIGTERM is read by the main loop, every thread started from here on
+    // has it blocked
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    ALWAYS_ASSERT(pthread_sigmask(SIG_BLOCK, &term, NULL)==0, "FAILED TO BLOCK SIGTERM!");
+    int term_fd AUTO_CLOSE_FD = signalfd(-1, &term, SFD_CLOEXEC);
+    ALWAYS_ASSERT(term_fd!=-1, "FAILED TO CREATE SIGNALFD! %i", errno);
+
+    pipe_name = argv[1];
+    ALWAYS_ASSERT(handoff_path(handoff_name, sizeof(handoff_name), pipe_name), "REGISTER PIPE NAME TOO LONG!");
+    handshake_timeout_ms = env_u64("MBROKER_HANDSHAKE_MS", HANDSHAKE_TIMEOUT_MS);
+    drain_timeout_ms = env_u64("MBROKER_DRAIN_MS", DRAIN_TIMEOUT_MS);
+    hash_map_create(&box_registry, 64, box_name_matches);
+    listener_stop = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ALWAYS_ASSERT(listener_stop!=-1, "FAILED TO CREATE EVENTFD! %i", errno);
+
+    pool_config config = {
+        .min_workers = (size_t)env_u64("MBROKER_MIN_WORKERS", WORKERS_MIN),
+        .max_workers = (size_t)num_sessions,
+        .capacity = (size_t)num_sessions,
+        .idle_ms = env_u64("MBROKER_WORKER_IDLE_MS", WORKERS_IDLE_MS),
+        .stack_size = (size_t)env_u64("MBROKER_WORKER_STACK_KB", WORKERS_STACK_KB)*1024,
+    };
+    ALWAYS_ASSERT(num_sessions>0 && pool_create(&workers, &config, run_packet)==0,
+        "FAILED TO START WORKERS!");
+
+    size_t control_count = (size_t)env_u64("MBROKER_CONTROL_WORKERS", CONTROL_WORKERS);
+    pool_config control_config = {
+        .min_workers = control_count,
+        .max_workers = control_count,
+        .capacity = CONTROL_QUEUE,
+        .idle_ms = 0,
+        .stack_size = config.stack_size,
+    };
+    ALWAYS_ASSERT(control_count>0 && pool_create(&control_workers, &control_config, run_packet)==0,
+        "FAILED TO START CONTROL WORKERS!");
+
+    pthread_t admission_thread, handshake_thread;
+    ALWAYS_ASSERT(
+        pthread_create(&admission_thread, NULL, session_admission_main, NULL)==0 &&
+        pthread_create(&handshake_thread, NULL, handshake_main, NULL)==0,
+        "FAILED TO SPAWN THREAD!"
+    );
+
+    int fifo AUTO_CLOSE_FD = -1;
+    int fifo_internal AUTO_CLOSE_FD = -1;
+    if(env_u64("MBROKER_TAKEOVER", 0)!=0){
+        take_over_broker(&fifo, &fifo_internal);
+        if(argc == 4) socket_name = argv[3];
+    }else{
+        // Optional second transport: a SOCK_SEQPACKET listener, which keeps the
+        // packet boundaries for us and needs no fifo per session
+        if(argc == 4){
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            ALWAYS_ASSERT(strlen(argv[3])<sizeof(addr.sun_path), "SOCKET PATH TOO LONG!");
+            strcpy(addr.sun_path, argv[3]);
+
+            socket_listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+            ALWAYS_ASSERT(socket_listener!=-1, "FAILED TO CREATE SOCKET! %i", errno);
+            if(bind(socket_listener, (struct sockaddr*)&addr, sizeof(addr))!=0) { PANIC("FAILED TO BIND SOCKET! %i", errno); }
+            socket_name = argv[3];
+            ALWAYS_ASSERT(listen(socket_listener, num_sessions)==0, "FAILED TO LISTEN ON SOCKET!");
+        }
+
+        if(mkfifo(pipe_name, 0666)!=0) { PANIC("FAILED TO CREATE FIFO! %i", errno); }
+
+        // Opened without waiting for the first client. The write end keeps
+        // the read end from ever seeing EOF, so reads can block after all
+        fifo = open(pipe_name, O_RDONLY | O_NONBLOCK);
+        ALWAYS_ASSERT(fifo!=-1, "FAILED TO OPEN FILE: %s (%i)", pipe_name, errno);
+        fifo_internal = open(pipe_name, O_WRONLY);
+        ALWAYS_ASSERT(fifo_internal!=-1, "FAILED TO OPEN FILE: %s (%i)", pipe_name, errno);
+        fcntl(fifo, F_SETFL, fcntl(fifo, F_GETFL) & ~O_NONBLOCK);
+
+        handoff_listener = handoff_listen(handoff_name);
+        ALWAYS_ASSERT(handoff_listener!=-1, "FAILED TO LISTEN ON HANDOFF SOCKET! %i", errno);
+    }
+    start_listener();
+    resume_parked_sessions();
+
+    // Register requests, SIGTERM and brokers taking over are all seen to here
+    struct pollfd events[3] = {
+        { fifo, POLLIN, 0 }, { term_fd, POLLIN, 0 }, { handoff_listener, POLLIN, 0 },
+    };
+    u64 next_sweep = stats_now_ns() + RETENTION_SWEEP_MS*1000000ull;
+    while(1){
+        int ready = poll(events, 3, RETENTION_SWEEP_MS);
+        if(ready<0){
+            if(errno==EINTR) continue;
+            PANIC("POLL FAILED! %i", errno);
+        }
+        // Busy or not, the sweep comes around every RETENTION_SWEEP_MS
+        if(stats_now_ns()>=next_sweep){
+            sweep_retention();
+            next_sweep = stats_now_ns() + RETENTION_SWEEP_MS*1000000ull;
+        }
+        if(ready==0) continue;
+        if(events[1].revents & POLLIN) drain_broker(fifo);
+        if(events[2].revents & POLLIN) hand_off_broker(fifo, fifo_internal);
+        if(events[0].revents & POLLIN) read_register_packet(fifo);
+    }
+
+    MTX_DESTORY(messages_lock);
+
+    return 0;
+}
+
+// Reads a request off the register pipe and queues it. Returns false if
+// there was none in the pipe, when it's non blocking
+bool read_register_packet(int fifo){
+    u8 packet_id;
+
+    // Read next packet id
+    ssize_t fifo_read = read(fifo, &packet_id, sizeof(packet_id));
+    if(fifo_read<0 && errno==EAGAIN) return false;
+    if(fifo_read<=0) PANIC("READ ERROR!\n");
+
+    // Get the packet size based on the id
+    ssize_t packet_size = id_size_lookup(packet_id);
+    if(packet_size==-1) PANIC("ILLEGAL PACKET ID: %i\n", (int)packet_id);
+
+    // allocate packet
+    void* data = malloc((size_t)packet_size);
+    ALWAYS_ASSERT(data!=NULL, "NO MEMORY!");
+    *((u8*)data) = packet_id;
+
+    // Read packet body
+    fifo_read = read(fifo, data+1,(size_t)packet_size-1);
+    if(fifo_read!=(size_t)packet_size-1) PANIC("CORRUPTED PIPE!");
+
+    enqueue_packet(data, -1);
+    return true;
+}
+
+bool is_publisher_packet(u8 id){
+    return id==ID_REGISTER_PUBLISHER || id==ID_REGISTER_PUBLISHER_SHM;
+}
+
+// A request is in flight from here until request_done
+unknown_packet* new_request(void* data, int connection){
+    unknown_packet* packet = malloc(sizeof(unknown_packet));
+    ALWAYS_ASSERT(packet!=NULL, "NO MEMORY!");
+    packet->id = *((u8*)data);
+    packet->packet_data = data;
+    packet->connection = connection;
+    packet->received_ns = stats_now_ns();
+    packet->client_fd = -1;
+    packet->resumed = false;
+    packet->credit_fd = -1;
+    packet->owed_credits = 0;
+    packet->next = NULL;
+
+    atomic_fetch_add(&requests_in_flight, 1);
+    if(is_publisher_packet(packet->id)) atomic_fetch_add(&publishers_in_flight, 1);
+    return packet;
+}
+
+void request_done(unknown_packet* packet){
+    if(is_publisher_packet(packet->id)) atomic_fetch_sub(&publishers_in_flight, 1);
+    atomic_fetch_sub(&requests_in_flight, 1);
+    free(packet->packet_data);
+    free(packet);
+}
+
+void enqueue_packet(void* data, int connection){
+    unknown_packet* packet = new_request(data, connection);
+
+    if(connection==-1 && client_pipe(packet)!=NULL){
+        packet->deadline_ns = packet->received_ns + handshake_timeout_ms*1000000;
+        SCOPED_LOCK(handshake_lock);
+        packet->next = handshake_incoming;
+        handshake_incoming = packet;
+        pthread_cond_signal(&handshake_ready);
+        return;
+    }
+    dispatch_packet(packet);
+}
+
+// Sends a request whose client is there to the workers that run its kind
+void dispatch_packet(unknown_packet* packet){
+    if(is_control_packet(packet->id)){
+        pool_submit(&control_workers, packet);
+        return;
+    }
+
+    SCOPED_LOCK(admission_lock);
+    // Straight into the pool, unless it's full or others are already waiting
+    if(admission_head==NULL && !admitting && pool_try_submit(&workers, packet)) return;
+    if(admission_tail==NULL){
+        admission_head = packet;
+    }else{
+        admission_tail->next = packet;
+    }
+    admission_tail = packet;
+    admission_waiting++;
+    pthread_cond_signal(&admission_ready);
+}
+
+bool is_control_packet(u8 id){
+    return id==ID_CREATE_MSG_BOX || id==ID_REMOVE_MSG_BOX ||
+        id==ID_LIST_MSG_BOX || id==ID_STATS;
+}
+
+// Moves the waiting session requests into the session pool as it has room
+void* session_admission_main(void* arg){
+    (void) arg;
+    while(1){
+        unknown_packet* packet;
+        {
+            SCOPED_LOCK(admission_lock);
+            while(admission_head==NULL){
+                ALWAYS_ASSERT(pthread_cond_wait(&admission_ready, &admission_lock)==0, "Failed to Cond wait");
+            }
+            packet = admission_head;
+            admission_head = packet->next;
+            if(admission_head==NULL) admission_tail = NULL;
+            admission_waiting--;
+            admitting = true;
+        }
+
+        pool_submit(&workers, packet);
+
+        SCOPED_LOCK(admission_lock);
+        admitting = false;
+    }
+    pthread_exit(NULL);
+}
+
+// The first packet on a new connection plays the part of the packet written
+// to the register pipe, the rest of the session then uses the same socket
+void* socket_listener_main(void* arg){
+    (void) arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    // Large enough for any packet in protocol.h
+    u8 buffer[4096];
+
+    struct pollfd events[2] = { { socket_listener, POLLIN, 0 }, { listener_stop, POLLIN, 0 } };
+    while(1){
+        if(poll(events, 2, -1)<0){
+            if(errno==EINTR) continue;
+            PANIC("POLL FAILED! %i", errno);
+        }
+        if(events[1].revents & POLLIN) break;
+
+        int connection = accept(socket_listener, NULL, NULL);
+        if(connection==-1){
+            if(errno==EINTR || errno==ECONNABORTED) continue;
+            PANIC("FAILED TO ACCEPT! %i", errno);
+        }
+
+        // Don't let a silent client hold up the listener
+        struct timeval timeout = {1, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+        if(received<=0 || received!=id_size_lookup(buffer[0]) ||
+            (buffer[0]!=ID_REGISTER_PUBLISHER && buffer[0]!=ID_REGISTER_SUBSCRIBER &&
+             buffer[0]!=ID_REGISTER_SUBSCRIBER_PATTERN &&
+             buffer[0]!=ID_CREATE_MSG_BOX && buffer[0]!=ID_REMOVE_MSG_BOX &&
+             buffer[0]!=ID_LIST_MSG_BOX && buffer[0]!=ID_STATS)){
+            close(connection);
+            continue;
+        }
+
+        timeout.tv_sec = 0;
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        void* data = malloc((size_t)received);
+        ALWAYS_ASSERT(data!=NULL, "NO MEMORY!");
+        memcpy(data, buffer, (size_t)received);
+
+        enqueue_packet(data, connection);
+    }
+    pthread_exit(NULL);
+}
+
+// Task function of the worker pool
+void run_packet(void* packet_void){
+    unknown_packet* packet = packet_void;
+    enum BrokerState state = atomic_load(&broker_state);
+
+    // A draining broker only answers control requests, clients that came to
+    // start a session see their end closed. One handing off starts them, for
+    // the sessions to be parked
+    if((state==BROKER_DRAINING || state==BROKER_CLOSING) && !is_control_packet(packet->id)){
+        int channel = client_channel(*packet);
+        if(channel!=-1) close(channel);
+        if(packet->credit_fd!=-1) close(packet->credit_fd);
+    }else{
+        process_packet(*packet);
+    }
+    if(is_control_packet(packet->id)){
+        stats_record(STATS_CONTROL, stats_now_ns() - packet->received_ns);
+    }
+
+    request_done(packet);
+}
+
+void handle_packet_register_pub(unknown_packet upacket);
+void handle_packet_register_sub(unknown_packet upacket);
+void handle_packet_register_pub_shm(unknown_packet upacket);
+void handle_packet_register_sub_shm(unknown_packet upacket);
+void handle_packet_register_sub_pattern(unknown_packet upacket);
+void handle_packet_create_msg_box(unknown_packet upacket);
+void handle_packet_remove_msg_box(unknown_packet upacket);
+void handle_packet_list_msg_box(unknown_packet upacket);
+void handle_packet_stats(unknown_packet upacket);
+
+void process_packet(unknown_packet packet) {
+    switch (packet.id) {
+        case ID_REGISTER_PUBLISHER:
+            handle_packet_register_pub(packet);
+            return;
+        case ID_REGISTER_SUBSCRIBER:
+            handle_packet_register_sub(packet);
+            return;
+        case ID_REGISTER_PUBLISHER_SHM:
+            handle_packet_register_pub_shm(packet);
+            return;
+        case ID_REGISTER_SUBSCRIBER_SHM:
+            handle_packet_register_sub_shm(packet);
+            return;
+        case ID_REGISTER_SUBSCRIBER_PATTERN:
+            handle_packet_register_sub_pattern(packet);
+            return;
+        case ID_CREATE_MSG_BOX:
+            handle_packet_create_msg_box(packet);
+            return;
+        case ID_REMOVE_MSG_BOX:
+            handle_packet_remove_msg_box(packet);
+            return;
+        case ID_LIST_MSG_BOX:
+            handle_packet_list_msg_box(packet);
+            return;
+        case ID_STATS:
+            handle_packet_stats(packet);
+            return;
+        default:
+            PANIC("ILLEGAL PACKET ID (%i): FIFO CORRUPTED?\n", packet.id);
+    }
+}
+
+// Session helpers shared by every transport
+
+// Returns the box with a new publisher session registered, or NULL if
+// there is no such box
+message_box* claim_publisher(const char* box_name, publisher_session* session){
+    SCOPED_LOCK(messages_lock);
+    message_box* msg = get_msg_box(box_name);
+    if(msg==NULL) return NULL;
+    msg->publishers++;
+
+    SCOPED_LOCK(msg->wait_mutex);
+    session->messages = 0;
+    session->thread = pthread_self();
+    session->next = msg->sessions;
+    msg->sessions = session;
+    return msg;
+}
+
+void release_publisher(message_box* msg, publisher_session* session){
+    SCOPED_LOCK(messages_lock);
+    msg->publishers--;
+
+    SCOPED_LOCK(msg->wait_mutex);
+    for(publisher_session** it=&msg->sessions;*it!=NULL;it=&(*it)->next){
+        if(*it==session){
+            *it = session->next;
+            break;
+        }
+    }
+}
+
+// Drops segments from the head of the box while its retention policy is
+// exceeded and every subscriber is already past them. Caller holds wait_mutex
+void box_enforce_retention(message_box* msg){
+    // Parked subscribers left no cursor behind, but still have to read on
+    if(atomic_load(&broker_state)==BROKER_HANDING_OFF) return;
+
+    u64 slowest = msg->index.end;
+    for(subscriber_cursor* it=msg->cursors;it!=NULL;it=it->next){
+        if(it->offset<slowest) slowest = it->offset;
+    }
+    box_index_trim(&msg->index, msg->fd_internal, &msg->retention, slowest, (u64)time(NULL));
+}
+
+// The other retention checks only run when a box is appended to or a
+// subscriber moves on, an idle box's messages would never age out
+void sweep_retention(){
+    SCOPED_LOCK(messages_lock);
+    for(message_box* it=msg_boxes;it!=NULL;it=it->next){
+        if(it->retention.max_age_seconds==0) continue;
+        SCOPED_LOCK(it->wait_mutex);
+        box_enforce_retention(it);
+        // What went may have been all a flow controlled publisher waited for
+        pthread_cond_broadcast(&it->room_wait);
+    }
+}
+
+// Reserves bytes past the box's tail, returns their offset
+u64 box_reserve(message_box* msg, u64 bytes){
+    return atomic_fetch_add(&msg->tail, bytes);
+}
+
+// Commits the count records copied in at a reserved offset, once every
+// reservation before it was committed. The records are packets unless
+// record_lens says otherwise
+void box_commit(message_box* msg, publisher_session* session, u64 offset, size_t count, const u32* record_lens){
+    u64 bytes = 0;
+    for(size_t i=0;i<count;i++){
+        bytes += record_lens==NULL ? sizeof(message_packet) : record_lens[i];
+    }
+    stats_count(STATS_MSGS_IN, count);
+    stats_count(STATS_BYTES_IN, count*sizeof(message_packet));
+    stats_count(STATS_BYTES_STORED, bytes);
+
+    for(u32 spins=0; atomic_load_explicit(&msg->committed, memory_order_acquire)!=offset; spins++){
+        if(spins>=BOX_COMMIT_SPIN) sched_yield();
+    }
+
+    SCOPED_LOCK(msg->wait_mutex);
+    for(size_t i=0;i<count;i++){
+        box_index_append(&msg->index, record_lens==NULL ? sizeof(message_packet) : record_lens[i]);
+    }
+    session->messages += count;
+    atomic_store_explicit(&msg->committed, offset+bytes, memory_order_release);
+    box_enforce_retention(msg);
+    pthread_cond_broadcast(&msg->write_wait);
+    for(pattern_box* it=msg->watchers;it!=NULL;it=it->next_watcher){
+        ring_pattern_session(it->session);
+    }
+    TRACE("appended %lu messages at offset=%lu", count, offset);
+}
+
+// Compresses each message once, on its way in, so the box file and every
+// read of it carry only the compressed bytes. A message that doesn't come
+// out smaller is stored as it is
+void box_append_compressed(message_box* msg, publisher_session* session, const message_packet* packets, size_t count){
+    ALWAYS_ASSERT(count<=SESSION_BATCH, "BATCH TOO LARGE TO COMPRESS!");
+    u8 records[SESSION_BATCH*sizeof(message_packet)];
+    u32 record_lens[SESSION_BATCH];
+    u64 bytes = 0;
+
+    for(size_t i=0;i<count;i++){
+        u8* record = records + bytes;
+        box_record_header header = { BOX_RECORD_COMPRESSED, 0 };
+        size_t packed = lz77_compress(&packets[i], sizeof(message_packet), record+sizeof(header),
+                                      sizeof(message_packet)-sizeof(header)-1);
+        if(packed==0){
+            memcpy(record, &packets[i], sizeof(message_packet));
+            record_lens[i] = sizeof(message_packet);
+        }else{
+            header.bytes = (u16)packed;
+            memcpy(record, &header, sizeof(header));
+            record_lens[i] = (u32)(sizeof(header)+packed);
+        }
+        bytes += record_lens[i];
+    }
+
+    u64 offset = box_reserve(msg, bytes);
+    ALWAYS_ASSERT(pwrite(msg->fd_internal, records, bytes, (off_t)offset)==(ssize_t)bytes,
+        "FAILED TO WRITE TO BOX: %s (%i)", msg->name, errno);
+    stats_count(STATS_SYSCALLS, 1);
+    box_commit(msg, session, offset, count, record_lens);
+}
+
+// Appends count packets to the box and wakes up its subscribers. Only the
+// in order commit takes wait_mutex, for the index bookkeeping, so
+// publishers never wait on each other's copies.
+//
+// The packets come in already as subscribers get them, so fan-out is the
+// box's bytes going out as they are, without a pass over them per
+// subscriber
+void box_append(message_box* msg, publisher_session* session, const message_packet* packets, size_t count){
+    if(msg->compression!=BOX_COMPRESSION_NONE){
+        box_append_compressed(msg, session, packets, count);
+        return;
+    }
+
+    u64 bytes = count*sizeof(message_packet);
+    u64 offset = box_reserve(msg, bytes);
+
+    // A reservation that is never committed would hold back every later one
+    ALWAYS_ASSERT(pwrite(msg->fd_internal, packets, bytes, (off_t)offset)==(ssize_t)bytes,
+        "FAILED TO WRITE TO BOX: %s (%i)", msg->name, errno);
+    stats_count(STATS_SYSCALLS, 1);
+    box_commit(msg, session, offset, count, NULL);
+}
+
+// Turns the packets a publisher sent into the messages the box stores,
+// the way subscribers get them (see box_append), and stamps the timed ones
+// with the time they came in. Returns how many of the first packets are
+// messages, the rest mustn't be stored
+size_t ingest_packets(message_box* msg, message_packet* packets, size_t count){
+    u64 ingest_ns = 0;
+    for(size_t i=0;i<count;i++){
+        if(packets[i].code==ID_SEND_MSG_SERVER){
+            packets[i].code = ID_SEND_MSG_SUBSCRIBER;
+        }else if(packets[i].code==ID_SEND_TIMED_MSG_SERVER){
+            packets[i].code = ID_SEND_TIMED_MSG_SUBSCRIBER;
+            if(ingest_ns==0){
+                ingest_ns = message_clock_ns();
+                if(!atomic_load(&msg->timed)) atomic_store(&msg->timed, true);
+            }
+            message_times(&packets[i])->ingest_ns = ingest_ns;
+        }else{
+            return i;
+        }
+    }
+    return count;
+}
+
+// Whether the box's retention limits can still be kept, that is whether
+// what its subscribers have yet to read is within them (the rest can be
+// dropped). Caller holds wait_mutex
+bool box_has_room(message_box* msg){
+    box_retention* retention = &msg->retention;
+    u64 pinned_bytes = 0, pinned_messages = 0;
+    for(subscriber_cursor* it=msg->cursors;it!=NULL;it=it->next){
+        u64 bytes = atomic_load(&msg->committed) - it->offset;
+        u64 messages = msg->index.messages - it->seq;
+        if(bytes>pinned_bytes) pinned_bytes = bytes;
+        if(messages>pinned_messages) pinned_messages = messages;
+    }
+    return (retention->max_bytes==0 || pinned_bytes<retention->max_bytes) &&
+           (retention->max_messages==0 || pinned_messages<retention->max_messages);
+}
+
+// Holds a publisher back until the box has room again, which is what
+// turns into backpressure on its client. Only publishers with a credit
+// window wait here: the others have no credits to hold back, and waiting
+// would only pin their worker behind the slowest subscriber, which is left
+// to retention and its lag policy instead. Returns false if the broker
+// stopped running first
+bool box_wait_room(message_box* msg){
+    SCOPED_LOCK(msg->wait_mutex);
+    while(!box_has_room(msg)){
+        if(atomic_load(&broker_state)!=BROKER_RUNNING) return false;
+        pthread_cond_wait(&msg->room_wait, &msg->wait_mutex);
+    }
+    return true;
+}
+
+// Translates a subscriber's requested start position into the sequence
+// number of its first message. Positions past the end start at the latest
+// message, positions that were already dropped at the oldest one left.
+// Caller holds wait_mutex
+u64 box_start_seq(message_box* msg, u8 start_mode, u64 start_value){
+    box_index* index = &msg->index;
+    u64 count = index->messages;
+    u64 seq;
+
+    switch((enum SubscribeStart)start_mode){
+        case SUB_START_LATEST:
+            seq = count;
+            break;
+        case SUB_START_OFFSET:
+            seq = start_value<count ? start_value : count;
+            break;
+        case SUB_START_LAST_N:
+            seq = start_value<count ? count-start_value : 0;
+            break;
+        case SUB_START_EARLIEST:
+        default:
+            seq = 0;
+            break;
+    }
+    return seq<box_index_first(index) ? box_index_first(index) : seq;
+}
+
+// Registers a new subscriber of the box and opens the subscriber's own
+// read fd of the box file at its start position. Caller holds messages_lock
+bool open_subscriber(message_box* msg, const register_subscriber_packet* packet, int* fd, subscriber_cursor* cursor){
+    *fd = open(msg->name, O_RDONLY);
+    if(*fd==-1) return false;
+
+    SCOPED_LOCK(msg->wait_mutex);
+    u64 seq = box_start_seq(msg, packet->start_mode, packet->start_value);
+    off_t start = (off_t)box_index_lookup(&msg->index, msg->fd_internal, seq);
+    if(lseek(*fd, start, SEEK_SET)!=start) return false;
+    cursor->offset = (u64)start;
+    cursor->seq = seq;
+    cursor->lag = msg->index.messages - seq;
+    cursor->dropped = 0;
+    cursor->lag_policy = packet->lag_policy==LAG_POLICY_DEFAULT ? LAG_POLICY_DISCONNECT : packet->lag_policy;
+    cursor->lag_budget = packet->lag_budget==0 ? SUB_DEFAULT_LAG_BUDGET : packet->lag_budget;
+    cursor->next = msg->cursors;
+    msg->cursors = cursor;
+    msg->subscribers++;
+    return true;
+}
+
+// Returns the box with a new subscriber registered, see open_subscriber
+message_box* claim_subscriber(const register_subscriber_packet* packet, int* fd, subscriber_cursor* cursor){
+    SCOPED_LOCK(messages_lock);
+    message_box* msg = get_msg_box(packet->box_name);
+    if(msg==NULL || !open_subscriber(msg, packet, fd, cursor)) return NULL;
+    return msg;
+}
+
+void release_subscriber(message_box* msg, subscriber_cursor* cursor){
+    SCOPED_LOCK(msg->wait_mutex);
+    for(subscriber_cursor** it=&msg->cursors;*it!=NULL;it=&(*it)->next){
+        if(*it==cursor){
+            *it = cursor->next;
+            break;
+        }
+    }
+    msg->subscribers--;
+    // The leaving subscriber may have been what held retention back
+    box_enforce_retention(msg);
+    pthread_cond_broadcast(&msg->room_wait);
+}
+
+// How many bytes the box has past the subscriber's offset, without waiting
+size_t box_readable(message_box* msg, int fd, subscriber_cursor* cursor){
+    u64 offset = (u64)lseek(fd, 0, SEEK_CUR);
+    SCOPED_LOCK(msg->wait_mutex);
+    cursor->offset = offset;
+    return (size_t)(atomic_load(&msg->committed)-offset);
+}
+
+// Sleeps until the box has data past the subscriber's offset, and returns
+// how many bytes are ready. Returns 0 once the broker is closing or handing
+// off and the subscriber has caught up
+size_t box_wait_readable(message_box* msg, int fd, subscriber_cursor* cursor){
+    u64 offset = (u64)lseek(fd, 0, SEEK_CUR);
+    SCOPED_LOCK(msg->wait_mutex);
+    cursor->offset = offset;
+    while(atomic_load(&msg->committed)==offset){
+        if(atomic_load(&broker_state)>=BROKER_CLOSING) return 0;
+        pthread_cond_wait(&msg->write_wait, &msg->wait_mutex);
+    }
+    return (size_t)(atomic_load(&msg->committed)-offset);
+}
+
+// Reads up to count of the messages in the next ready bytes of the box,
+// one into each of slots, decompressing those of a compressed box. Returns
+// how many were read, or -1 on errors
+ssize_t box_read(message_box* msg, int fd, size_t ready, struct iovec* slots, size_t count){
+    if(msg->compression==BOX_COMPRESSION_NONE){
+        if(count>ready/sizeof(message_packet)) count = ready/sizeof(message_packet);
+        if(count==0) return 0;
+        stats_count(STATS_SYSCALLS, 1);
+        ssize_t rread = readv(fd, slots, (int)count);
+        if(rread<0 || (size_t)rread%sizeof(message_packet)!=0) return -1;
+        return rread/(ssize_t)sizeof(message_packet);
+    }
+
+    u8 records[SESSION_BATCH*sizeof(message_packet)];
+    if(ready>sizeof(records)) ready = sizeof(records);
+    stats_count(STATS_SYSCALLS, 1);
+    ssize_t rread = read(fd, records, ready);
+    if(rread<=0) return rread;
+
+    size_t used = 0, got = 0;
+    while(got<count && used<(size_t)rread){
+        size_t left = (size_t)rread - used;
+        box_record_header header;
+        if(left<sizeof(header)) break;
+        memcpy(&header, records+used, sizeof(header));
+
+        if(header.code!=BOX_RECORD_COMPRESSED){
+            if(left<sizeof(message_packet)) break;
+            memcpy(slots[got].iov_base, records+used, sizeof(message_packet));
+            used += sizeof(message_packet);
+        }else{
+            if(left<sizeof(header)+header.bytes) break;
+            if(lz77_decompress(records+used+sizeof(header), header.bytes, slots[got].iov_base,
+                               sizeof(message_packet))!=sizeof(message_packet)) return -1;
+            used += sizeof(header)+header.bytes;
+        }
+        got++;
+    }
+    // What there were no slots for is read again next time
+    if(used<(size_t)rread) lseek(fd, -(off_t)((size_t)rread-used), SEEK_CUR);
+    return (ssize_t)got;
+}
+
+// Accounts for packets delivered to a subscriber and returns how many
+// messages it is now behind. Takes wait_mutex
+u64 subscriber_advance(message_box* msg, subscriber_cursor* cursor, size_t delivered){
+    SCOPED_LOCK(msg->wait_mutex);
+    cursor->seq += delivered;
+    // The records of a compressed box vary in size, its cursors stay where
+    // their read started until the next one, which retention only ever
+    // looks behind
+    if(msg->compression==BOX_COMPRESSION_NONE) cursor->offset += delivered*sizeof(message_packet);
+    cursor->lag = msg->index.messages - cursor->seq;
+    TRACE("delivered %lu messages seq=%lu lag=%lu", delivered, cursor->seq, cursor->lag);
+    if(delivered>0){
+        pthread_cond_broadcast(&msg->room_wait);
+        stats_count(STATS_MSGS_OUT, delivered);
+        stats_count(STATS_BYTES_OUT, delivered*sizeof(message_packet));
+    }
+    return cursor->lag;
+}
+
+// Moves a subscriber that fell past its lag budget ahead as its policy says.
+// Returns false if it has to be disconnected instead. Takes wait_mutex
+bool subscriber_apply_lag_policy(message_box* msg, int fd, subscriber_cursor* cursor){
+    SCOPED_LOCK(msg->wait_mutex);
+    box_index* index = &msg->index;
+    u64 seq;
+
+    switch((enum LagPolicy)cursor->lag_policy){
+        case LAG_POLICY_DROP_OLDEST:
+            seq = index->messages - cursor->lag_budget;
+            break;
+        case LAG_POLICY_SKIP_TO_LATEST:
+            seq = index->messages;
+            break;
+        case LAG_POLICY_DEFAULT:
+        case LAG_POLICY_DISCONNECT:
+        default:
+            return false;
+    }
+    if(seq<=cursor->seq) return true;
+
+    off_t offset = (off_t)box_index_lookup(index, msg->fd_internal, seq);
+    if(lseek(fd, offset, SEEK_SET)!=offset) return false;
+    cursor->offset = (u64)offset;
+    cursor->dropped += seq - cursor->seq;
+    cursor->seq = seq;
+    cursor->lag = index->messages - seq;
+    LOG("subscriber skipped to seq=%lu, %lu messages dropped so far", seq, cursor->dropped);
+    // It may have been what held retention back
+    box_enforce_retention(msg);
+    pthread_cond_broadcast(&msg->room_wait);
+    return true;
+}
+
+void session_established(unknown_packet upacket){
+    stats_record(STATS_REGISTRATION, stats_now_ns() - upacket.received_ns);
+    stats_count(STATS_REGISTRATIONS, 1);
+    DEBUG("session established, packet id=%lu", (unsigned long)upacket.id);
+}
+
+// Named pipes are opened from the name in the packet, sockets were already
+// accepted by the listener and are handed over to the caller
+// The client's end of the session: its socket, or its named pipe as the
+// handshake opened it
+int client_channel(unknown_packet upacket){
+    if(upacket.connection!=-1) return upacket.connection;
+    return upacket.client_fd;
+}
+
+// Whether a fifo open for reading has a writer, without taking anything out
+// of it: tee only returns 0 when the fifo is empty and has none. Whatever
+// it copies into scratch is drained again
+bool fifo_has_writer(int fd, int scratch[2]){
+    ssize_t teed = tee(fd, scratch[1], 1, SPLICE_F_NONBLOCK);
+    if(teed>0){
+        u8 byte;
+        ssize_t _temp_ = read(scratch[0], &byte, 1);
+        (void) _temp_;
+    }
+    return teed>0 || (teed==-1 && errno==EAGAIN);
+}
+
+// One attempt at opening a client's named pipe without blocking on the
+// client. A plain open waits for the client to open its end, forever if it
+// died right after registering. Opening for writing fails until the client
+// is reading, opening for reading doesn't wait but the client is only there
+// once there's a writer. Returns 1 once the client is there, 0 to try again
+// later and -1 if it never will be
+int try_open_client_fifo(const char* client_named_pipe, int flags, int* fd, int scratch[2]){
+    if(*fd==-1){
+        *fd = open(client_named_pipe, flags | O_NONBLOCK | O_CLOEXEC);
+        if(*fd==-1) return errno==ENXIO || errno==ENOENT || errno==EINTR ? 0 : -1;
+    }
+    if((flags & O_ACCMODE)==O_RDONLY && !fifo_has_writer(*fd, scratch)) return 0;
+
+    // Sessions pick their own blocking mode
+    fcntl(*fd, F_SETFL, fcntl(*fd, F_GETFL) & ~O_NONBLOCK);
+    return 1;
+}
+
+// Opens a named pipe of a client that is already in session, like the
+// publisher's credit pipe, giving up after handshake_timeout_ms
+int open_client_fifo(const char* client_named_pipe, int flags){
+    u64 deadline = stats_now_ns() + handshake_timeout_ms*1000000;
+    useconds_t backoff = HANDSHAKE_RETRY_MIN_US;
+    int scratch[2];
+    if(pipe2(scratch, O_CLOEXEC | O_NONBLOCK)!=0) return -1;
+
+    int fd = -1;
+    int opened;
+    while((opened = try_open_client_fifo(client_named_pipe, flags, &fd, scratch))==0 && stats_now_ns()<deadline){
+        usleep(backoff);
+        backoff = backoff*2>HANDSHAKE_RETRY_MAX_US ? HANDSHAKE_RETRY_MAX_US : backoff*2;
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    if(opened!=1 && fd!=-1){
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// The named pipe a request is answered through, NULL for requests that
+// have none (the shared memory sessions)
+const char* client_pipe(const unknown_packet* packet){
+    switch(packet->id){
+        case ID_REGISTER_PUBLISHER:
+            return ((register_publisher_packet*)packet->packet_data)->client_named_pipe;
+        case ID_REGISTER_SUBSCRIBER:
+            return ((register_subscriber_packet*)packet->packet_data)->client_named_pipe;
+        case ID_REGISTER_SUBSCRIBER_PATTERN:
+            return ((register_subscriber_pattern_packet*)packet->packet_data)->client_named_pipe;
+        case ID_CREATE_MSG_BOX:
+            return ((create_msg_box_packet*)packet->packet_data)->client_named_pipe;
+        case ID_REMOVE_MSG_BOX:
+            return ((remove_msg_box_packet*)packet->packet_data)->client_named_pipe;
+        case ID_LIST_MSG_BOX:
+            return ((list_msg_box_packet*)packet->packet_data)->client_named_pipe;
+        case ID_STATS:
+            return ((stats_packet*)packet->packet_data)->client_named_pipe;
+        default:
+            return NULL;
+    }
+}
+
+// Opens the named pipes of the requests that arrive, and hands each request
+// on once its client opened the other end, or drops it once it's had
+// handshake_timeout_ms to. Checks back on the clients that aren't there
+// yet less and less often, and as soon as a new request arrives
+void* handshake_main(void* arg){
+    (void) arg;
+    int scratch[2];
+    ALWAYS_ASSERT(pipe2(scratch, O_CLOEXEC | O_NONBLOCK)==0, "FAILED TO CREATE PIPE!");
+
+    unknown_packet* pending = NULL;
+    useconds_t backoff = HANDSHAKE_RETRY_MIN_US;
+    while(1){
+        {
+            SCOPED_LOCK(handshake_lock);
+            if(handshake_incoming==NULL && pending==NULL){
+                ALWAYS_ASSERT(pthread_cond_wait(&handshake_ready, &handshake_lock)==0, "Failed to Cond wait");
+            }else if(handshake_incoming==NULL){
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += (long)backoff*1000l;
+                if(deadline.tv_nsec>=1000000000l){
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000l;
+                }
+                int ret = pthread_cond_timedwait(&handshake_ready, &handshake_lock, &deadline);
+                ALWAYS_ASSERT(ret==0 || ret==ETIMEDOUT, "Failed to Cond wait");
+            }
+
+            if(handshake_incoming!=NULL){
+                unknown_packet* last = handshake_incoming;
+                while(last->next!=NULL) last = last->next;
+                last->next = pending;
+                pending = handshake_incoming;
+                handshake_incoming = NULL;
+                backoff = HANDSHAKE_RETRY_MIN_US;
+            }else{
+                backoff = backoff*2>HANDSHAKE_RETRY_MAX_US ? HANDSHAKE_RETRY_MAX_US : backoff*2;
+            }
+        }
+
+        u64 now = stats_now_ns();
+        for(unknown_packet** it=&pending;*it!=NULL;){
+            unknown_packet* packet = *it;
+            int flags = packet->id==ID_REGISTER_PUBLISHER ? O_RDONLY : O_WRONLY;
+            int opened = try_open_client_fifo(client_pipe(packet), flags, &packet->client_fd, scratch);
+            if(opened==0 && now<packet->deadline_ns){
+                it = &packet->next;
+                continue;
+            }
+
+            *it = packet->next;
+            packet->next = NULL;
+            if(opened==1){
+                dispatch_packet(packet);
+                continue;
+            }
+            fprintf(stderr, "client %s didn't open its pipe in %lums, request dropped\n",
+                client_pipe(packet), handshake_timeout_ms);
+            if(packet->client_fd!=-1) close(packet->client_fd);
+            request_done(packet);
+        }
+    }
+    pthread_exit(NULL);
+}
+
+// Reads at least one and up to max packets from a client in a single
+// syscall, recvmmsg for sockets. Pipes don't keep the packet boundaries, so
+// a packet the client's write split is finished with further reads.
+// Returns 0 once the client disconnects and -1 on errors
+ssize_t recv_packets(int connection, bool is_socket, message_packet* packets, size_t max){
+    if(!is_socket){
+        stats_count(STATS_SYSCALLS, 1);
+        ssize_t fifo_read = read(connection, packets, max*sizeof(message_packet));
+        if(fifo_read<=0) return fifo_read;
+
+        size_t got = (size_t)fifo_read;
+        while(got%sizeof(message_packet)!=0){
+            stats_count(STATS_SYSCALLS, 1);
+            fifo_read = read(connection, (u8*)packets + got, sizeof(message_packet) - got%sizeof(message_packet));
+            // The rest of the packet is on its way, a kick doesn't stop it
+            if(fifo_read<0 && errno==EINTR) continue;
+            if(fifo_read<=0) return -1;
+            got += (size_t)fifo_read;
+        }
+        return (ssize_t)(got/sizeof(message_packet));
+    }
+
+    struct mmsghdr msgs[SESSION_BATCH];
+    struct iovec iovs[SESSION_BATCH];
+    if(max>SESSION_BATCH) max = SESSION_BATCH;
+    memset(msgs, 0, sizeof(msgs));
+    for(size_t i=0;i<max;i++){
+        iovs[i].iov_base = packets + i;
+        iovs[i].iov_len = sizeof(message_packet);
+        msgs[i].msg_hdr.msg_iov = iovs + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // A client closing with credits it never read resets the connection.
+    // The reset is reported once, ahead of what it sent before closing
+    int received;
+    do{
+        stats_count(STATS_SYSCALLS, 1);
+        received = recvmmsg(connection, msgs, (unsigned int)max, MSG_WAITFORONE, NULL);
+    }while(received<0 && errno==ECONNRESET);
+    if(received<=0) return received;
+    for(int i=0;i<received;i++){
+        // A zero length message is how the peer's shutdown shows up mid batch
+        if(msgs[i].msg_len==0) return i;
+        if(msgs[i].msg_len!=sizeof(message_packet)) return -1;
+    }
+    return received;
+}
+
+// Makes one non blocking attempt at writing frames of frame_size bytes
+// (packets, usually) to a client, batched into a single syscall. Returns
+// the bytes written, which for a pipe may end in the middle of a frame, or
+// -1 (errno EAGAIN when the client's end is full)
+ssize_t send_packets(int connection, bool is_socket, const void* data, size_t bytes, size_t frame_size){
+    stats_count(STATS_SYSCALLS, 1);
+    if(!is_socket) return write(connection, data, bytes);
+
+    size_t count = bytes/frame_size;
+    struct mmsghdr msgs[SESSION_BATCH];
+    struct iovec iovs[SESSION_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(size_t i=0;i<count;i++){
+        iovs[i].iov_base = (u8*)data + i*frame_size;
+        iovs[i].iov_len = frame_size;
+        msgs[i].msg_hdr.msg_iov = iovs + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int wrote = sendmmsg(connection, msgs, (unsigned int)count, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(wrote<0) return -1;
+    return (ssize_t)((size_t)wrote*frame_size);
+}
+
+// Waits up to SUB_POLL_MS for room in a client's full end, adding the wait
+// to stalled_ms. Returns false if the client went away or stalled for
+// SUB_STALL_TIMEOUT_MS
+bool wait_client_room(int connection, int* stalled_ms){
+    if(*stalled_ms>=SUB_STALL_TIMEOUT_MS) return false;
+
+    struct pollfd pfd = { connection, POLLOUT, 0 };
+    int ready = poll(&pfd, 1, SUB_POLL_MS);
+    if(ready<0 && errno!=EINTR) return false;
+    if(ready==0) *stalled_ms += SUB_POLL_MS;
+    return !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+// Samples STATS_PUBLISH_TO_DELIVER for the timed ones of count messages
+// handed to a subscriber, from when they came into the broker. The message
+// is at the end of each of the frame_size byte frames. Untimed messages
+// carry no ingest time and aren't sampled, and neither are spliced ones,
+// so the subscribers of a box with timed messages copy them instead
+void record_deliveries(const void* frames, size_t count, size_t frame_size){
+    const u8* packet = (const u8*)frames + frame_size - sizeof(message_packet);
+    u64 now = 0;
+    for(size_t i=0;i<count;i++,packet+=frame_size){
+        if(!message_is_timed((const message_packet*)packet)) continue;
+        message_timestamps times;
+        memcpy(&times, packet + offsetof(message_packet, message), sizeof(times));
+        if(now==0) now = message_clock_ns();
+        stats_record(STATS_PUBLISH_TO_DELIVER, now - times.ingest_ns);
+    }
+}
+
+// Delivers count frames of frame_size bytes, one per message, to a
+// subscriber without letting it hold the worker hostage: while the client
+// doesn't drain its end, gives up as soon as the subscriber is past its lag
+// budget (once any half written frame is finished, so the stream stays
+// framed). The first sent bytes already went out some other way. Returns
+// how many frames were delivered, or -1 if the client went away or stalled
+// for too long
+ssize_t deliver_packets(message_box* msg, subscriber_cursor* cursor, int connection, bool is_socket,
+                        const void* frames, size_t count, size_t frame_size, size_t sent){
+    const u8* data = frames;
+    size_t total = count*frame_size, delivered = 0;
+    int stalled_ms = 0;
+
+    while(1){
+        if(sent/frame_size>delivered){
+            record_deliveries(data + delivered*frame_size, sent/frame_size - delivered, frame_size);
+            subscriber_advance(msg, cursor, sent/frame_size - delivered);
+            delivered = sent/frame_size;
+        }
+        if(sent>=total) break;
+
+        ssize_t wrote = send_packets(connection, is_socket, data+sent, total-sent, frame_size);
+        if(wrote>0){
+            sent += (size_t)wrote;
+            stalled_ms = 0;
+            continue;
+        }
+        // EINTR is a kick meant for a publisher the worker ran before, see kick_sessions
+        if(wrote==0 || (errno!=EAGAIN && errno!=EINTR)) return -1;
+
+        // A handoff doesn't wait for a stalled client either, the rest goes
+        // out from the broker taking over
+        if(sent%frame_size==0 && (atomic_load(&broker_state)==BROKER_HANDING_OFF ||
+            subscriber_advance(msg, cursor, 0)>cursor->lag_budget)) break;
+        if(!wait_client_room(connection, &stalled_ms)) return -1;
+    }
+    return (ssize_t)delivered;
+}
+
+// deliver_packets for a pipe client, with the count packets at the fd's
+// position in the box spliced from the page cache into the pipe. The fd is
+// left right past what was delivered
+ssize_t splice_packets(message_box* msg, subscriber_cursor* cursor, int fd, int connection, size_t count){
+    size_t total = count*sizeof(message_packet), sent = 0, delivered = 0;
+    int stalled_ms = 0;
+
+    while(1){
+        if(sent/sizeof(message_packet)>delivered){
+            subscriber_advance(msg, cursor, sent/sizeof(message_packet) - delivered);
+            delivered = sent/sizeof(message_packet);
+        }
+        if(sent>=total) break;
+
+        stats_count(STATS_SYSCALLS, 1);
+        ssize_t moved = splice(fd, NULL, connection, NULL, total-sent, SPLICE_F_NONBLOCK);
+        if(moved>0){
+            sent += (size_t)moved;
+            stalled_ms = 0;
+            continue;
+        }
+        if(moved==0 || (errno!=EAGAIN && errno!=EINTR)) return -1;
+
+        if(sent%sizeof(message_packet)==0 && (atomic_load(&broker_state)==BROKER_HANDING_OFF ||
+            subscriber_advance(msg, cursor, 0)>cursor->lag_budget)) break;
+        if(!wait_client_room(connection, &stalled_ms)) return -1;
+    }
+    return (ssize_t)delivered;
+}
+
+// A client that went away is noticed by the next read of its session
+void grant_credits(int credit_channel, u32 credits){
+    publisher_credit_packet packet;
+    write_packet_credit(&packet, credits);
+    ssize_t _temp_ = write(credit_channel, &packet, sizeof(packet));
+    (void) _temp_;
+}
+
+#ifdef MBROKER_URING
+// Tags of the ops a session has in flight on its ring
+enum { URING_TAG_CLIENT=0, URING_TAG_BOX, URING_TAG_CANCEL };
+
+// Finishes a packet the client's pipe split, with plain reads. Takes what
+// the ring read and returns the packets in the buffer, 0 once the client
+// disconnected and -1 on errors
+ssize_t uring_finish_read(int connection, message_packet* packets, i32 got){
+    if(got<=0) return got<0 ? -1 : 0;
+
+    size_t bytes = (size_t)got;
+    while(bytes%sizeof(message_packet)!=0){
+        stats_count(STATS_SYSCALLS, 1);
+        ssize_t more = read(connection, (u8*)packets + bytes, sizeof(message_packet) - bytes%sizeof(message_packet));
+        if(more<0 && errno==EINTR) continue;
+        if(more<=0) return -1;
+        bytes += (size_t)more;
+    }
+    return (ssize_t)(bytes/sizeof(message_packet));
+}
+
+// Waits for the client read in flight and finishes it. Once the broker
+// stops running the read is cancelled instead, setting stopped, and what it
+// got before that is returned (0 packets if nothing)
+ssize_t publish_uring_read(uring* ring, int connection, int current, bool* stopped){
+    i32 got;
+    while((got = uring_wait_signal(ring, URING_TAG_CLIENT))==-EINTR){
+        if(atomic_load(&broker_state)==BROKER_RUNNING) continue;
+        uring_cancel(ring, URING_TAG_CLIENT, URING_TAG_CANCEL);
+        uring_wait(ring, URING_TAG_CANCEL);
+        *stopped = true;
+    }
+    if(*stopped && got==-ECANCELED) return 0;
+    return uring_finish_read(connection, uring_buffer(ring, current), got);
+}
+
+// Publisher session on the worker's ring: the box write of a batch goes to
+// the kernel along with the read of the next one, which is then already on
+// its way while the batch is committed. Returns false if the session's fds
+// didn't fit in the ring, nothing was read then, or if the broker stopped
+// running, the session is carried on without the ring then. Credits for
+// messages taken in while the box had no room are added to owed
+bool publish_uring(uring* ring, message_box* msg, publisher_session* session, int connection,
+                   int credit_channel, u32 window, u32* owed){
+    int client = uring_attach(ring, connection);
+    int box = client==-1 ? -1 : uring_attach(ring, msg->fd_internal);
+    if(box==-1){
+        if(client!=-1) uring_detach(ring, client);
+        return false;
+    }
+
+    size_t batch_bytes = URING_BUFFER_PACKETS*sizeof(message_packet);
+    int current = 0;
+    bool stopped = false;
+    uring_read(ring, client, current, batch_bytes, -1, URING_TAG_CLIENT);
+    ssize_t received = publish_uring_read(ring, connection, current, &stopped);
+
+    while(received!=0){
+        message_packet* packets = uring_buffer(ring, current);
+        bool valid = received>0 && ingest_packets(msg, packets, (size_t)received)==(size_t)received;
+        if(!valid){
+            fprintf(stderr, "UNKNOWN ERROR! (%i)\nCLOSING CONNECTION!", errno);
+            break;
+        }
+
+        size_t bytes = (size_t)received*sizeof(message_packet);
+        u64 offset = box_reserve(msg, bytes);
+        uring_write(ring, box, current, bytes, (i64)offset, URING_TAG_BOX);
+        if(!stopped) uring_read(ring, client, 1-current, batch_bytes, -1, URING_TAG_CLIENT);
+
+        // A reservation that is never committed would hold back every later one
+        i32 wrote = uring_wait(ring, URING_TAG_BOX);
+        ALWAYS_ASSERT(wrote==(i32)bytes, "FAILED TO WRITE TO BOX: %s (%i)", msg->name, -wrote);
+        box_commit(msg, session, offset, (size_t)received, NULL);
+
+        // Credits come back only once the box can take the messages in
+        if(window>0){
+            if(!box_wait_room(msg)) *owed += (u32)received;
+            else grant_credits(credit_channel, (u32)received);
+        }
+        if(stopped) break;
+
+        current = 1-current;
+        received = publish_uring_read(ring, connection, current, &stopped);
+    }
+
+    uring_detach(ring, box);
+    uring_detach(ring, client);
+    return !stopped;
+}
+
+// Subscriber session on the worker's ring: the box holds the packets as
+// they go out, so the write of a batch is linked to its read and both go
+// to the kernel in a single enter. A client whose end is full is left to
+// deliver_packets. Returns false if the session's fds didn't fit in the
+// ring, nothing was delivered then, or if the broker is closing or handing
+// off, the session is carried on without the ring then
+bool subscribe_uring(uring* ring, message_box* msg, subscriber_cursor* cursor, int fd, int communication){
+    int box = uring_attach(ring, fd);
+    int client = box==-1 ? -1 : uring_attach(ring, communication);
+    if(client==-1){
+        if(box!=-1) uring_detach(ring, box);
+        return false;
+    }
+
+    message_packet* packets = uring_buffer(ring, 0);
+    bool stopped = false;
+    while(1){
+        size_t ready = box_wait_readable(msg, fd, cursor)/sizeof(message_packet);
+        if(ready==0 || atomic_load(&broker_state)==BROKER_HANDING_OFF){
+            stopped = true;
+            break;
+        }
+        if(ready>URING_BUFFER_PACKETS) ready = URING_BUFFER_PACKETS;
+        size_t bytes = ready*sizeof(message_packet);
+
+        uring_read(ring, box, 0, bytes, -1, URING_TAG_BOX);
+        uring_link(ring);
+        uring_write(ring, client, 0, bytes, -1, URING_TAG_CLIENT);
+        // The write completes last, by then the read is reaped too
+        i32 wrote = uring_wait(ring, URING_TAG_CLIENT);
+        i32 rread = uring_wait(ring, URING_TAG_BOX);
+        if(rread == 0) continue;
+        if(rread<0 || (size_t)rread%sizeof(message_packet)!=0) break;
+        size_t have = (size_t)rread/sizeof(message_packet);
+
+        // A short read cancels the write, what it did read is delivered below
+        ssize_t delivered;
+        if(wrote==(i32)bytes){
+            record_deliveries(packets, have, sizeof(message_packet));
+            subscriber_advance(msg, cursor, have);
+            delivered = (ssize_t)have;
+        }else if(wrote>0 || wrote==-EAGAIN || wrote==-ECANCELED){
+            delivered = deliver_packets(msg, cursor, communication, false, packets, have, sizeof(message_packet),
+                wrote>0 ? (size_t)wrote : 0);
+        }else{
+            errno = -wrote;
+            delivered = -1;
+        }
+
+        if(delivered<0){
+            if(errno!=EPIPE && errno!=0){
+                fprintf(stderr, "unknown error occured! sub disconnected!\n");
+            }
+            break;
+        }
+        // What it gave up on is read again
+        if((size_t)delivered<have) lseek(fd, (off_t)cursor->offset, SEEK_SET);
+
+        if(cursor->lag>cursor->lag_budget && !subscriber_apply_lag_policy(msg, fd, cursor)){
+            fprintf(stderr, "subscriber of %s is %lu messages behind, disconnected!\n", msg->name, cursor->lag);
+            break;
+        }
+    }
+
+    uring_detach(ring, client);
+    uring_detach(ring, box);
+    return !stopped;
+}
+#endif
+
+void handle_packet_register_pub(unknown_packet upacket){
+    register_publisher_packet* register_packet = upacket.packet_data;
+    bool is_socket = upacket.connection!=-1;
+
+    int connection AUTO_CLOSE_FD = client_channel(upacket);
+    if(connection==-1) return;
+
+    // Credits share the socket, named pipe clients have a fifo for them
+    // (which a session handed over from another broker comes with)
+    u32 window = register_packet->credit_window;
+    int credit_fifo AUTO_CLOSE_FD = upacket.credit_fd;
+    int credit_channel = is_socket ? connection : credit_fifo;
+    if(window>0 && !is_socket && credit_fifo==-1){
+        char credit_pipe[MAX_PIPE_NAME_LEN];
+        if(!credit_pipe_name(credit_pipe, register_packet->client_named_pipe)) return;
+        credit_fifo = open_client_fifo(credit_pipe, O_WRONLY);
+        if(credit_fifo==-1) return;
+        credit_channel = credit_fifo;
+    }
+    if(window>PUB_MAX_CREDIT_WINDOW) window = PUB_MAX_CREDIT_WINDOW;
+
+    publisher_session session;
+    message_box* msg = claim_publisher(register_packet->box_name, &session);
+    if(msg==NULL) return;
+    session_established(upacket);
+
+    // A resumed client still has its window, less what it was owed
+    u32 owed = 0;
+    if(!upacket.resumed){
+        if(window>0) grant_credits(credit_channel, window);
+    }else if(window>0 && upacket.owed_credits>0){
+        if(box_wait_room(msg)) grant_credits(credit_channel, upacket.owed_credits);
+        else owed = upacket.owed_credits;
+    }
+
+#ifdef MBROKER_URING
+    // Compressed boxes are written through box_append
+    uring* ring = is_socket || msg->compression!=BOX_COMPRESSION_NONE ? NULL : uring_thread();
+    if(ring!=NULL && publish_uring(ring, msg, &session, connection, credit_channel, window, &owed)){
+        release_publisher(msg, &session);
+        return;
+    }
+#endif
+
+    message_packet packets[SESSION_BATCH];
+    bool draining = false;
+
+    while(1){
+        // Sessions stop here, between batches, see kick_sessions
+        enum BrokerState state = atomic_load(&broker_state);
+        if(state==BROKER_HANDING_OFF){
+            park_publisher(msg, register_packet, is_socket, connection, credit_fifo, window, owed);
+            break;
+        }
+        // Draining takes in what the client already sent and no more
+        if(state!=BROKER_RUNNING && !draining){
+            fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) | O_NONBLOCK);
+            draining = true;
+        }
+
+        ssize_t received = recv_packets(connection, is_socket, packets, SESSION_BATCH);
+        if(received==0 || (received<0 && errno==EAGAIN)){
+            break;
+        }
+        if(received<0 && errno==EINTR){
+            continue;
+        }
+
+        bool valid = received>0 && ingest_packets(msg, packets, (size_t)received)==(size_t)received;
+        if(!valid){
+            fprintf(stderr, "UNKNOWN ERROR! (%i)\nCLOSING CONNECTION!", errno);
+            break;
+        }
+
+        box_append(msg, &session, packets, (size_t)received);
 
-    pipe_name = argv[1];
-    pc_queue_t workqueue __attribute__((cleanup(pcq_dequeue)));
+        // Credits come back only once the box can take the messages in
+        if(window>0){
+            if(!box_wait_room(msg)) owed += (u32)received;
+            else grant_credits(credit_channel, (u32)received);
+        }
+    }
+    release_publisher(msg, &session);
+}
 
-    ALWAYS_ASSERT(pcq_create(&workqueue, (size_t)num_sessions)==0, "Failed to create pcq_queue!");
+void handle_packet_register_sub(unknown_packet upacket){
+    register_subscriber_packet* register_packet = upacket.packet_data;
+    ALWAYS_ASSERT(register_packet->code == ID_REGISTER_SUBSCRIBER, "FATAL ERROR");
+    bool is_socket = upacket.connection!=-1;
 
-    if(mkfifo(pipe_name, 0666)!=0) { PANIC("FAILED TO CREATE FIFO! %i", errno); }
 
-    OPEN_FILE_FD(fifo,          pipe_name, O_RDONLY);
-    // So the rdonly can always read
-    OPEN_FILE_FD(fifo_internal, pipe_name, O_WRONLY);
+    int communication AUTO_CLOSE_FD = client_channel(upacket);
+    if(communication == -1) return;
+    // A full client end must never block the worker, see deliver_packets
+    if(!is_socket) fcntl(communication, F_SETFL, fcntl(communication, F_GETFL) | O_NONBLOCK);
 
-    pthread_t* worker_threads = (pthread_t*)malloc(sizeof(pthread_t)*(size_t)num_sessions);
-    ALWAYS_ASSERT(worker_threads!=NULL, "NO MEMORY!");
+    int fd AUTO_CLOSE_FD = -1;
+    subscriber_cursor cursor;
+    message_box* msg = claim_subscriber(register_packet, &fd, &cursor);
+    if(upacket.resumed) atomic_fetch_sub(&subscribers_resuming, 1);
+    if(msg==NULL) return;
+    session_established(upacket);
+
+#ifdef MBROKER_URING
+    uring* ring = is_socket || msg->compression!=BOX_COMPRESSION_NONE ? NULL : uring_thread();
+    if(ring!=NULL && subscribe_uring(ring, msg, &cursor, fd, communication)){
+        release_subscriber(msg, &cursor);
+        return;
+    }
+#endif
 
-    for(int i=0;i<num_sessions;i++){
-        ALWAYS_ASSERT(
-            pthread_create(worker_threads + i, NULL, worker_main, (void*)&workqueue)==0,
-            "FAILED TO SPAWN THREAD!"
-        );
+    message_packet packets[SESSION_BATCH];
+    struct iovec slots[SESSION_BATCH];
+    for(size_t i=0;i<SESSION_BATCH;i++){
+        slots[i].iov_base = &packets[i];
+        slots[i].iov_len = sizeof(message_packet);
     }
 
+    // A pipe gets the packets of a plain box spliced straight from the box
+    // file, they never pass through here. Spliced pages are only lent to the
+    // pipe though, and retention punching them out of the file would zero
+    // them before the client reads them, so boxes with limits are copied. So
+    // are the messages of boxes with timed ones, see record_deliveries
+    box_retention* retention = &msg->retention;
+    bool zero_copy = !is_socket && msg->compression==BOX_COMPRESSION_NONE &&
+        retention->max_bytes==0 && retention->max_messages==0 && retention->max_age_seconds==0;
+
     while(1){
-        u8 packet_id;
+        if(atomic_load(&broker_state)==BROKER_HANDING_OFF){
+            park_subscriber(msg, register_packet, is_socket, communication, &cursor);
+            break;
+        }
+        size_t ready = box_wait_readable(msg, fd, &cursor);
+        if(ready==0){
+            // Caught up with a broker that's going away, see box_wait_readable
+            if(atomic_load(&broker_state)==BROKER_HANDING_OFF) continue;
+            break;
+        }
+        ssize_t delivered;
+        if(zero_copy && !atomic_load(&msg->timed)){
+            size_t count = ready/sizeof(message_packet);
+            if(count>SESSION_BATCH) count = SESSION_BATCH;
+            delivered = splice_packets(msg, &cursor, fd, communication, count);
+        }else{
+            ssize_t rread = box_read(msg, fd, ready, slots, SESSION_BATCH);
+            if(rread == 0) continue;
+            if(rread<0) break;
+            delivered = deliver_packets(msg, &cursor, communication, is_socket, packets, (size_t)rread,
+                                        sizeof(message_packet), 0);
+        }
+        if(delivered<0){
+            if(errno!=EPIPE && errno!=0){
+                fprintf(stderr, "unknown error occured! sub disconnected!\n");
+            }
+            break;
+        }
 
-        // Read next packet id
-        ssize_t fifo_read = read(fifo, &packet_id, sizeof(packet_id));
-        if(fifo_read<=0) PANIC("READ ERROR!\n");
+        if(cursor.lag>cursor.lag_budget && !subscriber_apply_lag_policy(msg, fd, &cursor)){
+            fprintf(stderr, "subscriber of %s is %lu messages behind, disconnected!\n", msg->name, cursor.lag);
+            break;
+        }
+    }
 
-        // Get the packet size based on the id
-        ssize_t packet_size = id_size_lookup(packet_id);
-        if(packet_size==-1) PANIC("ILLEGAL PACKET ID: %i\n", (int)packet_id);
+    release_subscriber(msg, &cursor);
+}
 
-        // allocate packet
-        void* data = malloc((size_t)packet_size);
-        ALWAYS_ASSERT(data!=NULL, "NO MEMORY!");
-        *((u8*)data) = packet_id;
+// The shm sessions move packets straight between the ring slots and the
+// box file, without going through an intermediate buffer
+void handle_packet_register_pub_shm(unknown_packet upacket){
+    register_publisher_shm_packet* register_packet = upacket.packet_data;
 
-        // Read packet body
-        fifo_read = read(fifo, data+1,(size_t)packet_size-1);
-        if(fifo_read!=(size_t)packet_size-1) PANIC("CORRUPTED PIPE!");
+    shm_ring* ring AUTO_DETACH_RING = shm_ring_attach(register_packet->client_named_pipe);
+    if(ring==NULL) return;
 
-        pcq_enqueue(&workqueue, data);
+    publisher_session session;
+    message_box* msg = claim_publisher(register_packet->box_name, &session);
+    if(msg==NULL){
+        shm_ring_close(ring);
+        return;
+    }
+    session_established(upacket);
+
+    // Whatever the client committed since the last wakeup goes into the box
+    // with a single write, straight out of the ring slots
+    message_packet* slots;
+    size_t count;
+    while((slots = shm_ring_peek_batch(ring, SESSION_BATCH, &count))!=NULL){
+        size_t valid = ingest_packets(msg, slots, count);
+        if(valid>0) box_append(msg, &session, slots, valid);
+        shm_ring_release_batch(ring, count);
+        if(valid<count){
+            fprintf(stderr, "UNKNOWN ERROR! (%i)\nCLOSING CONNECTION!", errno);
+            break;
+        }
     }
 
-    MTX_DESTORY(messages_lock);
-
-    return 0;
+    shm_ring_close(ring);
+    release_publisher(msg, &session);
 }
 
-// main function for worker threads
-void* worker_main(void* queue_void){
-    pc_queue_t* queue = (pc_queue_t*) queue_void;
-
-    // Setup signal handling
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGPIPE);
-    pthread_sigmask(SIG_BLOCK, &set, NULL);
+void handle_packet_register_sub_shm(unknown_packet upacket){
+    register_subscriber_shm_packet* register_packet = upacket.packet_data;
 
-    while(1){
-        void* data = pcq_dequeue(queue);
+    shm_ring* ring AUTO_DETACH_RING = shm_ring_attach(register_packet->client_named_pipe);
+    if(ring==NULL) return;
 
-        if(data == NULL) pthread_exit(NULL);
+    int fd AUTO_CLOSE_FD = -1;
+    subscriber_cursor cursor;
+    message_box* msg = claim_subscriber(register_packet, &fd, &cursor);
+    if(msg==NULL){
+        shm_ring_close(ring);
+        return;
+    }
+    session_established(upacket);
 
-        unknown_packet packet;
-        packet.packet_data = data;
-        packet.id = *((u8*)packet.packet_data);
+    int stalled_ms = 0;
+    struct iovec slots[SESSION_BATCH];
+    while(1){
+        // Shared memory sessions aren't handed off, they're drained
+        size_t ready = box_wait_readable(msg, fd, &cursor);
+        if(ready==0) break;
+
+        // Same rules as deliver_packets, a full ring must not pin the worker
+        size_t count;
+        message_packet* batch = shm_ring_reserve_batch_timed(ring, SESSION_BATCH, &count, SUB_POLL_MS);
+        if(batch==NULL){
+            if(errno!=ETIMEDOUT) break;
+            stalled_ms += SUB_POLL_MS;
+            if(stalled_ms>=SUB_STALL_TIMEOUT_MS) break;
+            if(subscriber_advance(msg, &cursor, 0)>cursor.lag_budget &&
+                !subscriber_apply_lag_policy(msg, fd, &cursor)){
+                fprintf(stderr, "subscriber of %s is %lu messages behind, disconnected!\n", msg->name, cursor.lag);
+                break;
+            }
+            continue;
+        }
+        stalled_ms = 0;
 
-        process_packet(packet);
+        // Read straight into the slots, those left empty are reused next time
+        for(size_t i=0;i<count;i++){
+            slots[i].iov_base = &batch[i];
+            slots[i].iov_len = sizeof(message_packet);
+        }
+        ssize_t rread = box_read(msg, fd, ready, slots, count);
+        if(rread == 0) continue;
+        if(rread<0) break;
 
-        free(data);
+        record_deliveries(batch, (size_t)rread, sizeof(message_packet));
+        shm_ring_commit_batch(ring, (size_t)rread);
+        subscriber_advance(msg, &cursor, (size_t)rread);
     }
-    pthread_exit(NULL);
+
+    shm_ring_close(ring);
+    release_subscriber(msg, &cursor);
 }
 
-void handle_packet_register_pub(unknown_packet upacket);
-void handle_packet_register_sub(unknown_packet upacket);
-void handle_packet_create_msg_box(unknown_packet upacket);
-void handle_packet_remove_msg_box(unknown_packet upacket);
-void handle_packet_list_msg_box(unknown_packet upacket);
+void ring_pattern_session(pattern_session* session){
+    SCOPED_LOCK(session->lock);
+    session->doorbell++;
+    pthread_cond_signal(&session->wake);
+}
 
-void process_packet(unknown_packet packet) {
-    switch (packet.id) {
-        case ID_REGISTER_PUBLISHER:
-            handle_packet_register_pub(packet);
-            return;
-        case ID_REGISTER_SUBSCRIBER:
-            handle_packet_register_sub(packet);
-            return;
-        case ID_CREATE_MSG_BOX:
-            handle_packet_create_msg_box(packet);
-            return;
-        case ID_REMOVE_MSG_BOX:
-            handle_packet_remove_msg_box(packet);
-            return;
-        case ID_LIST_MSG_BOX:
-            handle_packet_list_msg_box(packet);
-            return;
-        default:
-            PANIC("ILLEGAL PACKET ID (%i): FIFO CORRUPTED?\n", packet.id);
+// Subscribes the session to a box its pattern matches and hands the box
+// over to the session's worker. Caller holds messages_lock
+void claim_for_pattern(pattern_session* session, message_box* msg){
+    if(!box_pattern_matches(session->request->box_name, msg->name)) return;
+
+    pattern_box* box = malloc(sizeof(pattern_box));
+    ALWAYS_ASSERT(box!=NULL, "NO MEMORY!");
+    box->msg = msg;
+    box->session = session;
+    box->fd = -1;
+    if(!open_subscriber(msg, session->request, &box->fd, &box->cursor)){
+        if(box->fd!=-1) close(box->fd);
+        free(box);
+        return;
     }
+    {
+        SCOPED_LOCK(msg->wait_mutex);
+        box->next_watcher = msg->watchers;
+        msg->watchers = box;
+    }
+
+    SCOPED_LOCK(session->lock);
+    box->next = session->added;
+    session->added = box;
+    session->doorbell++;
+    pthread_cond_signal(&session->wake);
 }
 
-void handle_packet_register_pub(unknown_packet upacket){
-    register_publisher_packet* register_packet = upacket.packet_data;
+// Trie visitors, for a new session over the boxes and a new box over the sessions
+void match_existing_box(void* msg_void, void* session_void){
+    claim_for_pattern(session_void, msg_void);
+}
 
-    int connection AUTO_CLOSE_FD = open(register_packet->client_named_pipe, 00);
-    if(connection==-1) return;
+void match_new_box(void* session_void, void* msg_void){
+    claim_for_pattern(session_void, msg_void);
+}
 
-    message_box* msg;
-    int fd = -1;
+void release_pattern_box(pattern_box* box){
     {
-        SCOPED_LOCK(messages_lock);
-        msg = get_msg_box(register_packet->box_name);
-        if(msg==NULL || msg->publishers>0) return;
-        msg->publishers = 1;
-        fd = msg->fd_internal_w;
+        SCOPED_LOCK(box->msg->wait_mutex);
+        for(pattern_box** it=&box->msg->watchers;*it!=NULL;it=&(*it)->next_watcher){
+            if(*it==box){
+                *it = box->next_watcher;
+                break;
+            }
+        }
     }
+    release_subscriber(box->msg, &box->cursor);
+    close(box->fd);
+    free(box);
+}
 
-    message_packet msg_packet;
-
-    while(1){
-        ssize_t fifo_read = read(connection, &msg_packet, sizeof(message_packet));
-        if(fifo_read==0){
-            break;
-        }
-        if(fifo_read!=sizeof(message_packet) || msg_packet.code!=ID_SEND_MSG_SERVER){
-            fprintf(stderr, "UNKNOWN ERROR! (%i)\nCLOSING CONNECTION!", errno);
-            break;
+// Writes a whole frame, waiting for room as deliver_packets does
+bool send_frame(int connection, bool is_socket, const void* frame, size_t size){
+    size_t sent = 0;
+    int stalled_ms = 0;
+    while(sent<size){
+        ssize_t wrote = send_packets(connection, is_socket, (const u8*)frame + sent, size-sent, size-sent);
+        if(wrote>0){
+            sent += (size_t)wrote;
+            stalled_ms = 0;
+            continue;
         }
-        
-        if(write(fd, &msg_packet, sizeof(msg_packet))!=sizeof(msg_packet)) break;
-        SCOPED_LOCK(msg->wait_mutex);
-        msg->size += sizeof(msg_packet);
-        pthread_cond_broadcast(&msg->write_wait);
+        if(wrote==0 || (errno!=EAGAIN && errno!=EINTR) || !wait_client_room(connection, &stalled_ms)) return false;
     }
-    SCOPED_LOCK(msg->wait_mutex);
-    msg->publishers--;
+    return true;
 }
 
-void handle_packet_register_sub(unknown_packet upacket){
-    register_subscriber_packet* register_packet = upacket.packet_data;
-    ALWAYS_ASSERT(register_packet->code == ID_REGISTER_SUBSCRIBER, "FATAL ERROR");
+// Delivers the next batch of one of the session's boxes, tagged with the
+// box's id. Returns how many messages went out, or -1 to end the session
+ssize_t deliver_pattern_box(pattern_box* box, int connection, bool is_socket, pattern_message_packet* frames){
+    size_t ready = box_readable(box->msg, box->fd, &box->cursor);
+    if(ready==0) return 0;
+
+    // Straight into the frames, around their headers
+    struct iovec slots[SESSION_BATCH];
+    for(size_t i=0;i<SESSION_BATCH;i++){
+        slots[i].iov_base = &frames[i].packet;
+        slots[i].iov_len = sizeof(message_packet);
+    }
+    ssize_t rread = box_read(box->msg, box->fd, ready, slots, SESSION_BATCH);
+    if(rread<=0) return rread;
+    size_t count = (size_t)rread;
+
+    for(size_t i=0;i<count;i++){
+        frames[i].code = ID_SEND_MSG_PATTERN;
+        frames[i].kind = PATTERN_FRAME_MSG;
+        frames[i].box_id = box->msg->id;
+    }
+    ssize_t delivered = deliver_packets(box->msg, &box->cursor, connection, is_socket,
+                                        frames, count, sizeof(pattern_message_packet), 0);
+    if(delivered<0){
+        if(errno!=EPIPE && errno!=0){
+            fprintf(stderr, "unknown error occured! sub disconnected!\n");
+        }
+        return -1;
+    }
 
+    if(box->cursor.lag>box->cursor.lag_budget && !subscriber_apply_lag_policy(box->msg, box->fd, &box->cursor)){
+        fprintf(stderr, "subscriber of %s is %lu messages behind, disconnected!\n", box->msg->name, box->cursor.lag);
+        return -1;
+    }
+    return delivered;
+}
+
+// One worker serves every box the pattern matches, now or later, taking
+// a batch from each in turn so a busy box can't starve the others. It
+// sleeps on the session's doorbell, which commits to any of its boxes ring
+void handle_packet_register_sub_pattern(unknown_packet upacket){
+    register_subscriber_pattern_packet* register_packet = upacket.packet_data;
+    ALWAYS_ASSERT(register_packet->code == ID_REGISTER_SUBSCRIBER_PATTERN, "FATAL ERROR");
+    bool is_socket = upacket.connection!=-1;
 
-    int communication AUTO_CLOSE_FD = open(register_packet->client_named_pipe, O_WRONLY);
+    int communication AUTO_CLOSE_FD = client_channel(upacket);
     if(communication == -1) return;
-    message_box* msg;
-    int fd AUTO_CLOSE_FD = -1;
+    // The pattern is walked as a string, the client is turned away like
+    // one asking for a box that doesn't exist
+    if(strnlen(register_packet->box_name, MAX_BOX_NAME_LEN)==MAX_BOX_NAME_LEN) return;
+    if(!is_socket) fcntl(communication, F_SETFL, fcntl(communication, F_GETFL) | O_NONBLOCK);
+
+    pattern_session session;
+    session.request = register_packet;
+    session.doorbell = 0;
+    session.added = NULL;
+    MTX_INIT(session.lock);
+    COND_INIT(session.wake);
+
+    const char* pattern = register_packet->box_name;
+    size_t prefix = box_pattern_prefix(pattern);
     {
         SCOPED_LOCK(messages_lock);
-        msg = get_msg_box(register_packet->box_name);
-        if(msg==NULL) return;
-        fd = open(msg->name, O_RDONLY);
-        if(fd==-1) return;
-        msg->subscribers++;
-        
+        box_trie_insert(&pattern_sessions, pattern, prefix, &session);
+        box_trie_visit_below(&box_names, pattern, prefix, match_existing_box, &session);
     }
+    session_established(upacket);
 
-    message_packet packet; packet.code = ID_SEND_MSG_SUBSCRIBER;
+    pattern_box* boxes = NULL;
+    pattern_message_packet frames[SESSION_BATCH];
+    bool alive = true;
 
-    while(1){
+    while(alive){
+        pattern_box* added;
+        u64 doorbell;
         {
-            SCOPED_LOCK(msg->wait_mutex);
-            while(msg->size==lseek(fd, 0, SEEK_CUR)){
-                pthread_cond_wait(&msg->write_wait, &msg->wait_mutex);
-            }
+            SCOPED_LOCK(session.lock);
+            added = session.added;
+            session.added = NULL;
+            doorbell = session.doorbell;
         }
-        ssize_t rread = read(fd, &packet, sizeof(packet));
-        if(rread == 0) continue;
 
-        if(rread!=sizeof(packet)) break;
+        // The client learns a box's name once, before any of its messages
+        while(added!=NULL){
+            pattern_box* box = added;
+            added = box->next;
+            box->next = boxes;
+            boxes = box;
+
+            memset(&frames[0], 0, sizeof(frames[0]));
+            frames[0].code = ID_SEND_MSG_PATTERN;
+            frames[0].kind = PATTERN_FRAME_BOX;
+            frames[0].box_id = box->msg->id;
+            frames[0].packet.code = ID_SEND_MSG_SUBSCRIBER;
+            strcpy(frames[0].packet.message, box->msg->name);
+            if(alive) alive = send_frame(communication, is_socket, &frames[0], sizeof(frames[0]));
+        }
 
-        packet.code = ID_SEND_MSG_SUBSCRIBER;
-        ssize_t wwrote = write(communication, &packet, sizeof(packet));
-        if(wwrote!=sizeof(packet)){
-            if(errno!=SIGPIPE && errno!=0){
-                fprintf(stderr, "unknown error occured! sub disconnected!\n");
-            }
-            break;
+        size_t delivered = 0;
+        for(pattern_box* box=boxes;alive && box!=NULL;box=box->next){
+            ssize_t sent = deliver_pattern_box(box, communication, is_socket, frames);
+            if(sent<0) alive = false;
+            else delivered += (size_t)sent;
         }
+        if(!alive || delivered>0) continue;
 
+        // Pattern sessions aren't handed off, they're drained: they leave once
+        // they caught up with a broker that's closing or handing off
+        SCOPED_LOCK(session.lock);
+        while(session.doorbell==doorbell && atomic_load(&broker_state)<BROKER_CLOSING){
+            pthread_cond_wait(&session.wake, &session.lock);
+        }
+        if(session.doorbell==doorbell) alive = false;
     }
 
-    SCOPED_LOCK(msg->wait_mutex);
-    msg->subscribers--;
+    // No box can be matched to the session once it's out of the trie
+    {
+        SCOPED_LOCK(messages_lock);
+        box_trie_remove(&pattern_sessions, pattern, prefix, &session);
+    }
+    {
+        SCOPED_LOCK(session.lock);
+        while(session.added!=NULL){
+            pattern_box* box = session.added;
+            session.added = box->next;
+            box->next = boxes;
+            boxes = box;
+        }
+    }
+    while(boxes!=NULL){
+        pattern_box* box = boxes;
+        boxes = box->next;
+        release_pattern_box(box);
+    }
+    MTX_DESTORY(session.lock);
+    COND_DESTROY(session.wake);
 }
 
 void handle_packet_create_msg_box(unknown_packet upacket){
     create_msg_box_packet* packet = upacket.packet_data;
     
-    int connection AUTO_CLOSE_FD = open(packet->client_named_pipe, O_WRONLY);
+    int connection AUTO_CLOSE_FD = client_channel(upacket);
     if(connection==-1) return;
 
-    message_box* box;
-    {
+    bool known_compression = packet->compression<=BOX_COMPRESSION_LZ77;
+    bool valid_name = strnlen(packet->box_name, MAX_BOX_NAME_LEN)<MAX_BOX_NAME_LEN;
+    message_box* box = NULL;
+    if(known_compression && valid_name){
         SCOPED_LOCK(messages_lock);
         box = get_msg_box(packet->box_name);
         if(box==NULL){
-            add_msg_box(packet->box_name);
+            add_msg_box(packet->box_name, &packet->retention, packet->compression);
         }
     }
     response_create_msg_box_packet response_packet;
     response_packet.code = (u8)ID_RESPONSE_CREATE_MSG_BOX;
     memset(response_packet.error_message, 0, ERROR_MSG_LEN);
 
-    if(box==NULL){
+    if(!known_compression){
+        response_packet.error_code = -1;
+        strcpy(response_packet.error_message, "UNKNOWN COMPRESSION!");
+    }else if(!valid_name){
+        response_packet.error_code = -1;
+        strcpy(response_packet.error_message, "BOX NAME TOO LONG!");
+    }else if(box==NULL){
         response_packet.error_code = 0;
     }else{
         response_packet.error_code = -1;
@@ -281,7 +2060,7 @@ void handle_packet_create_msg_box(unknown_packet upacket){
 void handle_packet_remove_msg_box(unknown_packet upacket){
     remove_msg_box_packet* packet = upacket.packet_data;
 
-    int connection AUTO_CLOSE_FD = open(packet->client_named_pipe, O_WRONLY);
+    int connection AUTO_CLOSE_FD = client_channel(upacket);
     if(connection==-1) return;
 
     message_box* box;
@@ -322,95 +2101,541 @@ void handle_packet_remove_msg_box(unknown_packet upacket){
 }
 
 void handle_packet_list_msg_box(unknown_packet upacket){
-    list_msg_box_packet* packet = upacket.packet_data;
-
-    int connection AUTO_CLOSE_FD = open(packet->client_named_pipe, O_WRONLY);
+    int connection AUTO_CLOSE_FD = client_channel(upacket);
     if(connection==-1) return;
 
-    list_msg_box_response_packet response_packet;
-    response_packet.code = ID_RESPONSE_LIST_MSG_BOX;
+    list_msg_box_response_packet rows[LIST_BATCH_ROWS];
+    size_t count = 0;
 
     SCOPED_LOCK(messages_lock);
     if(msg_boxes==NULL){
-        memset(response_packet.box_name, 0, MAX_BOX_NAME_LEN);
-        response_packet.is_last = true;
-        ssize_t _temp_ = write(connection, &response_packet, sizeof(response_packet));
+        rows[0].code = ID_RESPONSE_LIST_MSG_BOX;
+        memset(rows[0].box_name, 0, MAX_BOX_NAME_LEN);
+        rows[0].is_last = true;
+        ssize_t _temp_ = write(connection, &rows[0], sizeof(rows[0]));
         (void) _temp_;
         return;
     }
 
     for(message_box* it=msg_boxes;it!=NULL;it=it->next){
-        strcpy(response_packet.box_name, it->name);
-        response_packet.is_last = it->next==NULL;
-        response_packet.box_size = it->size;
-        response_packet.n_publishers = it->publishers;
-        response_packet.n_subscribers = it->subscribers;
-        ssize_t _temp_ = write(connection, &response_packet, sizeof(response_packet));
+        list_msg_box_response_packet* row = &rows[count++];
+        row->code = ID_RESPONSE_LIST_MSG_BOX;
+        memcpy(row->box_name, it->name, MAX_BOX_NAME_LEN);
+        row->is_last = it->next==NULL;
+        {
+            SCOPED_LOCK(it->wait_mutex);
+            row->box_size = atomic_load(&it->committed) - box_index_head(&it->index);
+        }
+        row->n_publishers = it->publishers;
+        row->n_subscribers = it->subscribers;
+
+        if(count==LIST_BATCH_ROWS || it->next==NULL){
+            size_t bytes = count*sizeof(rows[0]);
+            // A manager that went away takes no more rows
+            if(write(connection, rows, bytes)!=(ssize_t)bytes) return;
+            count = 0;
+        }
+    }
+}
+
+// Stats lines are sent one behind, so the last one can be flagged
+typedef struct{
+    int connection;
+    bool pending;
+    stats_response_packet packet;
+} stats_writer;
+
+__attribute__((format(printf, 2, 3)))
+void stats_line(stats_writer* writer, const char* format, ...){
+    if(writer->pending){
+        ssize_t _temp_ = write(writer->connection, &writer->packet, sizeof(writer->packet));
         (void) _temp_;
     }
+
+    memset(&writer->packet, 0, sizeof(writer->packet));
+    writer->packet.code = (u8)ID_RESPONSE_STATS;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(writer->packet.line, STATS_LINE_LEN, format, args);
+    va_end(args);
+    writer->pending = true;
+}
+
+void stats_finish(stats_writer* writer){
+    writer->packet.is_last = true;
+    ssize_t _temp_ = write(writer->connection, &writer->packet, sizeof(writer->packet));
+    (void) _temp_;
+}
+
+void handle_packet_stats(unknown_packet upacket){
+    int connection AUTO_CLOSE_FD = client_channel(upacket);
+    if(connection==-1) return;
+
+    stats_snapshot* snapshot = malloc(sizeof(stats_snapshot));
+    ALWAYS_ASSERT(snapshot!=NULL, "NO MEMORY!");
+    stats_collect(snapshot);
+    u64 deltas[STATS_COUNTERS];
+    double interval = stats_interval(snapshot, deltas);
+
+    stats_writer writer = { connection, false, {0} };
+    size_t waiting;
+    {
+        SCOPED_LOCK(admission_lock);
+        waiting = admission_waiting;
+    }
+    stats_line(&writer, "broker workers=%zu max_workers=%zu queue_depth=%zu queue_capacity=%zu admission_waiting=%zu",
+        pool_live(&workers), workers.config.max_workers, pool_pending(&workers), workers.config.capacity, waiting);
+    stats_line(&writer, "control workers=%zu queue_depth=%zu queue_capacity=%zu",
+        pool_live(&control_workers), pool_pending(&control_workers), control_workers.config.capacity);
+
+    for(int i=0;i<STATS_COUNTERS;i++){
+        stats_line(&writer, "counter name=%s total=%lu per_s=%.1f",
+            stats_counter_name((enum StatsCounter)i), snapshot->counters[i],
+            interval>0 ? (double)deltas[i]/interval : 0.0);
+    }
+
+    for(int i=0;i<STATS_HISTOGRAMS;i++){
+        const u64* buckets = snapshot->buckets[i];
+        stats_line(&writer, "latency name=%s samples=%lu p50_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu",
+            stats_histogram_name((enum StatsHistogram)i), stats_samples(buckets),
+            stats_percentile(buckets, 0.5), stats_percentile(buckets, 0.99),
+            stats_percentile(buckets, 0.999), stats_percentile(buckets, 1.0));
+    }
+    free(snapshot);
+
+    SCOPED_LOCK(messages_lock);
+    for(message_box* it=msg_boxes;it!=NULL;it=it->next){
+        SCOPED_LOCK(it->wait_mutex);
+        stats_line(&writer, "box name=%s messages=%lu bytes=%lu first=%lu publishers=%lu subscribers=%lu",
+            it->name, it->index.messages, atomic_load(&it->committed) - box_index_head(&it->index),
+            box_index_first(&it->index), it->publishers, it->subscribers);
+
+        for(publisher_session* session=it->sessions;session!=NULL;session=session->next){
+            stats_line(&writer, "publisher box=%s messages=%lu", it->name, session->messages);
+        }
+        for(subscriber_cursor* cursor=it->cursors;cursor!=NULL;cursor=cursor->next){
+            stats_line(&writer, "subscriber box=%s seq=%lu lag=%lu dropped=%lu lag_budget=%lu",
+                it->name, cursor->seq, cursor->lag, cursor->dropped, cursor->lag_budget);
+        }
+    }
+
+    stats_finish(&writer);
+}
+
+// Starts the socket listener thread, if the broker listens on a socket
+void start_listener(){
+    if(socket_listener==-1) return;
+    // Clears the stop of a handoff that failed
+    eventfd_t stops;
+    eventfd_read(listener_stop, &stops);
+    ALWAYS_ASSERT(pthread_create(&listener_thread, NULL, socket_listener_main, NULL)==0, "FAILED TO SPAWN THREAD!");
+}
+
+void stop_listener(){
+    if(socket_listener==-1) return;
+    ALWAYS_ASSERT(eventfd_write(listener_stop, 1)==0, "FAILED TO STOP THE LISTENER!");
+    ALWAYS_ASSERT(pthread_join(listener_thread, NULL)==0, "FAILED TO JOIN THE LISTENER!");
+}
+
+void kick_pattern_session(void* session, void* context){
+    (void) context;
+    ring_pattern_session(session);
+}
+
+// Gets every session to look at broker_state: publishers are interrupted
+// in their read from the client with SIGUSR1, everyone waiting on a box or
+// a doorbell is woken up
+void kick_sessions(){
+    SCOPED_LOCK(messages_lock);
+    for(message_box* it=msg_boxes;it!=NULL;it=it->next){
+        SCOPED_LOCK(it->wait_mutex);
+        for(publisher_session* session=it->sessions;session!=NULL;session=session->next){
+            pthread_kill(session->thread, SIGUSR1);
+        }
+        pthread_cond_broadcast(&it->write_wait);
+        pthread_cond_broadcast(&it->room_wait);
+    }
+    // Whether or not they matched a box yet
+    box_trie_visit_below(&pattern_sessions, "", 0, kick_pattern_session, NULL);
+}
+
+// Waits for the requests counted in in_flight to be done. Sessions are
+// kicked over and over, a publisher that read broker_state just before it
+// changed blocks in the read of its client again. Returns false if they
+// took more than drain_timeout_ms
+bool wait_requests(_Atomic size_t* in_flight){
+    u64 deadline = stats_now_ns() + drain_timeout_ms*1000000;
+    while(atomic_load(in_flight)>0){
+        if(stats_now_ns()>=deadline) return false;
+        kick_sessions();
+        usleep(DRAIN_POLL_MS*1000);
+    }
+    return true;
+}
+
+// Ends the broker once its sessions are done with. The pool workers are
+// never joined, idle ones (and past drain_timeout_ms, sessions) may still be
+// running, and exit() would tear the process down under them: only the
+// logs are flushed, the rest goes with _exit
+void leave_broker(){
+    log_flush();
+    fflush(stdout);
+    _exit(0);
+}
+
+// SIGTERM: stops taking requests in, lets the publishers take in what their
+// clients already sent and then the subscribers deliver everything in their
+// boxes, syncs the boxes to disk and exits. Clients learn about it from
+// their end of the session closing, as with any session that ends
+void drain_broker(int fifo){
+    LOG("draining the broker");
+    atomic_store(&broker_state, BROKER_DRAINING);
+    stop_listener();
+    if(pipe_name!=NULL) unlink(pipe_name);
+    if(socket_name!=NULL) unlink(socket_name);
+    unlink(handoff_name);
+
+    // Requests written before the name went away are turned down like the
+    // ones already queued, see run_packet
+    fcntl(fifo, F_SETFL, fcntl(fifo, F_GETFL) | O_NONBLOCK);
+    while(read_register_packet(fifo));
+
+    bool drained = wait_requests(&publishers_in_flight);
+    atomic_store(&broker_state, BROKER_CLOSING);
+    drained = wait_requests(&requests_in_flight) && drained;
+    if(!drained){
+        fprintf(stderr, "sessions still running after %lums, exiting anyway\n", drain_timeout_ms);
+    }
+
+    SCOPED_LOCK(messages_lock);
+    for(message_box* it=msg_boxes;it!=NULL;it=it->next){
+        SCOPED_LOCK(it->wait_mutex);
+        fdatasync(it->fd_internal);
+        fdatasync(it->index.fd);
+    }
+    leave_broker();
+}
+
+// Sends the broker taking over everything, in the order it needs it: the
+// register pipe and sockets, the boxes and then the sessions in them
+bool send_handoff(int channel, int fifo, int fifo_internal){
+    handoff_record record;
+    memset(&record, 0, sizeof(record));
+    record.kind = HANDOFF_BROKER;
+    int fds[HANDOFF_MAX_FDS] = { fifo, fifo_internal, handoff_listener, socket_listener };
+
+    SCOPED_LOCK(messages_lock);
+    record.box_id = next_box_id;
+    if(!handoff_send(channel, &record, fds, socket_listener==-1 ? 3 : 4)) return false;
+
+    for(message_box* it=msg_boxes;it!=NULL;it=it->next){
+        memset(&record, 0, sizeof(record));
+        record.kind = HANDOFF_BOX;
+        record.box_id = it->id;
+        record.retention = it->retention;
+        record.compression = it->compression;
+        memcpy(record.box_name, it->name, MAX_BOX_NAME_LEN);
+        if(!handoff_send(channel, &record, &it->fd_internal, 1)) return false;
+    }
+
+    SCOPED_LOCK(parked_lock);
+    for(parked_session* it=parked_sessions;it!=NULL;it=it->next){
+        if(!handoff_send(channel, &it->record, it->fds, it->n_fds)) return false;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.kind = HANDOFF_DONE;
+    return handoff_send(channel, &record, NULL, 0);
+}
+
+// A broker connected to take over (see handoff.h): parks every session,
+// sends it all and exits once it has it. Returns if the handoff failed,
+// with the broker running again as before
+void hand_off_broker(int fifo, int fifo_internal){
+    int channel AUTO_CLOSE_FD = accept4(handoff_listener, NULL, NULL, SOCK_CLOEXEC);
+    if(channel==-1) return;
+    LOG("handing off to a new broker");
+    atomic_store(&broker_state, BROKER_HANDING_OFF);
+    stop_listener();
+
+    handoff_record ack;
+    int fds[HANDOFF_MAX_FDS];
+    size_t n_fds;
+    if(wait_requests(&requests_in_flight) && send_handoff(channel, fifo, fifo_internal) &&
+        handoff_recv(channel, &ack, fds, &n_fds) && ack.kind==HANDOFF_DONE){
+        // The names are the new broker's now, they stay. Every session is
+        // parked, out of the workers
+        leave_broker();
+    }
+
+    fprintf(stderr, "HANDOFF FAILED! CARRYING ON\n");
+    atomic_store(&broker_state, BROKER_RUNNING);
+    start_listener();
+    resume_parked_sessions();
+}
+
+// MBROKER_TAKEOVER: carries on in place of the broker of the same register
+// pipe, see handoff.h. The sessions it hands over are resumed later, once
+// everything is running
+void take_over_broker(int* fifo, int* fifo_internal){
+    int channel AUTO_CLOSE_FD = handoff_connect(handoff_name);
+    ALWAYS_ASSERT(channel!=-1, "NO BROKER TO TAKE OVER FROM! %i", errno);
+
+    handoff_record record;
+    int fds[HANDOFF_MAX_FDS];
+    size_t n_fds;
+    while(1){
+        ALWAYS_ASSERT(handoff_recv(channel, &record, fds, &n_fds), "HANDOFF FAILED! %i", errno);
+        switch((enum HandoffKind)record.kind){
+            case HANDOFF_BROKER:
+                ALWAYS_ASSERT(n_fds>=3, "HANDOFF FAILED! NO REGISTER PIPE");
+                *fifo = fds[0];
+                *fifo_internal = fds[1];
+                handoff_listener = fds[2];
+                socket_listener = n_fds>3 ? fds[3] : -1;
+                next_box_id = record.box_id;
+                break;
+            case HANDOFF_BOX: {
+                ALWAYS_ASSERT(n_fds==1, "HANDOFF FAILED! NO BOX FILE");
+                SCOPED_LOCK(messages_lock);
+                insert_msg_box(record.box_name, &record.retention, record.compression, record.box_id, fds[0]);
+                break;
+            }
+            case HANDOFF_PUBLISHER:
+            case HANDOFF_SUBSCRIBER:
+                ALWAYS_ASSERT(n_fds>=1, "HANDOFF FAILED! NO CLIENT");
+                park_session(&record, fds, n_fds);
+                break;
+            case HANDOFF_DONE:
+                ALWAYS_ASSERT(handoff_send(channel, &record, NULL, 0), "HANDOFF FAILED! %i", errno);
+                LOG("took over from the old broker");
+                return;
+            default:
+                PANIC("UNKNOWN HANDOFF RECORD: %i", (int)record.kind);
+        }
+    }
+}
+
+// Keeps a session for the broker taking over, which the fds go to
+void park_session(const handoff_record* record, const int* fds, size_t n_fds){
+    parked_session* parked = malloc(sizeof(parked_session));
+    ALWAYS_ASSERT(parked!=NULL, "NO MEMORY!");
+    parked->record = *record;
+    for(size_t i=0;i<n_fds;i++){
+        ALWAYS_ASSERT(fds[i]!=-1, "FAILED TO DUP SESSION FD! %i", errno);
+        parked->fds[i] = fds[i];
+    }
+    parked->n_fds = n_fds;
+
+    SCOPED_LOCK(parked_lock);
+    parked->next = parked_sessions;
+    parked_sessions = parked;
+}
+
+// A publisher hands on its client's end and its credit pipe, if it has one
+void park_publisher(message_box* msg, const register_publisher_packet* request, bool is_socket,
+                    int connection, int credit_fifo, u32 window, u32 owed){
+    handoff_record record;
+    memset(&record, 0, sizeof(record));
+    record.kind = HANDOFF_PUBLISHER;
+    record.is_socket = is_socket;
+    record.credit_window = window;
+    record.owed_credits = owed;
+    memcpy(record.box_name, msg->name, MAX_BOX_NAME_LEN);
+    memcpy(record.client_named_pipe, request->client_named_pipe, MAX_PIPE_NAME_LEN);
+
+    int fds[2] = { dup(connection), credit_fifo==-1 ? -1 : dup(credit_fifo) };
+    park_session(&record, fds, credit_fifo==-1 ? 1 : 2);
+}
+
+// A subscriber hands on its client's end, and carries on from its cursor
+void park_subscriber(message_box* msg, const register_subscriber_packet* request, bool is_socket,
+                     int connection, const subscriber_cursor* cursor){
+    handoff_record record;
+    memset(&record, 0, sizeof(record));
+    record.kind = HANDOFF_SUBSCRIBER;
+    record.is_socket = is_socket;
+    record.seq = cursor->seq;
+    record.lag_policy = cursor->lag_policy;
+    record.lag_budget = cursor->lag_budget;
+    memcpy(record.box_name, msg->name, MAX_BOX_NAME_LEN);
+    memcpy(record.client_named_pipe, request->client_named_pipe, MAX_PIPE_NAME_LEN);
+
+    int fd = dup(connection);
+    park_session(&record, &fd, 1);
+}
+
+// Carries on a parked session through the handler of its register request,
+// as if its client had just registered, only with the fds it had and from
+// where it was left
+void resume_session(parked_session* parked){
+    handoff_record* record = &parked->record;
+    void* data;
+    if(record->kind==HANDOFF_PUBLISHER){
+        register_publisher_packet* request = calloc(1, sizeof(register_publisher_packet));
+        ALWAYS_ASSERT(request!=NULL, "NO MEMORY!");
+        request->code = (u8)ID_REGISTER_PUBLISHER;
+        memcpy(request->client_named_pipe, record->client_named_pipe, MAX_PIPE_NAME_LEN);
+        memcpy(request->box_name, record->box_name, MAX_BOX_NAME_LEN);
+        request->credit_window = record->credit_window;
+        data = request;
+    }else{
+        register_subscriber_packet* request = calloc(1, sizeof(register_subscriber_packet));
+        ALWAYS_ASSERT(request!=NULL, "NO MEMORY!");
+        request->code = (u8)ID_REGISTER_SUBSCRIBER;
+        memcpy(request->client_named_pipe, record->client_named_pipe, MAX_PIPE_NAME_LEN);
+        memcpy(request->box_name, record->box_name, MAX_BOX_NAME_LEN);
+        request->start_mode = (u8)SUB_START_OFFSET;
+        request->start_value = record->seq;
+        request->lag_policy = record->lag_policy;
+        request->lag_budget = record->lag_budget;
+        data = request;
+    }
+
+    unknown_packet* packet = new_request(data, record->is_socket ? parked->fds[0] : -1);
+    if(!record->is_socket) packet->client_fd = parked->fds[0];
+    packet->credit_fd = parked->n_fds>1 ? parked->fds[1] : -1;
+    packet->owed_credits = record->owed_credits;
+    packet->resumed = true;
+    free(parked);
+    dispatch_packet(packet);
+}
+
+// Subscribers go first: retention only spares what registered cursors
+// haven't read yet, so no publisher may append to a box before the
+// subscribers handed over with it are back in it
+void resume_parked_sessions(){
+    parked_session* parked;
+    {
+        SCOPED_LOCK(parked_lock);
+        parked = parked_sessions;
+        parked_sessions = NULL;
+    }
+
+    parked_session* publishers = NULL;
+    while(parked!=NULL){
+        parked_session* next = parked->next;
+        if(parked->record.kind==HANDOFF_SUBSCRIBER){
+            atomic_fetch_add(&subscribers_resuming, 1);
+            resume_session(parked);
+        }else{
+            parked->next = publishers;
+            publishers = parked;
+        }
+        parked = next;
+    }
+
+    u64 deadline = stats_now_ns() + drain_timeout_ms*1000000;
+    while(atomic_load(&subscribers_resuming)>0 && stats_now_ns()<deadline){
+        usleep(DRAIN_POLL_MS*1000);
+    }
+
+    while(publishers!=NULL){
+        parked_session* next = publishers->next;
+        resume_session(publishers);
+        publishers = next;
+    }
 }
 
 void print_usage(){
-    fprintf(stderr, "usage: mbroker <register_pipe_name> <max_sessions>\n");
+    fprintf(stderr, "usage: mbroker <register_pipe_name> <max_sessions> [socket_path]\n");
+    fprintf(stderr, "set MBROKER_LOG=quiet|normal|verbose to choose how much is logged\n");
+    fprintf(stderr, "max_sessions caps the worker threads, MBROKER_MIN_WORKERS (%i) are kept running,\n"
+                    "the others exit after MBROKER_WORKER_IDLE_MS (%i) idle, with MBROKER_WORKER_STACK_KB (%i) stacks\n",
+        WORKERS_MIN, WORKERS_IDLE_MS, WORKERS_STACK_KB);
+    fprintf(stderr, "create, remove, list and stats run on MBROKER_CONTROL_WORKERS (%i) workers of their own\n",
+        CONTROL_WORKERS);
+    fprintf(stderr, "SIGTERM drains the broker, giving sessions MBROKER_DRAIN_MS (%i) to finish. A broker started\n"
+                    "with MBROKER_TAKEOVER=1, in the same directory, takes over the running one's sessions,\n"
+                    "but for shared memory (--shm) and pattern ones: their clients are disconnected\n",
+        DRAIN_TIMEOUT_MS);
+}
+
+void add_msg_box(const char* name, const box_retention* retention, u8 compression) {
+    insert_msg_box(name, retention, compression, next_box_id++, -1);
 }
 
-void add_msg_box(const char* name) {
+// Registers a box, with the file of a box another broker handed over and
+// its index as persisted, or when box_fd is -1 new empty ones
+void insert_msg_box(const char* name, const box_retention* retention, u8 compression, u32 id, int box_fd) {
     message_box* new_box = (message_box*) malloc(sizeof(message_box));
     if(new_box == NULL) {
         PANIC("Failed to allocate memory for new message box.");
     }
     new_box->next = NULL;
-    strcpy(new_box->name, name);
+    new_box->previous = msg_boxes_tail;
+    ALWAYS_ASSERT(name_key_pad(new_box->name, name, MAX_BOX_NAME_LEN), "BOX NAME TOO LONG!");
+    new_box->name_hash = name_key_hash(new_box->name, MAX_BOX_NAME_LEN);
     new_box->publishers=0;
     new_box->subscribers=0;
-    new_box->size=0;
+    new_box->retention = *retention;
+    new_box->compression = compression;
+    new_box->cursors = NULL;
+    new_box->sessions = NULL;
+    new_box->watchers = NULL;
+    new_box->id = id;
+    atomic_init(&new_box->timed, false);
 
     MTX_INIT(new_box->wait_mutex);
     COND_INIT(new_box->write_wait);
-
-    new_box->fd_internal_w = open(new_box->name, O_WRONLY | O_CREAT, 0644);
+    COND_INIT(new_box->room_wait);
+
+    // A new box starts empty, whatever an earlier box of the same name left
+    bool created = box_fd==-1;
+    if(created) box_fd = open(new_box->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    new_box->fd_internal = box_fd;
+    ALWAYS_ASSERT(new_box->fd_internal!=-1, "FAILED TO CREATE BOX FILE: %s (%i)", new_box->name, errno);
+    ALWAYS_ASSERT(box_index_open(&new_box->index, new_box->name, new_box->fd_internal, created)==0,
+        "FAILED TO CREATE BOX INDEX: %s (%i)", new_box->name, errno);
+    atomic_init(&new_box->tail, new_box->index.end);
+    atomic_init(&new_box->committed, new_box->index.end);
 
     if(msg_boxes == NULL) {
         msg_boxes = new_box;
     } else {
-        message_box* current = msg_boxes;
-        while (current->next != NULL) {
-            current = current->next;
-        }
-        current->next = new_box;
+        msg_boxes_tail->next = new_box;
     }
+    msg_boxes_tail = new_box;
+    hash_map_insert(&box_registry, new_box->name_hash, new_box);
+
+    // Only the sessions whose pattern starts with a prefix of the name can match it
+    box_trie_insert(&box_names, new_box->name, strlen(new_box->name), new_box);
+    box_trie_visit_prefixes(&pattern_sessions, new_box->name, match_new_box, new_box);
+}
+
+bool box_name_matches(const void* box, const void* key){
+    return name_key_equal(((const message_box*)box)->name, key, MAX_BOX_NAME_LEN);
 }
 
 void remove_msg_box(const char* name) {
-    message_box* current = msg_boxes;
-    message_box* previous = NULL;
-
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0) {
-            if (previous == NULL) {
-                msg_boxes = current->next;
-            } else {
-                previous->next = current->next;
-            }
-            close(current->fd_internal_w);
-            MTX_DESTORY(current->wait_mutex);
-            COND_DESTROY(current->write_wait);
-            unlink(current->name);
-            free(current);
-            return;
-        }
-        previous = current;
-        current = current->next;
+    char key[MAX_BOX_NAME_LEN];
+    if(!name_key_pad(key, name, MAX_BOX_NAME_LEN)) return;
+    message_box* box = hash_map_remove(&box_registry, name_key_hash(key, MAX_BOX_NAME_LEN), key);
+    if(box == NULL) return;
+
+    if(box->previous == NULL) {
+        msg_boxes = box->next;
+    } else {
+        box->previous->next = box->next;
+    }
+    if(box->next == NULL) {
+        msg_boxes_tail = box->previous;
+    } else {
+        box->next->previous = box->previous;
     }
+    box_trie_remove(&box_names, box->name, strlen(box->name), box);
+    close(box->fd_internal);
+    box_index_close(&box->index, box->name, true);
+    MTX_DESTORY(box->wait_mutex);
+    COND_DESTROY(box->write_wait);
+    COND_DESTROY(box->room_wait);
+    unlink(box->name);
+    free(box);
 }
 
 message_box* get_msg_box(const char* name) {
-    message_box* current = msg_boxes;
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
-}
\ No newline at end of file
+    // Names from packets aren't trusted to be padded, or even terminated
+    char key[MAX_BOX_NAME_LEN];
+    if(!name_key_pad(key, name, MAX_BOX_NAME_LEN)) return NULL;
+    return hash_map_find(&box_registry, name_key_hash(key, MAX_BOX_NAME_LEN), key);
+}
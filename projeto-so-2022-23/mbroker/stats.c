@@ -0,0 +1,179 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static _Thread_local stats_thread* local_stats = NULL;
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_thread* threads = NULL;
+
+// What threads that exited counted, guarded by threads_lock
+static stats_snapshot retired;
+
+// Guarded by threads_lock, for stats_interval
+static u64 last_counters[STATS_COUNTERS];
+static u64 last_ns = 0;
+
+// Exiting threads fold their copy into retired instead of keeping it around
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void retire_thread(void* stats_void){
+    stats_thread* stats = stats_void;
+    local_stats = NULL;
+
+    SCOPED_LOCK(threads_lock);
+    for(size_t i=0;i<STATS_COUNTERS;i++){
+        retired.counters[i] += atomic_load_explicit(&stats->counters[i], memory_order_relaxed);
+    }
+    for(size_t h=0;h<STATS_HISTOGRAMS;h++){
+        for(size_t i=0;i<STATS_BUCKETS;i++){
+            retired.buckets[h][i] += atomic_load_explicit(&stats->buckets[h][i], memory_order_relaxed);
+        }
+    }
+
+    for(stats_thread** it=&threads;*it!=NULL;it=&(*it)->next){
+        if(*it==stats){
+            *it = stats->next;
+            break;
+        }
+    }
+    free(stats);
+}
+
+static void create_thread_key(){
+    ALWAYS_ASSERT(pthread_key_create(&thread_key, retire_thread)==0, "FAILED TO CREATE THREAD KEY!");
+}
+
+static stats_thread* register_thread(){
+    stats_thread* stats = calloc(1, sizeof(stats_thread));
+    ALWAYS_ASSERT(stats!=NULL, "NO MEMORY!");
+
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_setspecific(thread_key, stats);
+
+    SCOPED_LOCK(threads_lock);
+    stats->next = threads;
+    threads = stats;
+    if(last_ns==0) last_ns = stats_now_ns();
+    local_stats = stats;
+    return stats;
+}
+
+// Only the owning thread ever writes its copy, so no atomic read-modify-write
+static void bump(_Atomic u64* value, u64 by){
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed)+by, memory_order_relaxed);
+}
+
+static size_t bucket_of(u64 value){
+    if(value < (1u << STATS_SUB_BITS)) return (size_t)value;
+    if(value >= (1ull << STATS_MAX_BITS)) return STATS_BUCKETS-1;
+
+    unsigned int msb = 63u - (unsigned int)__builtin_clzll(value);
+    unsigned int shift = msb - STATS_SUB_BITS;
+    return ((size_t)(shift+1) << STATS_SUB_BITS) + (size_t)((value >> shift) & ((1u << STATS_SUB_BITS)-1));
+}
+
+static u64 bucket_low(size_t bucket){
+    if(bucket < (1u << STATS_SUB_BITS)) return (u64)bucket;
+
+    unsigned int shift = (unsigned int)(bucket >> STATS_SUB_BITS) - 1;
+    u64 sub = (u64)(bucket & ((1u << STATS_SUB_BITS)-1));
+    return ((1ull << STATS_SUB_BITS) + sub) << shift;
+}
+
+u64 stats_now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec*1000000000ull + (u64)ts.tv_nsec;
+}
+
+void stats_count(enum StatsCounter counter, u64 value){
+    stats_thread* stats = local_stats!=NULL ? local_stats : register_thread();
+    bump(&stats->counters[counter], value);
+}
+
+void stats_record(enum StatsHistogram histogram, u64 ns){
+    stats_thread* stats = local_stats!=NULL ? local_stats : register_thread();
+    bump(&stats->buckets[histogram][bucket_of(ns)], 1);
+}
+
+void stats_collect(stats_snapshot* snapshot){
+    SCOPED_LOCK(threads_lock);
+    memcpy(snapshot, &retired, sizeof(stats_snapshot));
+    for(stats_thread* it=threads;it!=NULL;it=it->next){
+        for(size_t i=0;i<STATS_COUNTERS;i++){
+            snapshot->counters[i] += atomic_load_explicit(&it->counters[i], memory_order_relaxed);
+        }
+        for(size_t h=0;h<STATS_HISTOGRAMS;h++){
+            for(size_t i=0;i<STATS_BUCKETS;i++){
+                snapshot->buckets[h][i] += atomic_load_explicit(&it->buckets[h][i], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+double stats_interval(const stats_snapshot* snapshot, u64 deltas[STATS_COUNTERS]){
+    SCOPED_LOCK(threads_lock);
+    u64 now = stats_now_ns();
+    for(size_t i=0;i<STATS_COUNTERS;i++){
+        deltas[i] = snapshot->counters[i] - last_counters[i];
+        last_counters[i] = snapshot->counters[i];
+    }
+
+    double seconds = (double)(now-last_ns)/1e9;
+    last_ns = now;
+    return seconds;
+}
+
+u64 stats_samples(const u64 buckets[STATS_BUCKETS]){
+    u64 samples = 0;
+    for(size_t i=0;i<STATS_BUCKETS;i++){
+        samples += buckets[i];
+    }
+    return samples;
+}
+
+u64 stats_percentile(const u64 buckets[STATS_BUCKETS], double p){
+    u64 samples = stats_samples(buckets);
+    if(samples==0) return 0;
+
+    u64 rank = (u64)(p*(double)samples);
+    if(rank>=samples) rank = samples-1;
+
+    u64 seen = 0;
+    for(size_t i=0;i<STATS_BUCKETS;i++){
+        seen += buckets[i];
+        if(seen>rank) return i+1<STATS_BUCKETS ? bucket_low(i+1)-1 : bucket_low(i);
+    }
+    return bucket_low(STATS_BUCKETS-1);
+}
+
+const char* stats_counter_name(enum StatsCounter counter){
+    switch(counter){
+        case STATS_MSGS_IN:       return "msgs_in";
+        case STATS_BYTES_IN:      return "bytes_in";
+        case STATS_BYTES_STORED:  return "bytes_stored";
+        case STATS_MSGS_OUT:      return "msgs_out";
+        case STATS_BYTES_OUT:     return "bytes_out";
+        case STATS_SYSCALLS:      return "syscalls";
+        case STATS_REGISTRATIONS: return "registrations";
+        case STATS_STEALS:        return "steals";
+        case STATS_COUNTERS:
+        default:                  return "unknown";
+    }
+}
+
+const char* stats_histogram_name(enum StatsHistogram histogram){
+    switch(histogram){
+        case STATS_PUBLISH_TO_DELIVER: return "publish_to_deliver";
+        case STATS_REGISTRATION:       return "registration";
+        case STATS_POOL_SUBMIT:        return "pool_submit_wait";
+        case STATS_POOL_IDLE:          return "pool_idle_wait";
+        case STATS_CONTROL:            return "control";
+        case STATS_HISTOGRAMS:
+        default:                       return "unknown";
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Histograms keep 2^STATS_SUB_BITS buckets per power of two, so any value
+// is known to within about 6%, up to 2^STATS_MAX_BITS ns (~5 hours)
+#define STATS_SUB_BITS 4
+#define STATS_MAX_BITS 44
+#define STATS_BUCKETS ((STATS_MAX_BITS-STATS_SUB_BITS+1) << STATS_SUB_BITS)
+
+enum StatsCounter {
+    STATS_MSGS_IN=0,
+    STATS_BYTES_IN,
+    STATS_BYTES_STORED,     // what bytes_in took in the box files, less for compressed boxes
+    STATS_MSGS_OUT,
+    STATS_BYTES_OUT,
+    STATS_SYSCALLS,
+    STATS_REGISTRATIONS,
+    STATS_STEALS,           // batches of tasks a worker took from another's deque
+    STATS_COUNTERS
+};
+
+enum StatsHistogram {
+    STATS_PUBLISH_TO_DELIVER=0, // from a timed message coming in to it being handed to a subscriber
+    STATS_REGISTRATION,         // from reading a register request to the session being set up
+    STATS_POOL_SUBMIT,          // time pool_submit blocked on a full worker pool
+    STATS_POOL_IDLE,            // time workers waited for a task
+    STATS_CONTROL,              // from reading a control request to it being answered
+    STATS_HISTOGRAMS
+};
+
+// Every thread counts into its own copy of the stats, registered on its
+// first use, so recording is a plain load and store with no lock or
+// contended cache line. Readers sum all the copies up on demand, and the
+// copy of a thread that exits is added to a total kept for them.
+typedef struct stats_thread{
+    _Atomic u64 counters[STATS_COUNTERS];
+    _Atomic u64 buckets[STATS_HISTOGRAMS][STATS_BUCKETS];
+    struct stats_thread* next;
+} stats_thread;
+
+typedef struct {
+    u64 counters[STATS_COUNTERS];
+    u64 buckets[STATS_HISTOGRAMS][STATS_BUCKETS];
+} stats_snapshot;
+
+u64 stats_now_ns();
+
+// stats_count: add value to one of the calling thread's counters
+void stats_count(enum StatsCounter counter, u64 value);
+
+// stats_record: add a sample in ns to one of the calling thread's histograms
+void stats_record(enum StatsHistogram histogram, u64 ns);
+
+// stats_collect: sum the stats of every thread up
+void stats_collect(stats_snapshot* snapshot);
+
+// stats_interval: seconds since the previous call (or since the first
+// thread started counting), deltas gets how much each counter grew in that time
+double stats_interval(const stats_snapshot* snapshot, u64 deltas[STATS_COUNTERS]);
+
+// stats_percentile: highest value in the bucket holding the p-th (0 to 1)
+// sample of a histogram, 0 if it is empty
+u64 stats_percentile(const u64 buckets[STATS_BUCKETS], double p);
+
+u64 stats_samples(const u64 buckets[STATS_BUCKETS]);
+
+const char* stats_counter_name(enum StatsCounter counter);
+const char* stats_histogram_name(enum StatsHistogram histogram);
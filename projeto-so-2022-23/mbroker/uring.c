@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "stats.h"
+
+#ifdef MBROKER_URING
+
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static _Thread_local uring* local_ring = NULL;
+static _Thread_local bool local_ring_failed = false;
+
+// The ring goes away with its thread
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static long uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static long uring_register(int fd, u32 opcode, void* arg, u32 count){
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void destroy_ring(void* ring_void){
+    uring* ring = ring_void;
+    local_ring = NULL;
+
+    if(ring->sqes!=NULL) munmap(ring->sqes, ring->sqes_size);
+    if(ring->ring_memory!=NULL) munmap(ring->ring_memory, ring->ring_size);
+    if(ring->fd!=-1) close(ring->fd);
+    free(ring->buffers);
+    free(ring);
+}
+
+static void create_ring_key(){
+    ALWAYS_ASSERT(pthread_key_create(&ring_key, destroy_ring)==0, "FAILED TO CREATE THREAD KEY!");
+}
+
+static int setup_ring(uring* ring){
+    // Only the owning thread ever submits, which spares the kernel some locking
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(ring->fd==-1 && errno==EINVAL){
+        memset(&params, 0, sizeof(params));
+        ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if(ring->fd==-1) return -1;
+    // Both queues in one mapping, and reads at the file position
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS)) return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries*sizeof(u32);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size>cq_size ? sq_size : cq_size;
+    void* memory = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    if(memory==MAP_FAILED) return -1;
+    ring->ring_memory = memory;
+
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if(sqes==MAP_FAILED) return -1;
+    ring->sqes = sqes;
+
+    u8* base = memory;
+    ring->sq_head = (_Atomic u32*)(base + params.sq_off.head);
+    ring->sq_tail = (_Atomic u32*)(base + params.sq_off.tail);
+    ring->sq_mask = (u32*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (u32*)(base + params.sq_off.array);
+    ring->cq_head = (_Atomic u32*)(base + params.cq_off.head);
+    ring->cq_tail = (_Atomic u32*)(base + params.cq_off.tail);
+    ring->cq_mask = (u32*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    // The buffers are pinned once here instead of on every transfer
+    size_t buffer_size = URING_BUFFER_PACKETS*sizeof(message_packet);
+    void* buffers = NULL;
+    if(posix_memalign(&buffers, 4096, URING_BUFFERS*buffer_size)!=0) return -1;
+    ring->buffers = buffers;
+    struct iovec iovs[URING_BUFFERS];
+    for(size_t i=0;i<URING_BUFFERS;i++){
+        iovs[i].iov_base = (u8*)buffers + i*buffer_size;
+        iovs[i].iov_len = buffer_size;
+    }
+    if(uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, URING_BUFFERS)!=0) return -1;
+
+    // Every file slot starts out empty
+    int files[URING_FILES];
+    for(size_t i=0;i<URING_FILES;i++) files[i] = -1;
+    if(uring_register(ring->fd, IORING_REGISTER_FILES, files, URING_FILES)!=0) return -1;
+    return 0;
+}
+
+uring* uring_thread(){
+    if(local_ring!=NULL || local_ring_failed) return local_ring;
+
+    uring* ring = calloc(1, sizeof(uring));
+    ALWAYS_ASSERT(ring!=NULL, "NO MEMORY!");
+    ring->fd = -1;
+    if(setup_ring(ring)!=0){
+        WARN("no io_uring for this worker (%li), falling back to blocking I/O", (long)errno);
+        destroy_ring(ring);
+        local_ring_failed = true;
+        return NULL;
+    }
+
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+message_packet* uring_buffer(uring* ring, int buffer){
+    return ring->buffers + (size_t)buffer*URING_BUFFER_PACKETS;
+}
+
+int uring_attach(uring* ring, int fd){
+    for(int slot=0;slot<URING_FILES;slot++){
+        if(ring->file_used[slot]) continue;
+
+        struct io_uring_files_update update = { (u32)slot, 0, (u64)(uintptr_t)&fd };
+        if(uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1)!=1) return -1;
+        ring->file_used[slot] = true;
+        return slot;
+    }
+    return -1;
+}
+
+void uring_detach(uring* ring, int slot){
+    int fd = -1;
+    struct io_uring_files_update update = { (u32)slot, 0, (u64)(uintptr_t)&fd };
+    uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    ring->file_used[slot] = false;
+}
+
+static struct io_uring_sqe* queue_op(uring* ring, u8 opcode, int slot, const void* data, size_t bytes,
+                                     i64 offset, u32 tag){
+    ALWAYS_ASSERT(ring->queued<URING_ENTRIES && tag<URING_ENTRIES, "TOO MANY IO_URING OPS IN FLIGHT!");
+
+    // Submitted entries are consumed by io_uring_enter before it returns, so
+    // everything from the tail on is free
+    u32 index = (atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->queued) & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = slot;
+    sqe->addr = (u64)(uintptr_t)data;
+    sqe->len = (u32)bytes;
+    sqe->off = (u64)offset;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+void uring_read(uring* ring, int slot, int buffer, size_t bytes, i64 offset, u32 tag){
+    struct io_uring_sqe* sqe = queue_op(ring, IORING_OP_READ_FIXED, slot, uring_buffer(ring, buffer), bytes, offset, tag);
+    sqe->buf_index = (u16)buffer;
+}
+
+void uring_write(uring* ring, int slot, int buffer, size_t bytes, i64 offset, u32 tag){
+    struct io_uring_sqe* sqe = queue_op(ring, IORING_OP_WRITE_FIXED, slot, uring_buffer(ring, buffer), bytes, offset, tag);
+    sqe->buf_index = (u16)buffer;
+}
+
+void uring_link(uring* ring){
+    ALWAYS_ASSERT(ring->queued>0, "NOTHING TO LINK TO!");
+    u32 index = (atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->queued - 1) & *ring->sq_mask;
+    ring->sqes[index].flags |= IOSQE_IO_LINK;
+}
+
+void uring_write_data(uring* ring, int slot, const void* data, size_t bytes, u32 tag){
+    queue_op(ring, IORING_OP_WRITE, slot, data, bytes, -1, tag);
+}
+
+// Moves whatever completed into done/result
+static void reap(uring* ring){
+    u32 head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    u32 tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    for(;head!=tail;head++){
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+        ring->done[cqe->user_data] = true;
+        ring->result[cqe->user_data] = cqe->res;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+}
+
+void uring_cancel(uring* ring, u32 tag, u32 cancel_tag){
+    struct io_uring_sqe* sqe = queue_op(ring, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, cancel_tag);
+    sqe->flags = 0;
+    sqe->addr = tag;
+}
+
+static i32 wait_for(uring* ring, u32 tag, bool interruptible){
+    // Queued ops become visible to the kernel, it takes them on the next enter
+    u32 tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + ring->queued;
+    atomic_store_explicit(ring->sq_tail, tail, memory_order_release);
+    ring->queued = 0;
+
+    reap(ring);
+    while(1){
+        u32 to_submit = tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if(ring->done[tag] && to_submit==0) break;
+
+        // Submitting and waiting share the syscall
+        u32 wait = ring->done[tag] ? 0 : 1;
+        stats_count(STATS_SYSCALLS, 1);
+        long ret = uring_enter(ring->fd, to_submit, wait, wait>0 ? IORING_ENTER_GETEVENTS : 0);
+        ALWAYS_ASSERT(ret>=0 || errno==EINTR || errno==EAGAIN || errno==EBUSY, "IO_URING_ENTER FAILED (%i)", errno);
+        reap(ring);
+        if(interruptible && ret<0 && errno==EINTR && !ring->done[tag]) return -EINTR;
+    }
+    ring->done[tag] = false;
+    return ring->result[tag];
+}
+
+i32 uring_wait(uring* ring, u32 tag){
+    return wait_for(ring, tag, false);
+}
+
+i32 uring_wait_signal(uring* ring, u32 tag){
+    return wait_for(ring, tag, true);
+}
+
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "common.h"
+#include "protocol.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Optional io_uring engine for the named pipe sessions, built with
+// make URING=yes. Without it (or when the kernel refuses to set up a ring)
+// sessions do their I/O with plain blocking syscalls.
+//
+// Every worker thread gets a ring of its own the first time it needs one,
+// with registered buffers the session reads into and writes from, and a
+// table of fixed files the session attaches its fds to. A session can then
+// queue a client read, a box write and a client write and hand them all to
+// the kernel with a single io_uring_enter.
+
+// Submission queue entries, and the most ops a session has in flight
+#define URING_ENTRIES 8
+
+// Registered buffers, each holding a batch of URING_BUFFER_PACKETS packets
+#define URING_BUFFERS 2
+#define URING_BUFFER_PACKETS 32
+
+// Fixed file slots, a session attaches two or three fds
+#define URING_FILES 8
+
+typedef struct{
+    int fd;
+    void* ring_memory;
+    size_t ring_size, sqes_size;
+
+    // submission queue, shared with the kernel
+    _Atomic u32 *sq_head, *sq_tail;
+    u32 *sq_mask, *sq_array;
+    struct io_uring_sqe* sqes;
+    u32 queued;     // prepared since the last submit
+
+    // completion queue, shared with the kernel
+    _Atomic u32 *cq_head, *cq_tail;
+    u32 *cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // completions that came in before they were waited for, by tag
+    bool done[URING_ENTRIES];
+    i32 result[URING_ENTRIES];
+
+    bool file_used[URING_FILES];
+    message_packet* buffers;
+} uring;
+
+// uring_thread: the calling thread's ring, set up on its first call
+//
+// Returns NULL if the kernel won't give out a ring, the caller does its
+// I/O the blocking way then
+uring* uring_thread();
+
+// uring_buffer: registered buffer i of the ring
+message_packet* uring_buffer(uring* ring, int buffer);
+
+// uring_attach: put fd in a free fixed file slot, returns the slot or -1
+int uring_attach(uring* ring, int fd);
+
+// uring_detach: free a slot, no op on it may still be in flight
+void uring_detach(uring* ring, int slot);
+
+// uring_read / uring_write: queue a transfer of bytes between fixed file
+// slot and the start of registered buffer, at offset or, with offset -1,
+// at the file's position (which it then moves). tag identifies the op's
+// completion and must be below URING_ENTRIES. Nothing reaches the kernel
+// before the next uring_wait
+void uring_read(uring* ring, int slot, int buffer, size_t bytes, i64 offset, u32 tag);
+void uring_write(uring* ring, int slot, int buffer, size_t bytes, i64 offset, u32 tag);
+
+// uring_link: make the next op queued wait for the last one, it fails with
+// -ECANCELED if that one fails or comes up short
+void uring_link(uring* ring);
+
+// uring_write_data: like uring_write, from memory that isn't registered
+void uring_write_data(uring* ring, int slot, const void* data, size_t bytes, u32 tag);
+
+// uring_wait: hand every queued op to the kernel and wait for the op with
+// tag to complete, in a single syscall when it can. Returns the op's
+// result, the bytes transferred or -errno
+i32 uring_wait(uring* ring, u32 tag);
+
+// uring_wait_signal: uring_wait, except that a signal coming in before the
+// op completes makes it return -EINTR, with the op still in flight
+i32 uring_wait_signal(uring* ring, u32 tag);
+
+// uring_cancel: queue the cancellation of the op in flight with tag, which
+// then completes with -ECANCELED unless it already got somewhere. The
+// cancellation itself completes with cancel_tag
+void uring_cancel(uring* ring, u32 tag, u32 cancel_tag);
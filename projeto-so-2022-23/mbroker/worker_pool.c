@@ -0,0 +1,287 @@
+#include "worker_pool.h"
+#include "stats.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void deque_init(pool_deque* deque, size_t capacity){
+    MTX_INIT(deque->lock);
+    deque->tasks = calloc(capacity, sizeof(void*));
+    ALWAYS_ASSERT(deque->tasks!=NULL, "NO MEMORY!");
+    deque->head = deque->count = 0;
+}
+
+// Never overflows, no more than capacity tasks are ever pending
+static void deque_push(worker_pool* pool, pool_deque* deque, void* task){
+    SCOPED_LOCK(deque->lock);
+    deque->tasks[(deque->head + deque->count) % pool->config.capacity] = task;
+    deque->count++;
+}
+
+static void* deque_pop_front(worker_pool* pool, pool_deque* deque){
+    SCOPED_LOCK(deque->lock);
+    if(deque->count==0) return NULL;
+    void* task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % pool->config.capacity;
+    deque->count--;
+    return task;
+}
+
+// Takes the back half of victim's tasks, up to max, into stolen
+static size_t deque_steal(worker_pool* pool, pool_deque* victim, void** stolen, size_t max){
+    SCOPED_LOCK(victim->lock);
+    size_t n = (victim->count + 1)/2;
+    if(n>max) n = max;
+    for(size_t i=0;i<n;i++){
+        victim->count--;
+        stolen[i] = victim->tasks[(victim->head + victim->count) % pool->config.capacity];
+    }
+    return n;
+}
+
+// Runs the first of count tasks, keeping the others in our own deque
+static void* keep_rest(pool_worker* worker, void** tasks, size_t count){
+    for(size_t i=1;i<count;i++){
+        deque_push(worker->pool, &worker->deque, tasks[i]);
+    }
+    return count>0 ? tasks[0] : NULL;
+}
+
+static void* find_task(pool_worker* worker){
+    worker_pool* pool = worker->pool;
+
+    void* task = deque_pop_front(pool, &worker->deque);
+    if(task!=NULL) return task;
+
+    void* batch[POOL_INJECT_BATCH];
+    size_t count = 0;
+    {
+        SCOPED_LOCK(pool->lock);
+        while(count<POOL_INJECT_BATCH && pool->injector_count>0){
+            batch[count++] = pool->injector[pool->injector_head];
+            pool->injector_head = (pool->injector_head + 1) % pool->config.capacity;
+            pool->injector_count--;
+        }
+    }
+    if(count>0) return keep_rest(worker, batch, count);
+
+    size_t slots = pool->config.max_workers;
+    size_t first = (size_t)rand_r(&worker->seed) % slots;
+    for(size_t i=0;i<slots;i++){
+        pool_worker* victim = &pool->workers[(first + i) % slots];
+        if(victim==worker || !atomic_load(&victim->live)) continue;
+
+        count = deque_steal(pool, &victim->deque, batch, POOL_INJECT_BATCH);
+        if(count>0){
+            stats_count(STATS_STEALS, 1);
+            return keep_rest(worker, batch, count);
+        }
+    }
+    return NULL;
+}
+
+// Deadline for a sleep of ms from now, for pthread_cond_timedwait
+static struct timespec deadline_in(u64 ms){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (time_t)(ms/1000);
+    ts.tv_nsec += (long)(ms%1000)*1000000l;
+    if(ts.tv_nsec>=1000000000l){
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000l;
+    }
+    return ts;
+}
+
+// Whether a worker that found nothing to do for idle_ms exits, and if so
+// gives up its slot. Takes pool->lock held
+static bool retire(pool_worker* worker){
+    worker_pool* pool = worker->pool;
+    if(pool->live<=pool->config.min_workers || atomic_load(&pool->pending)>0) return false;
+
+    pool->live--;
+    atomic_store(&worker->live, false);
+    return true;
+}
+
+// Next task for the worker, NULL once it should exit
+static void* wait_task(pool_worker* worker){
+    worker_pool* pool = worker->pool;
+
+    for(int spins=0; spins<POOL_SPIN; spins++){
+        void* task = find_task(worker);
+        if(task!=NULL) return task;
+        if(atomic_load(&pool->pending)==0) break;
+        sched_yield();
+    }
+
+    while(1){
+        {
+            SCOPED_LOCK(pool->lock);
+            pool->sleeping++;
+            struct timespec deadline = deadline_in(pool->config.idle_ms);
+            while(atomic_load(&pool->pending)==0){
+                if(pool->config.idle_ms==0){
+                    ALWAYS_ASSERT(pthread_cond_wait(&pool->work_ready, &pool->lock)==0, "Failed to Cond wait");
+                    continue;
+                }
+                int ret = pthread_cond_timedwait(&pool->work_ready, &pool->lock, &deadline);
+                ALWAYS_ASSERT(ret==0 || ret==ETIMEDOUT, "Failed to Cond wait");
+                if(ret==ETIMEDOUT && retire(worker)){
+                    pool->sleeping--;
+                    return NULL;
+                }
+                if(ret==ETIMEDOUT) deadline = deadline_in(pool->config.idle_ms);
+            }
+            pool->sleeping--;
+        }
+
+        // Pending tasks may still be on their way into a deque
+        for(int spins=0; spins<POOL_SPIN; spins++){
+            void* task = find_task(worker);
+            if(task!=NULL) return task;
+            sched_yield();
+        }
+    }
+}
+
+static void* worker_main(void* worker_void){
+    pool_worker* worker = worker_void;
+    worker_pool* pool = worker->pool;
+
+    // Signals are handled by the main thread, and closed clients show up as EPIPE
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while(1){
+        u64 idle_since = stats_now_ns();
+        void* task = wait_task(worker);
+        if(task==NULL) break;
+        stats_record(STATS_POOL_IDLE, stats_now_ns() - idle_since);
+
+        // Counted busy before it stops being pending, see pool_submit
+        atomic_fetch_add(&pool->busy, 1);
+        // A full pool may have a submitter waiting for this
+        if(atomic_fetch_sub(&pool->pending, 1)==pool->config.capacity){
+            SCOPED_LOCK(pool->lock);
+            pthread_cond_signal(&pool->room_ready);
+        }
+
+        pool->run(task);
+        atomic_fetch_sub(&pool->busy, 1);
+    }
+    TRACE("worker retired");
+    return NULL;
+}
+
+// Starts a worker in a free slot. Takes pool->lock held
+static bool spawn_worker(worker_pool* pool){
+    for(size_t i=0;i<pool->config.max_workers;i++){
+        pool_worker* worker = &pool->workers[i];
+        if(atomic_load(&worker->live)) continue;
+
+        // The slot's last thread may not have returned yet, but it is done
+        // with the slot
+        pthread_t thread;
+        atomic_store(&worker->live, true);
+        if(pthread_create(&thread, &pool->attr, worker_main, worker)!=0){
+            atomic_store(&worker->live, false);
+            return false;
+        }
+        pool->live++;
+        TRACE("worker started, live=%lu", pool->live);
+        return true;
+    }
+    return false;
+}
+
+int pool_create(worker_pool* pool, const pool_config* config, pool_task_fn run){
+    if(config->max_workers==0 || config->capacity==0) return -1;
+
+    pool->config = *config;
+    if(pool->config.min_workers>pool->config.max_workers) pool->config.min_workers = pool->config.max_workers;
+    pool->run = run;
+    MTX_INIT(pool->lock);
+    COND_INIT(pool->work_ready);
+    COND_INIT(pool->room_ready);
+    pool->injector = calloc(config->capacity, sizeof(void*));
+    pool->injector_head = pool->injector_count = 0;
+    pool->sleeping = pool->live = 0;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->busy, 0);
+
+    pool->workers = calloc(config->max_workers, sizeof(pool_worker));
+    if(pool->injector==NULL || pool->workers==NULL) return -1;
+
+    for(size_t i=0;i<config->max_workers;i++){
+        pool_worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->seed = (unsigned int)i;
+        atomic_init(&worker->live, false);
+        deque_init(&worker->deque, config->capacity);
+    }
+
+    // Nobody joins the workers, they go away on their own
+    if(pthread_attr_init(&pool->attr)!=0) return -1;
+    pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
+    if(config->stack_size>0){
+        size_t stack_size = config->stack_size;
+        if(stack_size<POOL_MIN_STACK) stack_size = POOL_MIN_STACK;
+        if(stack_size<PTHREAD_STACK_MIN) stack_size = PTHREAD_STACK_MIN;
+        if(pthread_attr_setstacksize(&pool->attr, stack_size)!=0) return -1;
+    }
+
+    SCOPED_LOCK(pool->lock);
+    for(size_t i=0;i<pool->config.min_workers;i++){
+        if(!spawn_worker(pool)) return -1;
+    }
+    return 0;
+}
+
+// Puts the task in the injector, with pool->lock held and room for it
+static void inject(worker_pool* pool, void* task){
+    pool->injector[(pool->injector_head + pool->injector_count) % pool->config.capacity] = task;
+    pool->injector_count++;
+    atomic_fetch_add(&pool->pending, 1);
+    TRACE("submitted, pending=%lu", atomic_load(&pool->pending));
+
+    // Grow while there are more tasks waiting than workers to take them
+    size_t idle = pool->live - atomic_load(&pool->busy);
+    if(atomic_load(&pool->pending)>idle && pool->live<pool->config.max_workers){
+        spawn_worker(pool);
+    }
+    if(pool->sleeping>0) pthread_cond_signal(&pool->work_ready);
+}
+
+void pool_submit(worker_pool* pool, void* task){
+    u64 start = stats_now_ns();
+
+    SCOPED_LOCK(pool->lock);
+    while(atomic_load(&pool->pending)==pool->config.capacity){
+        ALWAYS_ASSERT(pthread_cond_wait(&pool->room_ready, &pool->lock)==0, "Failed to Cond wait");
+    }
+    inject(pool, task);
+    stats_record(STATS_POOL_SUBMIT, stats_now_ns() - start);
+}
+
+bool pool_try_submit(worker_pool* pool, void* task){
+    SCOPED_LOCK(pool->lock);
+    if(atomic_load(&pool->pending)==pool->config.capacity) return false;
+    inject(pool, task);
+    return true;
+}
+
+size_t pool_pending(worker_pool* pool){
+    return atomic_load(&pool->pending);
+}
+
+size_t pool_live(worker_pool* pool){
+    SCOPED_LOCK(pool->lock);
+    return pool->live;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Tasks a worker takes off the injector at once, the rest of them wait in
+// its own deque where idle workers can steal them from
+#define POOL_INJECT_BATCH 8
+
+// Rounds an idle worker looks for work, yielding in between, before it
+// goes to sleep
+#define POOL_SPIN 64
+
+// Smallest stack a worker is given, whatever it is configured to. The
+// deepest handler, a publisher of a compressed box, keeps about 74KB of
+// batch buffers on the stack (its packets, the compressed records and the
+// LZ77 hash table), this leaves room for its frames and libc on top
+#define POOL_MIN_STACK (128*1024)
+
+typedef void (*pool_task_fn)(void* task);
+
+typedef struct{
+    size_t min_workers, max_workers;
+    size_t capacity;    // most tasks pending at once
+    u64 idle_ms;        // workers above min_workers exit after idling this long, 0 never
+    size_t stack_size;  // bytes, 0 for the system's default
+} pool_config;
+
+// Ring of tasks, the owner takes from the front and thieves from the back
+typedef struct{
+    pthread_mutex_t lock;
+    void** tasks;
+    size_t head, count;
+} pool_deque;
+
+struct worker_pool;
+
+// A slot workers are started in, and reused once they exit
+typedef struct{
+    struct worker_pool* pool;
+    pool_deque deque;
+    _Atomic bool live;  // a thread is running in the slot
+    unsigned int seed;  // picks the first victim to steal from
+} pool_worker;
+
+// Work stealing pool: submitted tasks go through a shared injector queue
+// into the deques of the workers that pick them up. A worker stuck on a
+// long task (a whole session) has what is left in its deque stolen by the
+// idle ones, so the shared lock is only taken once per batch.
+//
+// At most capacity tasks wait to be started at any time, pool_submit
+// blocks beyond that.
+//
+// The pool starts with min_workers threads and starts another one whenever
+// a task is submitted with every worker busy, up to max_workers. Workers
+// that sleep idle_ms without work exit again, down to min_workers.
+typedef struct worker_pool{
+    pool_worker* workers;   // max_workers slots
+    pool_config config;
+    pool_task_fn run;
+    pthread_attr_t attr;
+
+    // guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready, room_ready;
+    void** injector;
+    size_t injector_head, injector_count;
+    size_t sleeping;
+    size_t live;            // running threads
+
+    _Atomic size_t pending; // submitted and not started yet
+    _Atomic size_t busy;    // workers running a task
+} worker_pool;
+
+// pool_create: start min_workers threads running the tasks submitted with run
+int pool_create(worker_pool* pool, const pool_config* config, pool_task_fn run);
+
+// pool_submit: queue a task, waiting while capacity tasks are pending
+void pool_submit(worker_pool* pool, void* task);
+
+// pool_try_submit: queue a task unless capacity tasks are pending, returns
+// whether it was queued
+bool pool_try_submit(worker_pool* pool, void* task);
+
+// pool_pending: tasks submitted and not started yet
+size_t pool_pending(worker_pool* pool);
+
+// pool_live: worker threads currently running
+size_t pool_live(worker_pool* pool);
@@ -50,55 +50,41 @@ int pcq_destroy(pc_queue_t* queue){
 
 
 
+// The size, head and tail are only ever touched under pcq_current_size_lock,
+// which is also the lock both condvars wait on. Keeping them apart lets a
+// thread see the size change before the slot itself is filled or emptied,
+// or a signal land between a waiter's check and its wait. The head, tail
+// and condvar locks of pc_queue_t are left unused
 int pcq_enqueue(pc_queue_t* queue, void* elem){
+    SCOPED_LOCK(queue->pcq_current_size_lock);
 
-    {
-        SCOPED_LOCK(queue->pcq_current_size_lock);
-
-        // When waiting for there to be space make sure, that not only the capacity
-        // has been decremented (1rst cond) but also that the element has been removed (2nd cond),
-        // as they use different locks
-        while(queue->pcq_current_size==queue->pcq_capacity ||
-         (queue->pcq_head==queue->pcq_tail && queue->pcq_current_size!=0)){
-            ALWAYS_ASSERT(pthread_cond_wait(&queue->pcq_pusher_condvar, &queue->pcq_current_size_lock)==0, "Failed to Cond wait");
-        }
-
-        queue->pcq_current_size++;
+    while(queue->pcq_current_size==queue->pcq_capacity){
+        ALWAYS_ASSERT(pthread_cond_wait(&queue->pcq_pusher_condvar, &queue->pcq_current_size_lock)==0, "Failed to Cond wait");
     }
 
+    queue->pcq_buffer[queue->pcq_head] = elem;
+    queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
+    queue->pcq_current_size++;
+    TRACE("enqueue size=%lu", queue->pcq_current_size);
 
-    {
-        SCOPED_LOCK(queue->pcq_head_lock);
-        queue->pcq_buffer[queue->pcq_head] = elem;
-        queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
-    }
-
-
-    SCOPED_LOCK(queue->pcq_popper_condvar_lock);
     ALWAYS_ASSERT(pthread_cond_signal(&queue->pcq_popper_condvar)==0, "FAILED TO SIGNAL!");
 
     return 0;
 }
 
 void* pcq_dequeue(pc_queue_t *queue){
-    void* data = NULL;
-
-    {
-        SCOPED_LOCK(queue->pcq_current_size_lock);
-        while(queue->pcq_current_size==0 || (queue->pcq_tail==queue->pcq_head && queue->pcq_current_size!=queue->pcq_capacity)){
-            ALWAYS_ASSERT(pthread_cond_wait(&queue->pcq_popper_condvar, &queue->pcq_current_size_lock)==0, "Failed to Cond wait");
-        }
-        queue->pcq_current_size--;
-    }
+    SCOPED_LOCK(queue->pcq_current_size_lock);
 
-    {
-        SCOPED_LOCK(queue->pcq_tail_lock);
-        data = queue->pcq_buffer[queue->pcq_tail];
-        queue->pcq_buffer[queue->pcq_tail] = NULL;
-        queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
+    while(queue->pcq_current_size==0){
+        ALWAYS_ASSERT(pthread_cond_wait(&queue->pcq_popper_condvar, &queue->pcq_current_size_lock)==0, "Failed to Cond wait");
     }
 
-    SCOPED_LOCK(queue->pcq_pusher_condvar_lock);
+    void* data = queue->pcq_buffer[queue->pcq_tail];
+    queue->pcq_buffer[queue->pcq_tail] = NULL;
+    queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
+    queue->pcq_current_size--;
+    TRACE("dequeue size=%lu", queue->pcq_current_size);
+
     ALWAYS_ASSERT(pthread_cond_signal(&queue->pcq_pusher_condvar)==0, "FAILED TO SIGNAL!");
 
     return data;
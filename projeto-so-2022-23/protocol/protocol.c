@@ -1,5 +1,11 @@
 #include "protocol.h"
+#include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 static const size_t packet_size[] = {
     sizeof(register_publisher_packet),
@@ -11,16 +17,47 @@ static const size_t packet_size[] = {
     sizeof(list_msg_box_packet),
     sizeof(list_msg_box_response_packet),
     sizeof(message_packet),
+    sizeof(message_packet),
+    sizeof(register_publisher_shm_packet),
+    sizeof(register_subscriber_shm_packet),
+    sizeof(publisher_credit_packet),
+    sizeof(stats_packet),
+    sizeof(stats_response_packet),
+    sizeof(register_subscriber_pattern_packet),
+    sizeof(pattern_message_packet),
+    sizeof(message_packet),
     sizeof(message_packet)
 };
 
 ssize_t id_size_lookup(enum PacketId id){
-    if(!(ID_REGISTER_PUBLISHER<=id && id<=ID_SEND_MSG_SUBSCRIBER)){
+    if(!(ID_REGISTER_PUBLISHER<=id && id<=ID_SEND_TIMED_MSG_SUBSCRIBER)){
         return -1;
     }
     return (ssize_t)packet_size[id-1];
 }
 
+bool is_broker_socket(const char* register_name){
+    struct stat st;
+    return stat(register_name, &st)==0 && S_ISSOCK(st.st_mode);
+}
+
+int connect_broker_socket(const char* register_name, const void* packet, size_t size){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(register_name)>=sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, register_name);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(fd==-1) return -1;
+
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))!=0 ||
+        write(fd, packet, size)!=(ssize_t)size){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
 void write_packet_create(create_msg_box_packet* packet, const char* client_named_pipe, const char* msg_box){
     memset(packet, 0, sizeof(create_msg_box_packet));
@@ -31,8 +68,8 @@ void write_packet_create(create_msg_box_packet* packet, const char* client_named
     strcpy(packet->box_name,          msg_box          );
 }
 
-void write_packet_remove(create_msg_box_packet* packet, const char* client_named_pipe, const char* msg_box){
-    memset(packet, 0, sizeof(create_msg_box_packet));
+void write_packet_remove(remove_msg_box_packet* packet, const char* client_named_pipe, const char* msg_box){
+    memset(packet, 0, sizeof(remove_msg_box_packet));
 
     packet->code = (u8)ID_REMOVE_MSG_BOX;
 
@@ -56,4 +93,51 @@ void write_packet_register_pub(register_publisher_packet* packet, const char* cl
 
     strcpy(packet->client_named_pipe, client_named_pipe);
     strcpy(packet->box_name,          box_name         );
-}
\ No newline at end of file
+}
+
+void write_packet_register_sub_shm(register_subscriber_shm_packet* packet, const char* ring_name, const char* box_name){
+    write_packet_register_sub(packet, ring_name, box_name);
+    packet->code = (u8)ID_REGISTER_SUBSCRIBER_SHM;
+}
+
+void write_packet_register_sub_pattern(register_subscriber_pattern_packet* packet, const char* client_named_pipe, const char* pattern){
+    write_packet_register_sub(packet, client_named_pipe, pattern);
+    packet->code = (u8)ID_REGISTER_SUBSCRIBER_PATTERN;
+}
+
+void write_packet_register_pub_shm(register_publisher_shm_packet* packet, const char* ring_name, const char* box_name){
+    write_packet_register_pub(packet, ring_name, box_name);
+    packet->code = (u8)ID_REGISTER_PUBLISHER_SHM;
+}
+
+bool credit_pipe_name(char name[MAX_PIPE_NAME_LEN], const char* pipe_name){
+    int len = snprintf(name, MAX_PIPE_NAME_LEN, "%s.credits", pipe_name);
+    return len>0 && len<MAX_PIPE_NAME_LEN;
+}
+
+void write_packet_credit(publisher_credit_packet* packet, u32 credits){
+    packet->code = (u8)ID_PUBLISHER_CREDIT;
+    packet->credits = credits;
+}
+
+u64 message_clock_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec*1000000000ull + (u64)ts.tv_nsec;
+}
+
+bool message_is_timed(const message_packet* packet){
+    return packet->code==ID_SEND_TIMED_MSG_SERVER || packet->code==ID_SEND_TIMED_MSG_SUBSCRIBER;
+}
+
+message_timestamps* message_times(message_packet* packet){
+    return message_is_timed(packet) ? (message_timestamps*)packet->message : NULL;
+}
+
+char* message_text(message_packet* packet){
+    return message_is_timed(packet) ? packet->message+sizeof(message_timestamps) : packet->message;
+}
+
+size_t message_text_size(const message_packet* packet){
+    return message_is_timed(packet) ? MSG_LEN-sizeof(message_timestamps) : MSG_LEN;
+}
@@ -12,25 +12,112 @@ enum PacketId {
     ID_LIST_MSG_BOX,
     ID_RESPONSE_LIST_MSG_BOX,
     ID_SEND_MSG_SERVER,
-    ID_SEND_MSG_SUBSCRIBER
+    ID_SEND_MSG_SUBSCRIBER,
+    ID_REGISTER_PUBLISHER_SHM,
+    ID_REGISTER_SUBSCRIBER_SHM,
+    ID_PUBLISHER_CREDIT,
+    ID_STATS,
+    ID_RESPONSE_STATS,
+    ID_REGISTER_SUBSCRIBER_PATTERN,
+    ID_SEND_MSG_PATTERN,
+    ID_SEND_TIMED_MSG_SERVER,
+    ID_SEND_TIMED_MSG_SUBSCRIBER
 };
 
 #define ERROR_MSG_LEN     1024
 #define MSG_LEN           1024
 #define MAX_PIPE_NAME_LEN  256
 #define MAX_BOX_NAME_LEN    32
+#define STATS_LINE_LEN     256
 
+// With a credit_window the publisher only sends messages the broker
+// granted it credits for, see publisher_credit_packet
 #pragma pack(push, 1)
 typedef struct {
     u8 code;
     char client_named_pipe[MAX_PIPE_NAME_LEN];
     char box_name[MAX_BOX_NAME_LEN];
+    u32 credit_window;  // 0 turns flow control off
 } register_publisher_packet;
 #pragma pack(pop)
 
-// Same packet layout
-typedef register_publisher_packet register_subscriber_packet;
-typedef register_publisher_packet create_msg_box_packet;
+// Sent by the broker to a publisher using flow control, first with its
+// whole window and then as the messages it sent are taken in. Named pipe
+// sessions get them on the fifo named by credit_pipe_name, sockets on the
+// session's socket
+#pragma pack(push, 1)
+typedef struct {
+    u8 code;
+    u32 credits;
+} publisher_credit_packet;
+#pragma pack(pop)
+
+// Where a new subscriber starts reading the box from
+enum SubscribeStart {
+    SUB_START_EARLIEST=0,   // replay everything still in the box
+    SUB_START_LATEST,       // only messages published after registering
+    SUB_START_OFFSET,       // start_value is the sequence number of the first message
+    SUB_START_LAST_N        // start_value is how many past messages to replay
+};
+
+// What the broker does with a subscriber that falls more than lag_budget
+// messages behind the end of its box
+enum LagPolicy {
+    LAG_POLICY_DEFAULT=0,       // the broker's choice (LAG_POLICY_DISCONNECT)
+    LAG_POLICY_DISCONNECT,      // end the session
+    LAG_POLICY_DROP_OLDEST,     // skip ahead so it is lag_budget messages behind again
+    LAG_POLICY_SKIP_TO_LATEST   // skip ahead to the end of the box
+};
+
+#pragma pack(push, 1)
+typedef struct {
+    u8 code;
+    char client_named_pipe[MAX_PIPE_NAME_LEN];
+    char box_name[MAX_BOX_NAME_LEN];
+    u8 start_mode;
+    u64 start_value;
+    u8 lag_policy;
+    u64 lag_budget;     // 0 is the broker's default budget
+} register_subscriber_packet;
+#pragma pack(pop)
+
+// Retention policy of a box, 0 means no limit. Once a limit is exceeded
+// the broker drops the oldest messages, but never ones a subscriber still
+// has to read
+#pragma pack(push, 1)
+typedef struct {
+    u64 max_bytes;
+    u64 max_messages;
+    u64 max_age_seconds;
+} box_retention;
+#pragma pack(pop)
+
+// How a box stores its messages
+enum BoxCompression {
+    BOX_COMPRESSION_NONE=0,
+    BOX_COMPRESSION_LZ77    // every message compressed on its own, see lz77.h
+};
+
+#pragma pack(push, 1)
+typedef struct {
+    u8 code;
+    char client_named_pipe[MAX_PIPE_NAME_LEN];
+    char box_name[MAX_BOX_NAME_LEN];
+    box_retention retention;
+    u8 compression;
+} create_msg_box_packet;
+#pragma pack(pop)
+
+// Same packet layout, box_name holds a pattern where '*' matches any run of
+// characters and '?' any single one. The session gets the messages of every
+// box it matches, including boxes created later, as pattern_message_packets.
+// The start position and lag policy apply to each box on its own
+typedef register_subscriber_packet register_subscriber_pattern_packet;
+
+// Same packet layout, client_named_pipe holds the name of the shm_ring
+// the client created for the session (see shm_ring.h)
+typedef register_publisher_packet register_publisher_shm_packet;
+typedef register_subscriber_packet register_subscriber_shm_packet;
 
 #pragma pack(push, 1)
 typedef struct{
@@ -40,8 +127,15 @@ typedef struct{
 } response_create_msg_box_packet;
 #pragma pack(pop)
 
+#pragma pack(push, 1)
+typedef struct {
+    u8 code;
+    char client_named_pipe[MAX_PIPE_NAME_LEN];
+    char box_name[MAX_BOX_NAME_LEN];
+} remove_msg_box_packet;
+#pragma pack(pop)
+
 // Same packet layout
-typedef register_publisher_packet remove_msg_box_packet;
 typedef response_create_msg_box_packet response_remove_msg_box_packet;
 
 #pragma pack(push, 1)
@@ -59,6 +153,10 @@ typedef struct{
 } list_msg_box_response_packet;
 #pragma pack(pop)
 
+// The broker writes list rows up to LIST_BATCH_ROWS at a time, so reading
+// that many rows at once takes a whole batch off a socket too
+#define LIST_BATCH_ROWS 256
+
 #pragma pack(push, 1)
 typedef struct{
     u8 code;
@@ -66,12 +164,90 @@ typedef struct{
 } message_packet;
 #pragma pack(pop)
 
+// Timing a message is opt-in: a timed message (ID_SEND_TIMED_MSG_*) starts
+// with these and has that much less room for its text, in a packet of the
+// same size, so messages nobody times carry nothing extra. The timestamps
+// are message_clock_ns() readings
+#pragma pack(push, 1)
+typedef struct{
+    u64 sent_ns;    // set by the publisher as it sends the message
+    u64 ingest_ns;  // set by the broker as it reads the message in
+} message_timestamps;
+#pragma pack(pop)
+
+// What a pattern_message_packet carries
+enum PatternFrame {
+    PATTERN_FRAME_BOX=0,    // a box the pattern matched, packet.message holds its name
+    PATTERN_FRAME_MSG       // a message of the box announced with box_id
+};
+
+// Frame of a pattern subscription. Every box is announced once, before its
+// first message, and its messages are then tagged with its box_id
+#pragma pack(push, 1)
+typedef struct{
+    u8 code;
+    u8 kind;
+    u32 box_id;
+    message_packet packet;
+} pattern_message_packet;
+#pragma pack(pop)
+
+// Same packet layout
+typedef list_msg_box_packet stats_packet;
+
+// The broker answers a stats request with one "<kind> key=value ..." line
+// per packet, the last one has is_last set
+#pragma pack(push, 1)
+typedef struct{
+    u8 code, is_last;
+    char line[STATS_LINE_LEN];
+} stats_response_packet;
+#pragma pack(pop)
+
 ssize_t id_size_lookup(enum PacketId id);
 
+// The broker can also listen on a SOCK_SEQPACKET unix socket, clients given
+// its path instead of the register pipe's use the socket for the whole session
+bool is_broker_socket(const char* register_name);
+
+// Connects to the broker's socket and sends the first packet, returns the
+// session's socket or -1 on failure
+int connect_broker_socket(const char* register_name, const void* packet, size_t size);
+
+// Creates an uncompressed box without retention limits, fill in
+// packet->retention and packet->compression afterwards to change that
 void write_packet_create(create_msg_box_packet* packet, const char* client_named_pipe, const char* msg_box);
 
-void write_packet_remove(create_msg_box_packet* packet, const char* client_named_pipe, const char* msg_box);
+void write_packet_remove(remove_msg_box_packet* packet, const char* client_named_pipe, const char* msg_box);
 
+// Subscribes from SUB_START_EARLIEST, change start_mode/start_value afterwards for other positions
 void write_packet_register_sub(register_subscriber_packet* packet, const char* client_named_pipe, const char* box_name);
 
-void write_packet_register_pub(register_publisher_packet* packet, const char* client_named_pipe, const char* box_name);
\ No newline at end of file
+// Registers without flow control, set packet->credit_window afterwards to use it
+void write_packet_register_pub(register_publisher_packet* packet, const char* client_named_pipe, const char* box_name);
+
+// credit_pipe_name: name of the fifo the credits of a named pipe session go
+// to, false if it doesn't fit in MAX_PIPE_NAME_LEN
+bool credit_pipe_name(char name[MAX_PIPE_NAME_LEN], const char* pipe_name);
+
+void write_packet_credit(publisher_credit_packet* packet, u32 credits);
+
+// message_clock_ns: the monotonic clock message timestamps are taken from,
+// comparable between processes on the same host
+u64 message_clock_ns();
+
+bool message_is_timed(const message_packet* packet);
+
+// message_times: the timestamps of a timed message, NULL for any other
+message_timestamps* message_times(message_packet* packet);
+
+// message_text: where the text of a message starts, past the timestamps of
+// a timed one, and how many bytes it has room for. Set the code first
+char* message_text(message_packet* packet);
+size_t message_text_size(const message_packet* packet);
+
+void write_packet_register_sub_shm(register_subscriber_shm_packet* packet, const char* ring_name, const char* box_name);
+
+void write_packet_register_sub_pattern(register_subscriber_pattern_packet* packet, const char* client_named_pipe, const char* pattern);
+
+void write_packet_register_pub_shm(register_publisher_shm_packet* packet, const char* ring_name, const char* box_name);
\ No newline at end of file
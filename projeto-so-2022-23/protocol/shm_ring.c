@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long a sleeping side waits before checking that its peer still exists
+#define SHM_RING_WAIT_NS 100000000L
+
+static size_t ring_map_size(u32 capacity){
+    return sizeof(shm_ring_shared) + (size_t)capacity*sizeof(message_packet);
+}
+
+static shm_ring* new_handle(shm_ring_shared* shared, size_t map_size, u32 capacity){
+    shm_ring* ring = malloc(sizeof(shm_ring));
+    ALWAYS_ASSERT(ring!=NULL, "NO MEMORY!");
+    ring->shared = shared;
+    ring->map_size = map_size;
+    ring->capacity = capacity;
+    return ring;
+}
+
+static long futex_wait(void* addr, u32 expected){
+    struct timespec timeout = {0, SHM_RING_WAIT_NS};
+    return syscall(SYS_futex, addr, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+static void futex_wake(void* addr){
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// A peer that crashed never closes the ring, so sleepers poll for it
+static bool peer_alive(shm_ring* ring){
+    pid_t client = atomic_load(&ring->shared->client_pid);
+    pid_t peer = client==getpid() ? atomic_load(&ring->shared->broker_pid) : client;
+    if(peer==0) return true;
+    return kill(peer, 0)==0 || errno!=ESRCH;
+}
+
+void shm_ring_name(char name[MAX_PIPE_NAME_LEN], const char* pipe_name){
+    size_t i = strlen(SHM_RING_PREFIX);
+    memcpy(name, SHM_RING_PREFIX, i);
+    for(; *pipe_name!='\0' && i<MAX_PIPE_NAME_LEN-1; i++, pipe_name++){
+        name[i] = *pipe_name=='/' ? '_' : *pipe_name;
+    }
+    name[i] = '\0';
+}
+
+shm_ring* shm_ring_create(const char* name){
+    int fd AUTO_CLOSE_FD = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd==-1) return NULL;
+
+    size_t size = ring_map_size(SHM_RING_SLOTS);
+    if(ftruncate(fd, (off_t)size)!=0){
+        shm_unlink(name);
+        return NULL;
+    }
+
+    shm_ring_shared* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shared==MAP_FAILED){
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // ftruncate zero fills, so only the non zero fields need setting
+    shared->capacity = SHM_RING_SLOTS;
+    atomic_store(&shared->client_pid, getpid());
+
+    return new_handle(shared, size, SHM_RING_SLOTS);
+}
+
+shm_ring* shm_ring_attach(const char* name){
+    // The name comes from a client, it must be one of a ring
+    if(strnlen(name, MAX_PIPE_NAME_LEN)==MAX_PIPE_NAME_LEN ||
+        strncmp(name, SHM_RING_PREFIX, strlen(SHM_RING_PREFIX))!=0 || strchr(name+1, '/')!=NULL){
+        return NULL;
+    }
+
+    int fd AUTO_CLOSE_FD = shm_open(name, O_RDWR, 0);
+    if(fd==-1) return NULL;
+
+    // Nobody else needs to find it, it lives on until both sides unmap it
+    shm_unlink(name);
+
+    struct stat st;
+    if(fstat(fd, &st)!=0 || (size_t)st.st_size<sizeof(shm_ring_shared)) return NULL;
+
+    size_t size = (size_t)st.st_size;
+    shm_ring_shared* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shared==MAP_FAILED) return NULL;
+
+    // Read once: from here on only the checked copy in the handle is used
+    u32 capacity = *(volatile u32*)&shared->capacity;
+    if(capacity==0 || (capacity & (capacity-1))!=0 || ring_map_size(capacity)!=size){
+        munmap(shared, size);
+        return NULL;
+    }
+
+    atomic_store(&shared->broker_pid, getpid());
+    futex_wake(&shared->broker_pid);
+
+    return new_handle(shared, size, capacity);
+}
+
+int shm_ring_wait_broker(shm_ring* ring, int timeout_ms){
+    for(int waited=0; atomic_load(&ring->shared->broker_pid)==0; waited += (int)(SHM_RING_WAIT_NS/1000000)){
+        if(atomic_load(&ring->shared->closed) || waited>=timeout_ms) return -1;
+        if(futex_wait(&ring->shared->broker_pid, 0)==-1 && errno==EINTR) return -1;
+    }
+    return 0;
+}
+
+void shm_ring_detach(shm_ring** ring){
+    if(ring==NULL || *ring==NULL) return;
+    ALWAYS_ASSERT(munmap((*ring)->shared, (*ring)->map_size)==0, "FAILED TO UNMAP RING!");
+    free(*ring);
+    *ring = NULL;
+}
+
+void shm_ring_close(shm_ring* ring){
+    atomic_store(&ring->shared->closed, 1);
+    futex_wake(&ring->shared->head);
+    futex_wake(&ring->shared->tail);
+    futex_wake(&ring->shared->broker_pid);
+}
+
+// Reserves up to max free slots that follow each other in memory, sleeping
+// at most max_sleeps times on a full ring, forever if negative
+static message_packet* reserve_within(shm_ring* ring, size_t max, size_t* count, int max_sleeps){
+    u32 head = atomic_load_explicit(&ring->shared->head, memory_order_relaxed);
+    u32 tail;
+
+    for(u32 spins=0;;spins++){
+        if(atomic_load_explicit(&ring->shared->closed, memory_order_relaxed)){
+            errno = EPIPE;
+            return NULL;
+        }
+
+        tail = atomic_load_explicit(&ring->shared->tail, memory_order_acquire);
+        if(head-tail < ring->capacity) break;
+        if(spins<SHM_RING_SPIN) continue;
+
+        if(max_sleeps==0){
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        if(max_sleeps>0) max_sleeps--;
+
+        // The futex only sleeps if tail is still the value we saw as full
+        atomic_store(&ring->shared->producer_sleeping, 1);
+        long woke = futex_wait(&ring->shared->tail, tail);
+        atomic_store(&ring->shared->producer_sleeping, 0);
+
+        if(woke==-1 && errno==EINTR) return NULL;
+
+        if(!peer_alive(ring)){
+            shm_ring_close(ring);
+            errno = EPIPE;
+            return NULL;
+        }
+    }
+
+    // Checked above to be at least one, and at most the ring
+    u32 first = head & (ring->capacity-1);
+    size_t free_slots = ring->capacity - (head-tail);
+    if(free_slots>ring->capacity-first) free_slots = ring->capacity-first;
+    if(free_slots>max) free_slots = max;
+    *count = free_slots;
+    return &ring->shared->slots[first];
+}
+
+message_packet* shm_ring_reserve(shm_ring* ring){
+    size_t count;
+    return reserve_within(ring, 1, &count, -1);
+}
+
+message_packet* shm_ring_reserve_batch_timed(shm_ring* ring, size_t max, size_t* count, int timeout_ms){
+    return reserve_within(ring, max, count, (int)((timeout_ms*1000000L + SHM_RING_WAIT_NS-1)/SHM_RING_WAIT_NS));
+}
+
+void shm_ring_commit_batch(shm_ring* ring, size_t count){
+    u32 head = atomic_load_explicit(&ring->shared->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->shared->head, head+(u32)count, memory_order_release);
+
+    // Pairs with the store to consumer_sleeping before the consumer's futex_wait
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&ring->shared->consumer_sleeping, memory_order_relaxed)){
+        futex_wake(&ring->shared->head);
+    }
+}
+
+void shm_ring_commit(shm_ring* ring){
+    shm_ring_commit_batch(ring, 1);
+}
+
+message_packet* shm_ring_peek_batch(shm_ring* ring, size_t max, size_t* count){
+    u32 tail = atomic_load_explicit(&ring->shared->tail, memory_order_relaxed);
+    u32 head;
+
+    for(u32 spins=0;;spins++){
+        head = atomic_load_explicit(&ring->shared->head, memory_order_acquire);
+        if(head!=tail) break;
+
+        // Only report closed once everything that was committed is drained
+        if(atomic_load_explicit(&ring->shared->closed, memory_order_acquire)) return NULL;
+        if(spins<SHM_RING_SPIN) continue;
+
+        atomic_store(&ring->shared->consumer_sleeping, 1);
+        long woke = futex_wait(&ring->shared->head, head);
+        atomic_store(&ring->shared->consumer_sleeping, 0);
+
+        if(woke==-1 && errno==EINTR) return NULL;
+
+        if(!peer_alive(ring)){
+            shm_ring_close(ring);
+        }
+    }
+
+    // head is the producer's word, it can't make us go past the slots
+    u32 first = tail & (ring->capacity-1);
+    size_t filled = head-tail;
+    if(filled>ring->capacity-first) filled = ring->capacity-first;
+    if(filled>max) filled = max;
+    *count = filled;
+    return &ring->shared->slots[first];
+}
+
+message_packet* shm_ring_peek(shm_ring* ring){
+    size_t count;
+    return shm_ring_peek_batch(ring, 1, &count);
+}
+
+void shm_ring_release_batch(shm_ring* ring, size_t count){
+    u32 tail = atomic_load_explicit(&ring->shared->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->shared->tail, tail+(u32)count, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&ring->shared->producer_sleeping, memory_order_relaxed)){
+        futex_wake(&ring->shared->tail);
+    }
+}
+
+void shm_ring_release(shm_ring* ring){
+    shm_ring_release_batch(ring, 1);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+#include "protocol.h"
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// Must be a power of two. About what a pipe buffer holds: a deeper ring
+// takes no more throughput, only queues messages for longer
+#define SHM_RING_SLOTS 64
+
+// How many times a side polls the ring before sleeping on the futex
+#define SHM_RING_SPIN 1024
+
+// Every ring's shm object name starts with it, the broker attaches to no
+// other object
+#define SHM_RING_PREFIX "/mbroker-ring-"
+
+// Single producer single consumer ring of message_packets living in a
+// shared memory object. Each side only ever writes its own cursor, so the
+// fast path is a copy plus one atomic store; the futex doorbells are only
+// rung when the other side announced it is asleep.
+typedef struct {
+    _Alignas(64) _Atomic u32 head;      // next slot to be written (producer)
+    _Atomic u32 consumer_sleeping;
+    _Alignas(64) _Atomic u32 tail;      // next slot to be read (consumer)
+    _Atomic u32 producer_sleeping;
+    _Alignas(64) _Atomic u32 closed;
+    _Atomic i32 client_pid, broker_pid;
+    u32 capacity;                       // set by the client, checked once by the broker
+    _Alignas(64) message_packet slots[];
+} shm_ring_shared;
+
+// A side's own handle on a ring. The geometry is copied out of the mapping
+// once it was checked, the other side can rewrite the mapping at any time
+typedef struct {
+    shm_ring_shared* shared;
+    size_t map_size;
+    u32 capacity;
+} shm_ring;
+
+// shm_ring_name: derive a valid shm object name (SHM_RING_PREFIX...) from a
+// pipe name
+void shm_ring_name(char name[MAX_PIPE_NAME_LEN], const char* pipe_name);
+
+// shm_ring_create: (client side) create and map a new ring
+//
+// Fails if an object with the same name already exists
+shm_ring* shm_ring_create(const char* name);
+
+// shm_ring_attach: (broker side) map a ring created by a client and announce
+// the broker to it. Names that shm_ring_name doesn't give out are refused
+shm_ring* shm_ring_attach(const char* name);
+
+// shm_ring_wait_broker: (client side) wait until a broker attached the ring
+//
+// Returns -1 on timeout, on a signal (errno is EINTR) or if the ring was
+// closed before the broker showed up
+int shm_ring_wait_broker(shm_ring* ring, int timeout_ms);
+
+// shm_ring_detach: unmap the ring and free the handle (the other side can
+// keep using it)
+void shm_ring_detach(shm_ring** ring);
+
+// shm_ring_close: mark the ring as closed and wake up the other side
+void shm_ring_close(shm_ring* ring);
+
+// shm_ring_reserve: get the next free slot to be filled in place
+//
+// Sleeps while the ring is full, returns NULL if the ring was closed or the
+// sleep was interrupted by a signal (errno is EINTR)
+message_packet* shm_ring_reserve(shm_ring* ring);
+
+// shm_ring_commit: publish the slot returned by shm_ring_reserve
+void shm_ring_commit(shm_ring* ring);
+
+// shm_ring_reserve_batch_timed: shm_ring_reserve for up to max free slots
+// at once, the ones that follow the first in memory (the ring wraps
+// around), giving up after about timeout_ms on a full ring (errno is
+// ETIMEDOUT). A closed ring sets errno to EPIPE. Sets count to how many
+// there are, at least one
+message_packet* shm_ring_reserve_batch_timed(shm_ring* ring, size_t max, size_t* count, int timeout_ms);
+
+// shm_ring_commit_batch: publish the first count slots returned by
+// shm_ring_reserve_batch_timed
+void shm_ring_commit_batch(shm_ring* ring, size_t count);
+
+// shm_ring_peek: get the next filled slot to be consumed in place
+//
+// Sleeps while the ring is empty, returns NULL once the ring is closed and
+// has been fully drained, or if the sleep was interrupted by a signal
+message_packet* shm_ring_peek(shm_ring* ring);
+
+// shm_ring_release: give back the slot returned by shm_ring_peek
+void shm_ring_release(shm_ring* ring);
+
+// shm_ring_peek_batch: shm_ring_peek for up to max filled slots at once,
+// the ones that follow the first in memory (the ring wraps around). Sets
+// count to how many there are, at least one
+message_packet* shm_ring_peek_batch(shm_ring* ring, size_t max, size_t* count);
+
+// shm_ring_release_batch: give back count slots returned by shm_ring_peek_batch
+void shm_ring_release_batch(shm_ring* ring, size_t count);
+
+#define AUTO_DETACH_RING __attribute__((cleanup(shm_ring_detach)))
@@ -1,19 +1,46 @@
 #include "logging.h"
 #include "protocol.h"
 #include "common.h"
+#include "shm_ring.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <memory.h>
 #include <signal.h>
 #include <poll.h>
 
+// Messages we ask the broker to let us have in flight
+#define PUB_CREDIT_WINDOW 256
+
+// Most messages sent in a single write
+#define PUB_BATCH 32
+
+// Flow control state, see publisher_credit_packet
+int credit_channel = -1;
+u32 credits = 0;
+
+// With --timed messages carry timestamps, for subscribers in --latency mode
+u8 message_code = (u8)ID_SEND_MSG_SERVER;
+
 void print_usage(){
-    fprintf(stderr, "usage:pub <register_pipe_name> <pipe_name> <box_name>\n");
+    fprintf(stderr, "usage:pub <register_pipe_name> <pipe_name> <box_name> [--shm] [--timed]\n");
+}
+
+// Reads the next line of stdin into packet, returns NULL like fgets
+char* read_message(message_packet* packet){
+    packet->code = message_code;
+    char* ret_val = fgets(message_text(packet), (int)message_text_size(packet), stdin);
+    message_timestamps* times = message_times(packet);
+    if(times!=NULL){
+        times->sent_ns = message_clock_ns();
+        times->ingest_ns = 0;
+    }
+    return ret_val;
 }
 
 // The sig handler has to be registered
@@ -33,80 +60,241 @@ void print_debug(const char* what){
 #endif
 }
 
-int main(int argc, char **argv) {
-    if(argc != 4 || 
-        strnlen(argv[2], MAX_PIPE_NAME_LEN)==MAX_PIPE_NAME_LEN ||
-        strnlen(argv[3], MAX_BOX_NAME_LEN) ==MAX_BOX_NAME_LEN){
+// Same as the fifo loop, but fgets writes straight into the ring slot
+int publish_shm(const char* register_pipe_name, const char* pipe_name, const char* box_name){
+    char ring_name[MAX_PIPE_NAME_LEN];
+    shm_ring_name(ring_name, pipe_name);
 
-        print_usage();
-        return -1;
+    shm_ring* ring AUTO_DETACH_RING = shm_ring_create(ring_name);
+    ALWAYS_ASSERT(ring!=NULL, "FAILED TO CREATE OWN RING! REASON: %i", errno);
+
+    {
+        register_publisher_shm_packet packet;
+        write_packet_register_pub_shm(&packet, ring_name, box_name);
+
+        OPEN_FILE_FD(register_fifo, register_pipe_name, O_WRONLY);
+
+        if(write(register_fifo, &packet, sizeof(packet))!=sizeof(packet)){
+            shm_unlink(ring_name);
+            PANIC("FAILED TO REGISTER AT BROKER");
+        }
     }
 
-    ALWAYS_ASSERT(signal(SIGINT, sig_int_handler)!=SIG_ERR, "FAILED TO REGISTER SIG HANDLER");
+    if(shm_ring_wait_broker(ring, 5000)!=0){
+        shm_unlink(ring_name);
+        if(errno == EINTR){
+            exit(0);
+        }
+        PANIC("BROKER DID NOT ATTACH TO RING!\n");
+    }
+
+    print_debug("CONNECTED!\n");
+
+    while(1){
+        message_packet* slot = shm_ring_reserve(ring);
+        if(slot==NULL){
+            if(errno == EINTR){
+                print_debug("DISCONNECTED!\n");
+            }else{
+                fprintf(stderr, "Broker closed the ring!\n");
+            }
+            break;
+        }
+
+        errno = 0;
+        char* ret_val = read_message(slot);
+
+        if(feof(stdin)){
+            print_debug("Hit eof!\n");
+            break;
+        }
+        if(errno == EINTR){
+            print_debug("DISCONNECTED!\n");
+            break;
+        }
+        if(ret_val==NULL) PANIC("UNKOWN STDIN ERROR!\n");
+
+        shm_ring_commit(ring);
+    }
+
+    shm_ring_close(ring);
+    return 0;
+}
+
+int open_channel_fifo(const char* register_pipe_name, const char* pipe_name, const char* box_name){
+    // The fifos have to exist before the broker tries to open them
+    ALWAYS_ASSERT(mkfifo(pipe_name, 0666)==0, "FAILED TO CREATE OWN FIFO! REASON: %i", errno);
+
+    // Without room for the credit fifo's name we go without flow control
+    char credit_pipe[MAX_PIPE_NAME_LEN];
+    bool flow_control = credit_pipe_name(credit_pipe, pipe_name);
+    if(flow_control){
+        ALWAYS_ASSERT(mkfifo(credit_pipe, 0666)==0, "FAILED TO CREATE OWN FIFO! REASON: %i", errno);
+    }
 
-    const char* register_pipe_name = argv[1];
-    const char* pipe_name = argv[2];
-    const char* box_name = argv[3];
-    
     {
         register_publisher_packet packet;
         write_packet_register_pub(&packet, pipe_name, box_name);
+        packet.credit_window = flow_control ? PUB_CREDIT_WINDOW : 0;
 
         OPEN_FILE_FD(register_fifo, register_pipe_name, O_WRONLY);
 
         ssize_t wrote = write(register_fifo, &packet, sizeof(packet));
 
         if(wrote!=sizeof(packet)){
+            unlink(pipe_name);
+            if(flow_control) unlink(credit_pipe);
             PANIC("FAILED TO REGISTER AT BROKER");
         }
         
     }
 
-    ALWAYS_ASSERT(mkfifo(pipe_name, 0666)==0, "FAILED TO CREATE OWN FIFO! REASON: %i", errno);
-    int msg_channel_fifo AUTO_CLOSE_FD = open(pipe_name, O_WRONLY);
+    // Same order as the broker opens them in
+    int msg_channel_fifo = open(pipe_name, O_WRONLY);
+    if(flow_control && msg_channel_fifo != -1){
+        credit_channel = open(credit_pipe, O_RDONLY);
+    }
 
     // Remove pipe from fs (not delete)
     unlink(pipe_name); //  (return value is ignored)
+    if(flow_control) unlink(credit_pipe);
 
-    if(msg_channel_fifo == -1){
+    if(msg_channel_fifo == -1 || (flow_control && credit_channel == -1)){
         if(errno == EINTR){
             exit(0);
         }
         PANIC("FAILED TO OPEN OWN FIFO!\n");
     }
 
-    print_debug("CONNECTED!\n");
+    return msg_channel_fifo;
+}
 
-    message_packet packet;
+// Blocks until we have credit, also picking up any grants already waiting.
+// Returns false once the broker ended the session
+bool wait_credits(){
+    if(credit_channel==-1) return true;
 
-    packet.code = (u8)ID_SEND_MSG_SERVER;
+    struct pollfd pfd = { credit_channel, POLLIN, 0 };
+    while(credits==0 || poll(&pfd, 1, 0)>0){
+        publisher_credit_packet grant;
+        if(read(credit_channel, &grant, sizeof(grant))!=sizeof(grant) || grant.code!=(u8)ID_PUBLISHER_CREDIT){
+            return false;
+        }
+        credits += grant.credits;
+    }
+    return true;
+}
 
-    while(1){
-        char* ret_val = fgets(packet.message, 1024, stdin);
+// Whether another line can be read from stdin without blocking
+bool stdin_ready(){
+    struct pollfd pfd = { fileno(stdin), POLLIN, 0 };
+    return poll(&pfd, 1, 0)>0;
+}
 
-        // Exit on CTRL+D
-        if(feof(stdin)){
-            print_debug("Hit eof!\n");
-            break;
-        }
-        if(errno == EINTR){
-            print_debug("DISCONNECTED!\n");
-            break;
+// Pipes take the whole batch in one write, the socket keeps one packet per
+// message
+bool send_batch(int msg_channel, bool is_socket, const message_packet* batch, size_t count){
+    if(!is_socket){
+        ssize_t bytes = (ssize_t)(count*sizeof(message_packet));
+        return write(msg_channel, batch, (size_t)bytes)==bytes;
+    }
+    for(size_t i=0;i<count;i++){
+        if(write(msg_channel, batch+i, sizeof(message_packet))!=sizeof(message_packet)) return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool use_shm = false;
+    bool valid_args = argc>=4;
+    for(int i=4;i<argc;i++){
+        if(strcmp(argv[i], "--shm")==0){
+            use_shm = true;
+        }else if(strcmp(argv[i], "--timed")==0){
+            message_code = (u8)ID_SEND_TIMED_MSG_SERVER;
+        }else{
+            valid_args = false;
         }
-        if(ret_val==NULL) PANIC("UNKOWN STDIN ERROR!\n");
+    }
 
-        ssize_t wrote = write(msg_channel_fifo, &packet, sizeof(packet));
-        
-        if(errno == EINTR){
-            print_debug("DISCONNECTED!\n");
+    if(!valid_args ||
+        strnlen(argv[2], MAX_PIPE_NAME_LEN)==MAX_PIPE_NAME_LEN ||
+        strnlen(argv[3], MAX_BOX_NAME_LEN) ==MAX_BOX_NAME_LEN){
+
+        print_usage();
+        return -1;
+    }
+
+    ALWAYS_ASSERT(signal(SIGINT, sig_int_handler)!=SIG_ERR, "FAILED TO REGISTER SIG HANDLER");
+
+    const char* register_pipe_name = argv[1];
+    const char* pipe_name = argv[2];
+    const char* box_name = argv[3];
+
+    if(use_shm){
+        return publish_shm(register_pipe_name, pipe_name, box_name);
+    }
+
+    int msg_channel AUTO_CLOSE_FD = -1;
+    bool is_socket = is_broker_socket(register_pipe_name);
+
+    if(is_socket){
+        register_publisher_packet packet;
+        write_packet_register_pub(&packet, pipe_name, box_name);
+        packet.credit_window = PUB_CREDIT_WINDOW;
+
+        msg_channel = connect_broker_socket(register_pipe_name, &packet, sizeof(packet));
+        ALWAYS_ASSERT(msg_channel!=-1, "FAILED TO REGISTER AT BROKER");
+        credit_channel = msg_channel;
+    }else{
+        msg_channel = open_channel_fifo(register_pipe_name, pipe_name, box_name);
+    }
+
+    print_debug("CONNECTED!\n");
+
+    message_packet batch[PUB_BATCH];
+    bool done = false;
+
+    while(!done){
+        if(!wait_credits()){
+            fprintf(stderr, "Broker closed the connection!\n");
             break;
         }
 
-        if(wrote != sizeof(packet)){
-            fprintf(stderr, "Failed to write to pipe! (%i)\n", (i32)wrote);
+        // Batch up whatever is already waiting on stdin, within our credit
+        size_t count = 0;
+        do{
+            errno = 0;
+            char* ret_val = read_message(&batch[count]);
+
+            // Exit on CTRL+D
+            if(feof(stdin)){
+                print_debug("Hit eof!\n");
+                done = true;
+                break;
+            }
+            if(errno == EINTR){
+                print_debug("DISCONNECTED!\n");
+                done = true;
+                break;
+            }
+            if(ret_val==NULL) PANIC("UNKOWN STDIN ERROR!\n");
+            count++;
+        }while(count<PUB_BATCH && (credit_channel==-1 || count<credits) && stdin_ready());
+
+        if(count==0) continue;
+
+        errno = 0;
+        if(!send_batch(msg_channel, is_socket, batch, count)){
+            if(errno == EINTR){
+                print_debug("DISCONNECTED!\n");
+            }else{
+                fprintf(stderr, "Failed to write to pipe! (%i)\n", errno);
+            }
             break;
         }
+        if(credit_channel!=-1) credits -= (u32)count;
     }
-    
+
     return 0;
 }
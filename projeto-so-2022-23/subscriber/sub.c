@@ -1,10 +1,12 @@
 #include "logging.h"
 #include "protocol.h"
 #include "common.h"
+#include "shm_ring.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <memory.h>
 #include <signal.h>
 #include <fcntl.h>
@@ -14,7 +16,111 @@
 #include "debug.h"
 
 void print_usage(){
-    fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> <box_name>\n");
+    fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> <box_name> [--shm | --pattern]\n"
+                    "           [--latest | --offset <first_message> | --last <n_messages>]\n"
+                    "           [--lag-budget <n_messages>] [--on-lag disconnect|drop-oldest|skip-to-latest]\n"
+                    "           [--latency]\n");
+}
+
+// Where to start reading the box from, replays it all by default
+u8 start_mode = SUB_START_EARLIEST;
+u64 start_value = 0;
+
+// What the broker does once we fall too far behind, its defaults if unset
+u8 lag_policy = LAG_POLICY_DEFAULT;
+u64 lag_budget = 0;
+
+// With --pattern box_name is a pattern, and we get the messages of every
+// box it matches, each printed after its box's name
+bool use_pattern = false;
+
+void write_session_options(register_subscriber_packet* packet){
+    packet->start_mode = start_mode;
+    packet->start_value = start_value;
+    packet->lag_policy = lag_policy;
+    packet->lag_budget = lag_budget;
+}
+
+bool parse_lag_policy(const char* name){
+    if(strcmp(name, "disconnect")==0){
+        lag_policy = LAG_POLICY_DISCONNECT;
+    }else if(strcmp(name, "drop-oldest")==0){
+        lag_policy = LAG_POLICY_DROP_OLDEST;
+    }else if(strcmp(name, "skip-to-latest")==0){
+        lag_policy = LAG_POLICY_SKIP_TO_LATEST;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+// With --latency messages are timed instead of printed, and a report of
+// the latencies and throughput is printed once we are done
+bool measure_latency = false;
+
+typedef struct{
+    u64* end_to_end;    // from the publisher's send to our read
+    u64* from_broker;   // from the broker's ingest to our read
+    size_t count, capacity;
+    u64 first_ns, last_ns;
+} latency_samples;
+
+latency_samples samples = {0};
+
+void record_latency(message_packet* packet){
+    u64 now = message_clock_ns();
+    if(samples.first_ns==0) samples.first_ns = now;
+    samples.last_ns = now;
+
+    // Only messages published with pub --timed carry timestamps
+    message_timestamps* times = message_times(packet);
+    if(times==NULL || times->sent_ns==0 || times->ingest_ns==0) return;
+
+    if(samples.count==samples.capacity){
+        samples.capacity = samples.capacity==0 ? 4096 : samples.capacity*2;
+        samples.end_to_end = realloc(samples.end_to_end, samples.capacity*sizeof(u64));
+        samples.from_broker = realloc(samples.from_broker, samples.capacity*sizeof(u64));
+        ALWAYS_ASSERT(samples.end_to_end!=NULL && samples.from_broker!=NULL, "NO MEMORY!");
+    }
+    samples.end_to_end[samples.count] = now - times->sent_ns;
+    samples.from_broker[samples.count] = now - times->ingest_ns;
+    samples.count++;
+}
+
+// Box announcements of a pattern subscription come as messages too
+bool is_message(const message_packet* packet){
+    return packet->code==(u8)ID_SEND_MSG_SUBSCRIBER || packet->code==(u8)ID_SEND_TIMED_MSG_SUBSCRIBER;
+}
+
+int cmp_u64(const void* a, const void* b){
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return (x>y) - (x<y);
+}
+
+void print_latency(const char* name, u64* latencies, size_t n){
+    if(n==0) return;
+    qsort(latencies, n, sizeof(u64), cmp_u64);
+    fprintf(stdout, "latency name=%s samples=%zu p50_ns=%lu p99_ns=%lu p999_ns=%lu max_ns=%lu\n",
+        name, n, latencies[n/2], latencies[n*99/100], latencies[n*999/1000], latencies[n-1]);
+}
+
+void print_latency_report(size_t messages_received){
+    double seconds = (double)(samples.last_ns - samples.first_ns)/1e9;
+    fprintf(stdout, "throughput messages=%zu seconds=%.3f msgs_per_s=%.0f\n",
+        messages_received, seconds, seconds>0 ? (double)messages_received/seconds : 0.0);
+    print_latency("end_to_end", samples.end_to_end, samples.count);
+    print_latency("broker_to_sub", samples.from_broker, samples.count);
+
+    free(samples.end_to_end);
+    free(samples.from_broker);
+}
+
+void consume_message(message_packet* packet){
+    if(measure_latency){
+        record_latency(packet);
+    }else{
+        fprintf(stdout, "%s\n", message_text(packet));
+    }
 }
 
 // The sig handler has to be registered
@@ -35,39 +141,120 @@ void print_debug(const char* what){
 }
 
 
-int main(int argc, char **argv) {
+// Messages are printed straight from the ring slots
+size_t subscribe_shm(const char* register_pipe_name, const char* pipe_name, const char* box_name){
     size_t messages_received = 0;
 
-    if(argc != 4 || 
-        strnlen(argv[2], MAX_PIPE_NAME_LEN)==MAX_PIPE_NAME_LEN ||
-        strnlen(argv[3], MAX_BOX_NAME_LEN) ==MAX_BOX_NAME_LEN){
+    char ring_name[MAX_PIPE_NAME_LEN];
+    shm_ring_name(ring_name, pipe_name);
 
-        print_usage();
-        return -1;
+    shm_ring* ring AUTO_DETACH_RING = shm_ring_create(ring_name);
+    ALWAYS_ASSERT(ring!=NULL, "FAILED TO CREATE OWN RING! REASON: %i", errno);
+
+    { // Register self at broker
+        register_subscriber_shm_packet packet;
+        write_packet_register_sub_shm(&packet, ring_name, box_name);
+        write_session_options(&packet);
+
+        OPEN_FILE_FD(register_fifo, register_pipe_name, O_WRONLY);
+
+        if(write(register_fifo, &packet, sizeof(packet)) < sizeof(packet)){
+            shm_unlink(ring_name);
+            PANIC("FAILED TO REGISTER AT BROKER");
+        }
     }
 
-    // Relabel the individual argv
-    const char* register_pipe_name = argv[1];
-    const char* pipe_name = argv[2];
-    const char* box_name = argv[3];
+    if(shm_ring_wait_broker(ring, 5000)!=0){
+        shm_unlink(ring_name);
+        if(errno == EINTR){
+            return 0;
+        }
+        PANIC("BROKER DID NOT ATTACH TO RING!\n");
+    }
 
-    ALWAYS_ASSERT(signal(SIGINT, sig_int_handler)!=SIG_ERR, "FAILED TO REGISTER SIG HANDLER");
+    print_debug("CONNECTED!\n");
+
+    message_packet* slot;
+    while((slot = shm_ring_peek(ring))!=NULL){
+        if(!is_message(slot)){
+            PANIC("GOT INVALID PACKET ID!");
+        }
+
+        messages_received++;
+        consume_message(slot);
+        shm_ring_release(ring);
+    }
+
+    shm_ring_close(ring);
+    return messages_received;
+}
+
+void write_register_packet(register_subscriber_packet* packet, const char* pipe_name, const char* box_name){
+    if(use_pattern){
+        write_packet_register_sub_pattern(packet, pipe_name, box_name);
+    }else{
+        write_packet_register_sub(packet, pipe_name, box_name);
+    }
+    write_session_options(packet);
+}
+
+// Names of the boxes a pattern subscription announced, by box id
+typedef struct{
+    u32 id;
+    char name[MAX_BOX_NAME_LEN];
+} pattern_box_name;
+
+pattern_box_name* pattern_boxes = NULL;
+size_t pattern_box_count = 0;
+
+const char* pattern_box_lookup(u32 id){
+    for(size_t i=0;i<pattern_box_count;i++){
+        if(pattern_boxes[i].id==id) return pattern_boxes[i].name;
+    }
+    return NULL;
+}
+
+void consume_pattern_frame(pattern_message_packet* frame){
+    if(frame->kind==PATTERN_FRAME_BOX){
+        pattern_boxes = realloc(pattern_boxes, (pattern_box_count+1)*sizeof(pattern_box_name));
+        ALWAYS_ASSERT(pattern_boxes!=NULL, "NO MEMORY!");
+        pattern_boxes[pattern_box_count].id = frame->box_id;
+        strncpy(pattern_boxes[pattern_box_count].name, frame->packet.message, MAX_BOX_NAME_LEN-1);
+        pattern_boxes[pattern_box_count].name[MAX_BOX_NAME_LEN-1] = '\0';
+        pattern_box_count++;
+        return;
+    }
+
+    const char* name = pattern_box_lookup(frame->box_id);
+    if(frame->kind!=PATTERN_FRAME_MSG || name==NULL){
+        PANIC("GOT A MESSAGE OF AN UNKNOWN BOX!");
+    }
+    if(measure_latency){
+        record_latency(&frame->packet);
+    }else{
+        fprintf(stdout, "%s: %s\n", name, message_text(&frame->packet));
+    }
+}
+
+int open_channel_fifo(const char* register_pipe_name, const char* pipe_name, const char* box_name){
+    // The fifo has to exist before the broker tries to open it
+    ALWAYS_ASSERT(mkfifo(pipe_name, 0666)==0, "FAILED TO CREATE OWN FIFO! REASON: %i", errno);
 
     { // Register self at broker
         register_subscriber_packet packet;
-        write_packet_register_sub(&packet, pipe_name, box_name);
+        write_register_packet(&packet, pipe_name, box_name);
 
         OPEN_FILE_FD(register_fifo, register_pipe_name, O_WRONLY);
 
         ssize_t wrote = write(register_fifo, &packet, sizeof(packet));
 
         if(wrote < sizeof(packet)){
+            unlink(pipe_name);
             PANIC("FAILED TO REGISTER AT BROKER");
         }
     }
 
-    ALWAYS_ASSERT(mkfifo(pipe_name, 0666)==0, "FAILED TO CREATE OWN FIFO! REASON: %i", errno);
-    int msg_channel_fifo AUTO_CLOSE_FD = open(pipe_name, O_RDONLY);
+    int msg_channel_fifo = open(pipe_name, O_RDONLY);
 
     // Remove pipe from fs (not delete)
     unlink(pipe_name); //  (return value is ignored)
@@ -80,17 +267,98 @@ int main(int argc, char **argv) {
         PANIC("FAILED TO OPEN OWN FIFO!\n");
     }
 
+    return msg_channel_fifo;
+}
+
+// The broker may hand a packet (or pattern frame) over in several writes, a
+// short read only means the rest of it is still on the way. Returns how
+// much was read
+ssize_t read_packet(int channel, void* packet, size_t size){
+    size_t got = 0;
+    while(got<size){
+        ssize_t rread = read(channel, (u8*)packet + got, size - got);
+        if(rread<=0) return got>0 ? (ssize_t)got : rread;
+        got += (size_t)rread;
+    }
+    return (ssize_t)got;
+}
+
+int main(int argc, char **argv) {
+    size_t messages_received = 0;
+    bool use_shm = false;
+    bool valid_options = true;
+
+    for(int i=4;i<argc && valid_options;i++){
+        if(strcmp(argv[i], "--shm")==0){
+            use_shm = true;
+        }else if(strcmp(argv[i], "--pattern")==0){
+            use_pattern = true;
+        }else if(strcmp(argv[i], "--latest")==0){
+            start_mode = SUB_START_LATEST;
+        }else if(strcmp(argv[i], "--offset")==0 && i+1<argc && sscanf(argv[i+1], "%lu", &start_value)==1){
+            start_mode = SUB_START_OFFSET;
+            i++;
+        }else if(strcmp(argv[i], "--last")==0 && i+1<argc && sscanf(argv[i+1], "%lu", &start_value)==1){
+            start_mode = SUB_START_LAST_N;
+            i++;
+        }else if(strcmp(argv[i], "--lag-budget")==0 && i+1<argc && sscanf(argv[i+1], "%lu", &lag_budget)==1){
+            i++;
+        }else if(strcmp(argv[i], "--on-lag")==0 && i+1<argc && parse_lag_policy(argv[i+1])){
+            i++;
+        }else if(strcmp(argv[i], "--latency")==0){
+            measure_latency = true;
+        }else{
+            valid_options = false;
+        }
+    }
+
+    if(argc < 4 || !valid_options || (use_shm && use_pattern) ||
+        strnlen(argv[2], MAX_PIPE_NAME_LEN)==MAX_PIPE_NAME_LEN ||
+        strnlen(argv[3], MAX_BOX_NAME_LEN) ==MAX_BOX_NAME_LEN){
+
+        print_usage();
+        return -1;
+    }
+
+    // Relabel the individual argv
+    const char* register_pipe_name = argv[1];
+    const char* pipe_name = argv[2];
+    const char* box_name = argv[3];
+
+    ALWAYS_ASSERT(signal(SIGINT, sig_int_handler)!=SIG_ERR, "FAILED TO REGISTER SIG HANDLER");
+
+    if(use_shm){
+        messages_received = subscribe_shm(register_pipe_name, pipe_name, box_name);
+        fprintf(stdout, "Received %zu messages!\n", messages_received);
+        if(measure_latency) print_latency_report(messages_received);
+        return 0;
+    }
+
+    int msg_channel AUTO_CLOSE_FD = -1;
+
+    if(is_broker_socket(register_pipe_name)){
+        register_subscriber_packet packet;
+        write_register_packet(&packet, pipe_name, box_name);
+
+        msg_channel = connect_broker_socket(register_pipe_name, &packet, sizeof(packet));
+        ALWAYS_ASSERT(msg_channel!=-1, "FAILED TO REGISTER AT BROKER");
+    }else{
+        msg_channel = open_channel_fifo(register_pipe_name, pipe_name, box_name);
+    }
+
     print_debug("CONNECTED!\n");
 
-    // Setup for receiving messages
-    message_packet packet;
+    // Setup for receiving messages, pattern frames wrap the packet
+    pattern_message_packet frame;
+    message_packet* packet = use_pattern ? &frame.packet : (message_packet*)&frame;
+    size_t frame_size = use_pattern ? sizeof(frame) : sizeof(*packet);
     ssize_t read_from_fifo;
 
     while(1){
         // Read packet
-        read_from_fifo = read(msg_channel_fifo, &packet, sizeof(packet));
+        read_from_fifo = read_packet(msg_channel, &frame, frame_size);
 
-        if(read_from_fifo!=sizeof(packet)){
+        if(read_from_fifo!=frame_size){
             if(errno == 0){
                 print_debug("SERVER DISCONNECTED!\n");
                 break;
@@ -101,15 +369,22 @@ int main(int argc, char **argv) {
             PANIC("UNKNOWN ERROR!");
         }
 
-        if(packet.code!=(u8)ID_SEND_MSG_SUBSCRIBER){
+        if(!is_message(packet) ||
+            (use_pattern && frame.code!=(u8)ID_SEND_MSG_PATTERN)){
             PANIC("GOT INVALID PACKET ID!");
         }
 
-        messages_received++;
-        fprintf(stdout, "%s\n", packet.message);
+        if(use_pattern){
+            if(frame.kind==PATTERN_FRAME_MSG) messages_received++;
+            consume_pattern_frame(&frame);
+        }else{
+            messages_received++;
+            consume_message(packet);
+        }
     }
 
     fprintf(stdout, "Received %zu messages!\n", messages_received);
+    if(measure_latency) print_latency_report(messages_received);
 
     return 0;
 }
\ No newline at end of file
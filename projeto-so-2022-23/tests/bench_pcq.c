@@ -0,0 +1,233 @@
+#include "producer-consumer.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Sweeps producer/consumer thread counts and queue capacities over the
+// producer consumer queue and prints, for each combination, one key=value
+// line with the throughput, the time spent inside pcq_enqueue/pcq_dequeue
+// and how often the threads had to sleep for it, then one line per side
+// with the whole wait time histogram.
+//
+// Sleeps are counted by wrapping pthread_cond_wait and pthread_mutex_lock
+// at link time (see the Makefile), so the queue itself is left untouched.
+//
+// usage: bench_pcq [operations_per_run]
+
+#define DEFAULT_OPERATIONS 50000
+
+// Histogram bucket i holds waits below 2^(i+1) ns
+#define NUM_BUCKETS 40
+
+// Thread counts tried on either side, and the most a run uses
+static const int thread_counts[] = {1, 2, 4};
+#define MAX_THREADS 8
+static const size_t capacities[] = {1, 16, 256};
+
+#define LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+typedef struct {
+    uint64_t buckets[NUM_BUCKETS];
+    uint64_t ops, total_ns, max_ns;
+    uint64_t cond_waits, contended_locks;
+} side_stats;
+
+typedef struct {
+    size_t ops;
+    side_stats stats;
+} worker;
+
+pc_queue_t queue;
+
+static _Thread_local uint64_t cond_waits = 0;
+static _Thread_local uint64_t contended_locks = 0;
+
+int __real_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+
+int __wrap_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    cond_waits++;
+    return __real_pthread_cond_wait(cond, mutex);
+}
+
+int __wrap_pthread_mutex_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return 0;
+    }
+    contended_locks++;
+    return __real_pthread_mutex_lock(mutex);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record(side_stats *stats, uint64_t ns) {
+    size_t bucket = ns < 2 ? 0 : (size_t)(63 - __builtin_clzll(ns));
+    if (bucket >= NUM_BUCKETS) {
+        bucket = NUM_BUCKETS - 1;
+    }
+    stats->buckets[bucket]++;
+    stats->ops++;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns) {
+        stats->max_ns = ns;
+    }
+}
+
+static void merge(side_stats *into, const side_stats *from) {
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->ops += from->ops;
+    into->total_ns += from->total_ns;
+    if (from->max_ns > into->max_ns) {
+        into->max_ns = from->max_ns;
+    }
+    into->cond_waits += from->cond_waits;
+    into->contended_locks += from->contended_locks;
+}
+
+// Upper bound of the bucket holding the p-th (0 to 1) wait
+static uint64_t percentile(const side_stats *stats, double p) {
+    uint64_t rank = (uint64_t)(p * (double)stats->ops);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen > rank) {
+            return (2ull << i) - 1;
+        }
+    }
+    return stats->max_ns;
+}
+
+// producer_thread_func: enqueues its share of the operations
+static void *producer_thread_func(void *arg) {
+    worker *self = arg;
+    cond_waits = contended_locks = 0;
+    for (size_t i = 0; i < self->ops; i++) {
+        uint64_t start = now_ns();
+        pcq_enqueue(&queue, self);
+        record(&self->stats, now_ns() - start);
+    }
+    self->stats.cond_waits = cond_waits;
+    self->stats.contended_locks = contended_locks;
+    return NULL;
+}
+
+// consumer_thread_func: dequeues until it gets the NULL end marker
+static void *consumer_thread_func(void *arg) {
+    worker *self = arg;
+    cond_waits = contended_locks = 0;
+    while (true) {
+        uint64_t start = now_ns();
+        void *elem = pcq_dequeue(&queue);
+        if (elem == NULL) {
+            break;
+        }
+        record(&self->stats, now_ns() - start);
+    }
+    self->stats.cond_waits = cond_waits;
+    self->stats.contended_locks = contended_locks;
+    return NULL;
+}
+
+static void print_side(const char *side, const side_stats *stats, int producers,
+                       int consumers, size_t capacity) {
+    printf("pcq_hist side=%s producers=%i consumers=%i capacity=%zu buckets=", side,
+           producers, consumers, capacity);
+    bool first = true;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        if (stats->buckets[i] > 0) {
+            printf("%s%llu:%lu", first ? "" : ",", (2ull << i) - 1, stats->buckets[i]);
+            first = false;
+        }
+    }
+    printf("\n");
+}
+
+static void run(int producers, int consumers, size_t capacity, size_t ops) {
+    int res = pcq_create(&queue, capacity);
+    if (res != 0) {
+        fprintf(stderr, "failed to create the queue\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t threads[MAX_THREADS];
+    worker workers[MAX_THREADS] = {0};
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < producers; i++) {
+        workers[i].ops = ops / (size_t)producers + ((size_t)i < ops % (size_t)producers);
+        pthread_create(&threads[i], NULL, producer_thread_func, &workers[i]);
+    }
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[producers + i], NULL, consumer_thread_func,
+                       &workers[producers + i]);
+    }
+
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < consumers; i++) {
+        pcq_enqueue(&queue, NULL);
+    }
+    for (int i = 0; i < consumers; i++) {
+        pthread_join(threads[producers + i], NULL);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    getrusage(RUSAGE_SELF, &after);
+    pcq_destroy(&queue);
+
+    side_stats enqueue = {0}, dequeue = {0};
+    for (int i = 0; i < producers; i++) {
+        merge(&enqueue, &workers[i].stats);
+    }
+    for (int i = 0; i < consumers; i++) {
+        merge(&dequeue, &workers[producers + i].stats);
+    }
+
+    double n = (double)ops;
+    long switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+    printf("pcq producers=%i consumers=%i capacity=%zu ops=%zu ops_per_s=%.0f "
+           "enq_mean_ns=%.0f enq_p50_ns=%lu enq_p99_ns=%lu enq_max_ns=%lu "
+           "deq_mean_ns=%.0f deq_p50_ns=%lu deq_p99_ns=%lu deq_max_ns=%lu "
+           "cond_waits_per_op=%.3f contended_locks_per_op=%.3f context_switches_per_op=%.3f\n",
+           producers, consumers, capacity, ops, n * 1e9 / (double)elapsed,
+           (double)enqueue.total_ns / n, percentile(&enqueue, 0.5),
+           percentile(&enqueue, 0.99), enqueue.max_ns, (double)dequeue.total_ns / n,
+           percentile(&dequeue, 0.5), percentile(&dequeue, 0.99), dequeue.max_ns,
+           (double)(enqueue.cond_waits + dequeue.cond_waits) / n,
+           (double)(enqueue.contended_locks + dequeue.contended_locks) / n,
+           (double)switches / n);
+    print_side("enqueue", &enqueue, producers, consumers, capacity);
+    print_side("dequeue", &dequeue, producers, consumers, capacity);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    size_t ops = DEFAULT_OPERATIONS;
+    if (argc > 2 || (argc == 2 && (sscanf(argv[1], "%zu", &ops) != 1 || ops == 0))) {
+        fprintf(stderr, "usage: bench_pcq [operations_per_run]\n");
+        return -1;
+    }
+
+    for (size_t c = 0; c < LENGTH(capacities); c++) {
+        for (size_t p = 0; p < LENGTH(thread_counts); p++) {
+            for (size_t q = 0; q < LENGTH(thread_counts); q++) {
+                run(thread_counts[p], thread_counts[q], capacities[c], ops);
+            }
+        }
+    }
+
+    return 0;
+}
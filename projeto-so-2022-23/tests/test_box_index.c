@@ -0,0 +1,89 @@
+#include "mbroker/box_index.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_LEN 1000
+#define NUM_MESSAGES 500
+
+box_index index_;
+int box_fd;
+
+// fill_box: start an empty box and append n messages of RECORD_LEN bytes
+void fill_box(const char* box_name, u64 n){
+    box_fd = open(box_name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    assert(box_fd!=-1);
+    int res = box_index_open(&index_, box_name, box_fd, true);
+    assert(res==0);
+    for(u64 i=0;i<n;i++){
+        box_index_append(&index_, RECORD_LEN);
+    }
+}
+
+void empty_box(const char* box_name){
+    box_index_close(&index_, box_name, true);
+    close(box_fd);
+    unlink(box_name);
+}
+
+u64 messages_kept(){
+    return index_.messages - box_index_first(&index_);
+}
+
+u64 bytes_kept(){
+    return index_.end - box_index_head(&index_);
+}
+
+int main(){
+    char dir[] = "/tmp/test_box_index_XXXXXX";
+    assert(mkdtemp(dir)!=NULL);
+    assert(chdir(dir)==0);
+
+    // a message limit keeps at least that many, and drops whatever whole
+    // segments it can past them
+    box_retention by_messages = {0, 100, 0};
+    fill_box("messages", NUM_MESSAGES);
+    box_index_trim(&index_, box_fd, &by_messages, index_.end, 0);
+    assert(messages_kept()>=100);
+    assert(messages_kept()<100+BOX_INDEX_INTERVAL);
+    empty_box("messages");
+
+    // same for bytes
+    box_retention by_bytes = {100*RECORD_LEN, 0, 0};
+    fill_box("bytes", NUM_MESSAGES);
+    box_index_trim(&index_, box_fd, &by_bytes, index_.end, 0);
+    assert(bytes_kept()>=100*RECORD_LEN);
+    assert(bytes_kept()<(100+BOX_INDEX_INTERVAL)*RECORD_LEN);
+    empty_box("bytes");
+
+    // a limit that is met already drops nothing
+    fill_box("within", 100+BOX_INDEX_INTERVAL-1);
+    assert(box_index_trim(&index_, box_fd, &by_messages, index_.end, 0)==0);
+    assert(messages_kept()==100+BOX_INDEX_INTERVAL-1);
+    empty_box("within");
+
+    // an age limit drops every whole segment once they are all old enough,
+    // but none while they are still fresh
+    box_retention by_age = {0, 0, 1};
+    fill_box("age", NUM_MESSAGES);
+    u64 now = (u64)time(NULL);
+    assert(box_index_trim(&index_, box_fd, &by_age, index_.end, now)==0);
+    box_index_trim(&index_, box_fd, &by_age, index_.end, now+10);
+    assert(messages_kept()==NUM_MESSAGES%BOX_INDEX_INTERVAL);
+    empty_box("age");
+
+    // nothing a subscriber has yet to read goes, whatever the limit
+    fill_box("pinned", NUM_MESSAGES);
+    box_index_trim(&index_, box_fd, &by_messages, 10*RECORD_LEN, 0);
+    assert(messages_kept()==NUM_MESSAGES);
+    box_index_trim(&index_, box_fd, &by_messages, 2*BOX_INDEX_INTERVAL*RECORD_LEN, 0);
+    assert(box_index_first(&index_)==2*BOX_INDEX_INTERVAL);
+    empty_box("pinned");
+
+    assert(chdir("/")==0);
+    assert(rmdir(dir)==0);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "hash_map.h"
+
+#include <stdlib.h>
+
+// Grows past 7/8 full, Robin Hood keeps probes short well beyond that
+#define HASH_MAP_LOAD_NUM 7
+#define HASH_MAP_LOAD_DEN 8
+
+static hash_map_slot* alloc_slots(size_t capacity){
+    hash_map_slot* slots = calloc(capacity, sizeof(hash_map_slot));
+    ALWAYS_ASSERT(slots!=NULL, "NO MEMORY!");
+    return slots;
+}
+
+void hash_map_create(hash_map* map, size_t initial_capacity, hash_map_match_fn match){
+    size_t capacity = 8;
+    while(capacity<initial_capacity) capacity *= 2;
+    map->slots = alloc_slots(capacity);
+    map->capacity = capacity;
+    map->size = 0;
+    map->match = match;
+}
+
+static void place(hash_map_slot* slots, size_t capacity, hash_map_slot entry){
+    size_t mask = capacity-1;
+    entry.distance = 1;
+    for(size_t i=entry.hash&mask;;i=(i+1)&mask){
+        if(slots[i].distance==0){
+            slots[i] = entry;
+            return;
+        }
+        // The richer entry gives up its slot and carries on probing
+        if(slots[i].distance<entry.distance){
+            hash_map_slot richer = slots[i];
+            slots[i] = entry;
+            entry = richer;
+        }
+        entry.distance++;
+    }
+}
+
+static void grow(hash_map* map){
+    size_t capacity = map->capacity*2;
+    hash_map_slot* slots = alloc_slots(capacity);
+    for(size_t i=0;i<map->capacity;i++){
+        if(map->slots[i].distance!=0) place(slots, capacity, map->slots[i]);
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->capacity = capacity;
+}
+
+// Slot holding key, or capacity if it isn't in the map
+static size_t find_slot(const hash_map* map, u32 hash, const void* key){
+    size_t mask = map->capacity-1;
+    u32 distance = 1;
+    for(size_t i=hash&mask;;i=(i+1)&mask, distance++){
+        const hash_map_slot* slot = &map->slots[i];
+        // Any entry of key would have taken this slot from a richer one
+        if(slot->distance<distance) return map->capacity;
+        if(slot->hash==hash && map->match(slot->value, key)) return i;
+    }
+}
+
+void* hash_map_find(const hash_map* map, u32 hash, const void* key){
+    size_t i = find_slot(map, hash, key);
+    return i==map->capacity ? NULL : map->slots[i].value;
+}
+
+void hash_map_insert(hash_map* map, u32 hash, void* value){
+    if((map->size+1)*HASH_MAP_LOAD_DEN > map->capacity*HASH_MAP_LOAD_NUM) grow(map);
+    hash_map_slot entry = {.hash = hash, .value = value};
+    place(map->slots, map->capacity, entry);
+    map->size++;
+}
+
+void* hash_map_remove(hash_map* map, u32 hash, const void* key){
+    size_t i = find_slot(map, hash, key);
+    if(i==map->capacity) return NULL;
+    void* value = map->slots[i].value;
+
+    // Shift back the entries that probed past the removed one
+    size_t mask = map->capacity-1;
+    for(size_t next=(i+1)&mask;map->slots[next].distance>1;i=next, next=(next+1)&mask){
+        map->slots[i] = map->slots[next];
+        map->slots[i].distance--;
+    }
+    map->slots[i].distance = 0;
+    map->slots[i].value = NULL;
+    map->size--;
+    return value;
+}
+
+void hash_map_destroy(hash_map* map){
+    free(map->slots);
+    map->slots = NULL;
+    map->capacity = 0;
+    map->size = 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Open addressing map from a key to a value, with Robin Hood probing: an
+// entry inserted further from its home slot than the one sitting in a slot
+// takes the slot and the other moves on, so probe lengths stay short and
+// even, and a miss stops as soon as it's further from home than the slot
+// it's looking at. Removal shifts the entries after it back instead of
+// leaving tombstones.
+//
+// The map doesn't hold the keys. The caller hashes the key and keeps it in
+// the value (a box keeps its own name), the stored hash rules out most
+// slots and match only runs on the ones whose hash is the same
+typedef bool (*hash_map_match_fn)(const void* value, const void* key);
+
+typedef struct{
+    u32 hash;
+    u32 distance;   // from the home slot plus one, 0 for an empty slot
+    void* value;
+} hash_map_slot;
+
+typedef struct{
+    hash_map_slot* slots;
+    size_t capacity;    // a power of two
+    size_t size;
+    hash_map_match_fn match;
+} hash_map;
+
+void hash_map_create(hash_map* map, size_t initial_capacity, hash_map_match_fn match);
+
+// hash_map_find: the value stored under key, NULL if there's none
+void* hash_map_find(const hash_map* map, u32 hash, const void* key);
+
+// hash_map_insert: store value under hash, the key mustn't be in the map
+void hash_map_insert(hash_map* map, u32 hash, void* value);
+
+// hash_map_remove: remove and return the value under key, NULL if there's none
+void* hash_map_remove(hash_map* map, u32 hash, const void* key);
+
+void hash_map_destroy(hash_map* map);
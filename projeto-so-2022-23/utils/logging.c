@@ -1,5 +1,180 @@
 #include "logging.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
 log_level_t g_level = LOG_QUIET;
 
 void set_log_level(log_level_t level) { g_level = level; }
+
+void log_level_from_env(const char *variable) {
+    const char *value = getenv(variable);
+    if (value == NULL)
+        return;
+
+    if (strcmp(value, "quiet") == 0)
+        set_log_level(LOG_QUIET);
+    else if (strcmp(value, "normal") == 0)
+        set_log_level(LOG_NORMAL);
+    else if (strcmp(value, "verbose") == 0)
+        set_log_level(LOG_VERBOSE);
+}
+
+void log_check_format(const char *format, ...) { (void)format; }
+
+typedef struct {
+    const log_site *site;
+    unsigned long time_ns;
+    unsigned long args[LOG_MAX_ARGS];
+} log_entry;
+
+// Single producer (the owning thread), single consumer (the flusher)
+typedef struct log_ring {
+    _Atomic unsigned long head, tail;
+    _Atomic unsigned long dropped;
+    log_entry entries[LOG_RING_SIZE];
+    struct log_ring *next;
+} log_ring;
+
+static _Thread_local log_ring *local_ring = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring *rings = NULL;
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+
+// Exiting threads print what is left in their ring and give it up
+static pthread_key_t ring_key;
+static bool have_ring_key = false;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + (unsigned long)ts.tv_nsec;
+}
+
+static void print_entry(const log_entry *entry) {
+    const log_site *site = entry->site;
+    char buf[2048];
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    snprintf(buf, sizeof(buf), site->format, entry->args[0], entry->args[1],
+             entry->args[2], entry->args[3]);
+#pragma GCC diagnostic pop
+
+    fprintf(stderr, "%s%lu.%06lu %s:%d :: %s :: %s\n", site->tag,
+            entry->time_ns / 1000000000ul, entry->time_ns / 1000ul % 1000000ul,
+            site->file, site->line, site->func, buf);
+}
+
+static void drain(log_ring *ring) {
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        print_entry(&ring->entries[tail & (LOG_RING_SIZE - 1)]);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(stderr, "[LOG]:   %lu messages dropped, log ring full\n", dropped);
+    }
+}
+
+void log_flush(void) {
+    // Serialized by rings_lock, the rings only ever have one consumer
+    pthread_mutex_lock(&rings_lock);
+    for (log_ring *it = rings; it != NULL; it = it->next) {
+        drain(it);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fflush(stderr);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_MS * 1000000l};
+    while (true) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+static void retire_ring(void *ring_void) {
+    log_ring *ring = ring_void;
+    local_ring = NULL;
+
+    pthread_mutex_lock(&rings_lock);
+    drain(ring);
+    for (log_ring **it = &rings; *it != NULL; it = &(*it)->next) {
+        if (*it == ring) {
+            *it = ring->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    free(ring);
+}
+
+static void start_flusher(void) {
+    have_ring_key = pthread_key_create(&ring_key, retire_ring) == 0;
+
+    // Signals are left to the threads that were expecting them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) == 0) {
+        pthread_detach(flusher);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    atexit(log_flush);
+}
+
+static log_ring *register_ring(void) {
+    pthread_once(&flusher_once, start_flusher);
+
+    log_ring *ring = calloc(1, sizeof(log_ring));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    if (have_ring_key)
+        pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+void log_record(const log_site *site, unsigned long a0, unsigned long a1,
+                unsigned long a2, unsigned long a3) {
+    log_ring *ring = local_ring != NULL ? local_ring : register_ring();
+    if (ring == NULL)
+        return;
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_entry *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    entry->site = site;
+    entry->time_ns = now_ns();
+    entry->args[0] = a0;
+    entry->args[1] = a1;
+    entry->args[2] = a2;
+    entry->args[3] = a3;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
@@ -25,39 +25,72 @@ extern log_level_t g_level;
     do {                                                                       \
         char buf[2048];                                                        \
         snprintf(buf, 2048, __VA_ARGS__);                                      \
+        log_flush();                                                           \
         fprintf(stderr, "[PANIC]: %s:%d :: %s :: %s\n", __FILE__, __LINE__,    \
                 __func__, buf);                                                \
         exit(EXIT_FAILURE);                                                    \
     } while (0);
 
-#define WARN(...)                                                              \
-    do {                                                                       \
-        if (g_level == LOG_NORMAL || g_level == LOG_VERBOSE) {                 \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[WARN]:  %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
-        }                                                                      \
-    } while (0);
+// WARN, LOG, DEBUG and TRACE do not format anything on the calling thread:
+// a record holding the call site and up to LOG_MAX_ARGS raw arguments is
+// pushed into a per-thread ring and a background thread formats it later.
+// A disabled level costs a single compare. Because of the deferral:
+//  - integer arguments must use the l conversions (%lu, %li, %lx, %p...)
+//  - %s only takes strings that outlive the call (literals, strerror())
+//  - floating point arguments are not supported
+// Records are dropped (and counted) instead of blocking when a ring is full.
+#define LOG_MAX_ARGS 4
+#define LOG_RING_SIZE 1024 // records per thread, must be a power of two
+#define LOG_FLUSH_MS 50
+
+typedef struct {
+    log_level_t level;
+    const char *tag;
+    const char *format;
+    const char *file;
+    int line;
+    const char *func;
+} log_site;
+
+// log_record: queue a message of site for the background flusher
+void log_record(const log_site *site, unsigned long a0, unsigned long a1,
+                unsigned long a2, unsigned long a3);
+
+// log_flush: format and print every queued message now
+void log_flush(void);
+
+// log_level_from_env: set the log level from an environment variable
+// holding quiet, normal or verbose, if it is set
+void log_level_from_env(const char *variable);
+
+// Never called, lets the compiler check the format against its arguments
+void log_check_format(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
 
-#define LOG(...)                                                               \
+#define LOG_SITE_(lvl, tag_, format_, a0, a1, a2, a3, ...)                    \
     do {                                                                       \
-        if (g_level == LOG_NORMAL || g_level == LOG_VERBOSE) {                 \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[LOG]:   %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
-        }                                                                      \
-    } while (0);
+        static const log_site site_ = {lvl,      tag_,     format_,           \
+                                       __FILE__, __LINE__, __func__};         \
+        log_record(&site_, (unsigned long)(a0), (unsigned long)(a1),          \
+                   (unsigned long)(a2), (unsigned long)(a3));                 \
+    } while (0)
 
-#define DEBUG(...)                                                             \
+#define LOG_AT_(lvl, tag_, ...)                                                \
     do {                                                                       \
-        if (g_level == LOG_VERBOSE) {                                          \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[DEBUG]: %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
+        if (__builtin_expect((lvl) <= g_level, 0)) {                           \
+            if (0)                                                             \
+                log_check_format(__VA_ARGS__);                                 \
+            LOG_SITE_(lvl, tag_, __VA_ARGS__, 0, 0, 0, 0, 0);                  \
         }                                                                      \
-    } while (0);
+    } while (0)
+
+#define WARN(...) LOG_AT_(LOG_NORMAL, "[WARN]:  ", __VA_ARGS__);
+
+#define LOG(...) LOG_AT_(LOG_NORMAL, "[LOG]:   ", __VA_ARGS__);
+
+#define DEBUG(...) LOG_AT_(LOG_VERBOSE, "[DEBUG]: ", __VA_ARGS__);
+
+// TRACE: hot path events, only recorded when verbose
+#define TRACE(...) LOG_AT_(LOG_VERBOSE, "[TRACE]: ", __VA_ARGS__);
 
 #endif // __UTILS_LOGGING_H__
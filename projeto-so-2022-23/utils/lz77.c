@@ -0,0 +1,123 @@
+#include "lz77.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+// Match candidates are found through a hash of the next 4 bytes
+#define LZ77_HASH_BITS 12
+
+static u32 read32(const u8* p){
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static u32 hash4(const u8* p){
+    return (read32(p)*2654435761u) >> (32-LZ77_HASH_BITS);
+}
+
+// Lengths past what fits in the token are 255s and a remainder
+static u8* put_length(u8* out, const u8* end, size_t len){
+    for(;len>=255;len-=255){
+        if(out>=end) return NULL;
+        *out++ = 255;
+    }
+    if(out>=end) return NULL;
+    *out++ = (u8)len;
+    return out;
+}
+
+static bool get_length(const u8** in, const u8* end, size_t* len){
+    u8 byte;
+    do{
+        if(*in>=end) return false;
+        byte = *(*in)++;
+        *len += byte;
+    }while(byte==255);
+    return true;
+}
+
+// A match of 0 ends the block, with the literals only
+static u8* put_sequence(u8* out, const u8* end, const u8* literals, size_t n_literals, size_t offset, size_t match){
+    size_t match_code = match==0 ? 0 : match-LZ77_MIN_MATCH;
+    if(out>=end) return NULL;
+    *out++ = (u8)(((n_literals<15 ? n_literals : 15)<<4) | (match_code<15 ? match_code : 15));
+    if(n_literals>=15 && (out = put_length(out, end, n_literals-15))==NULL) return NULL;
+
+    if((size_t)(end-out)<n_literals) return NULL;
+    memcpy(out, literals, n_literals);
+    out += n_literals;
+    if(match==0) return out;
+
+    if(end-out<2) return NULL;
+    *out++ = (u8)offset;
+    *out++ = (u8)(offset>>8);
+    if(match_code>=15 && (out = put_length(out, end, match_code-15))==NULL) return NULL;
+    return out;
+}
+
+size_t lz77_compress(const void* src_void, size_t len, void* dst_void, size_t capacity){
+    if(len>LZ77_MAX_INPUT) return 0;
+    const u8* src = src_void;
+    u8* out = dst_void;
+    const u8* end = out + capacity;
+
+    // Last position of each hash plus one, 0 for none
+    u16 table[1<<LZ77_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0, pos = 0;
+    while(pos+LZ77_MIN_MATCH<=len){
+        u32 hash = hash4(src+pos);
+        size_t candidate = table[hash];
+        table[hash] = (u16)(pos+1);
+        if(candidate==0 || read32(src+candidate-1)!=read32(src+pos)){
+            pos++;
+            continue;
+        }
+        candidate--;
+
+        size_t match = LZ77_MIN_MATCH;
+        while(pos+match<len && src[candidate+match]==src[pos+match]) match++;
+        out = put_sequence(out, end, src+anchor, pos-anchor, pos-candidate, match);
+        if(out==NULL) return 0;
+        pos += match;
+        anchor = pos;
+    }
+
+    out = put_sequence(out, end, src+anchor, len-anchor, 0, 0);
+    if(out==NULL) return 0;
+    return (size_t)(out - (u8*)dst_void);
+}
+
+ssize_t lz77_decompress(const void* src, size_t len, void* dst, size_t capacity){
+    const u8* in = src;
+    const u8* in_end = in + len;
+    u8* out = dst;
+    const u8* out_end = out + capacity;
+
+    while(in<in_end){
+        u8 token = *in++;
+        size_t literals = (size_t)(token>>4);
+        if(literals==15 && !get_length(&in, in_end, &literals)) return -1;
+        if((size_t)(in_end-in)<literals || (size_t)(out_end-out)<literals) return -1;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if(in==in_end) break;
+
+        if(in_end-in<2) return -1;
+        size_t offset = (size_t)in[0] | (size_t)in[1]<<8;
+        in += 2;
+        size_t match = (size_t)(token & 15);
+        if(match==15 && !get_length(&in, in_end, &match)) return -1;
+        match += LZ77_MIN_MATCH;
+        if(offset==0 || offset>(size_t)(out-(u8*)dst) || (size_t)(out_end-out)<match) return -1;
+
+        // Byte by byte, the match may overlap what it copies
+        const u8* from = out-offset;
+        for(size_t i=0;i<match;i++) out[i] = from[i];
+        out += match;
+    }
+    return (ssize_t)(out-(u8*)dst);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Byte oriented LZ77 codec, in the spirit of LZ4: a compressed block is a
+// run of sequences, each a token byte (literal count in the high nibble,
+// match length minus LZ77_MIN_MATCH in the low one, 15 meaning more length
+// bytes follow), the literals, then a 2 byte little endian match offset.
+// The last sequence has literals only. Matches may overlap what they copy,
+// so a run of one byte costs a few bytes whatever its length.
+//
+// Blocks are at most 64KiB, which is plenty for message batches
+
+#define LZ77_MIN_MATCH 4
+#define LZ77_MAX_INPUT 65535
+
+// lz77_compress: compress len bytes of src into dst, returns the compressed
+// size or 0 if it doesn't fit in capacity. A capacity under len makes it
+// give up on data that wouldn't come out smaller
+size_t lz77_compress(const void* src, size_t len, void* dst, size_t capacity);
+
+// lz77_decompress: decompress len bytes of src into dst, returns the size
+// decompressed or -1 if the block is corrupt or doesn't fit in capacity
+ssize_t lz77_decompress(const void* src, size_t len, void* dst, size_t capacity);
@@ -0,0 +1,118 @@
+#include "name_key.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// The hash is NH (from UMAC): the sum over the 8 byte words of the key of
+// the product of its two halves, each plus a secret. Vectors do 2 or 4
+// words per multiply and land on the same sum as the scalar loop
+#define NH_KEYS 8
+
+static const u64 nh_keys[NH_KEYS] = {
+    0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull,
+    0xA0761D6478BD642Full, 0xE7037ED1A0B428DBull, 0x8EBC6AF09C88C6E3ull, 0x589965CC75374CC3ull,
+};
+
+static u64 load64(const char* p){
+    u64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static u64 nh_word(u64 word, u64 key){
+    u32 lo = (u32)word + (u32)key;
+    u32 hi = (u32)(word>>32) + (u32)(key>>32);
+    return (u64)lo*hi;
+}
+
+bool name_key_pad(char* key, const char* name, size_t width){
+    size_t len = strnlen(name, width);
+    if(len==width) return false;
+    memcpy(key, name, len);
+    memset(key+len, 0, width-len);
+    return true;
+}
+
+u32 name_key_hash(const char* key, size_t width){
+    u64 sum = 0;
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i sum256 = _mm256_setzero_si256();
+    for(;i+32<=width && i+32<=NH_KEYS*8;i+=32){
+        __m256i words = _mm256_loadu_si256((const void*)(key+i));
+        __m256i keys = _mm256_loadu_si256((const void*)(nh_keys+i/8));
+        __m256i halves = _mm256_add_epi32(words, keys);
+        sum256 = _mm256_add_epi64(sum256, _mm256_mul_epu32(halves, _mm256_srli_epi64(halves, 32)));
+    }
+    u64 lanes256[4];
+    _mm256_storeu_si256((void*)lanes256, sum256);
+    sum += lanes256[0] + lanes256[1] + lanes256[2] + lanes256[3];
+#endif
+#ifdef __SSE2__
+    __m128i sum128 = _mm_setzero_si128();
+    for(;i+16<=width && i+16<=NH_KEYS*8;i+=16){
+        __m128i words = _mm_loadu_si128((const void*)(key+i));
+        __m128i keys = _mm_loadu_si128((const void*)(nh_keys+i/8));
+        __m128i halves = _mm_add_epi32(words, keys);
+        sum128 = _mm_add_epi64(sum128, _mm_mul_epu32(halves, _mm_srli_epi64(halves, 32)));
+    }
+    u64 lanes128[2];
+    _mm_storeu_si128((void*)lanes128, sum128);
+    sum += lanes128[0] + lanes128[1];
+#endif
+    for(;i+8<=width;i+=8){
+        sum += nh_word(load64(key+i), nh_keys[i/8%NH_KEYS]);
+    }
+    if(i<width){
+        u64 tail = 0;
+        memcpy(&tail, key+i, width-i);
+        sum += nh_word(tail, nh_keys[i/8%NH_KEYS]);
+    }
+
+    // NH alone leaves the low bits weak, the finalizer of murmur3 mixes them in
+    sum ^= sum>>33;
+    sum *= 0xFF51AFD7ED558CCDull;
+    sum ^= sum>>33;
+    sum *= 0xC4CEB9FE1A85EC53ull;
+    sum ^= sum>>33;
+    return (u32)sum;
+}
+
+// Index of the first byte where a and b differ, width if none does
+static size_t first_difference(const char* a, const char* b, size_t width){
+    size_t i = 0;
+#ifdef __AVX2__
+    for(;i+32<=width;i+=32){
+        __m256i same = _mm256_cmpeq_epi8(_mm256_loadu_si256((const void*)(a+i)), _mm256_loadu_si256((const void*)(b+i)));
+        u32 differ = ~(u32)_mm256_movemask_epi8(same);
+        if(differ!=0) return i + (size_t)__builtin_ctz(differ);
+    }
+#endif
+#ifdef __SSE2__
+    for(;i+16<=width;i+=16){
+        __m128i same = _mm_cmpeq_epi8(_mm_loadu_si128((const void*)(a+i)), _mm_loadu_si128((const void*)(b+i)));
+        u32 differ = (u32)_mm_movemask_epi8(same) ^ 0xFFFFu;
+        if(differ!=0) return i + (size_t)__builtin_ctz(differ);
+    }
+#endif
+    for(;i+8<=width;i+=8){
+        u64 differ = load64(a+i) ^ load64(b+i);
+        if(differ==0) continue;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        return i + (size_t)__builtin_ctzll(differ)/8;
+#else
+        return i + (size_t)__builtin_clzll(differ)/8;
+#endif
+    }
+    for(;i<width;i++){
+        if(a[i]!=b[i]) return i;
+    }
+    return width;
+}
+
+bool name_key_equal(const char* a, const char* b, size_t width){
+    return first_difference(a, b, width)==width;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Names kept in fixed width buffers (box names, file names) as keys. A key
+// is the name zero padded to the whole width of its buffer, so two keys are
+// equal exactly when their bytes are, and can be hashed and compared 16 or
+// 32 bytes at a time instead of a character at a time. Owners keep the hash
+// next to the key so a lookup only compares the keys whose hashes match
+//
+// SSE2 is always there on x86-64, AVX2 is used when built for it
+// (-mavx2 or -march=native), anything else falls back to 8 byte words
+
+// name_key_pad: copy name into the width bytes of key, zero padded,
+// returns false if name and its terminator don't fit
+bool name_key_pad(char* key, const char* name, size_t width);
+
+// name_key_hash: hash of the width bytes of key
+u32 name_key_hash(const char* key, size_t width);
+
+// name_key_equal: whether the width bytes of a and b are the same
+bool name_key_equal(const char* a, const char* b, size_t width);
@@ -42,4 +42,35 @@ void vector_destory(vector* v){
     v->size = 0;
     v->capacity = 0;
     v->buff = NULL;
-}
\ No newline at end of file
+}
+
+void flat_vector_create(flat_vector* v, size_t element_size, size_t initial_capacity){
+    if(initial_capacity<1) initial_capacity = 1;
+    v->buff = malloc(element_size*initial_capacity);
+    ALWAYS_ASSERT(v->buff!=NULL, "NO MEMORY!\n");
+    v->size = 0;
+    v->capacity = initial_capacity;
+    v->element_size = element_size;
+}
+
+void* flat_vector_reserve(flat_vector* v, size_t count){
+    if(v->size+count > v->capacity){
+        size_t capacity = v->capacity*2;
+        if(capacity < v->size+count) capacity = v->size+count;
+        v->buff = realloc(v->buff, capacity*v->element_size);
+        if(v->buff == NULL) PANIC("NO MEMORY!\n");
+        v->capacity = capacity;
+    }
+    return flat_vector_at(v, v->size);
+}
+
+void* flat_vector_at(const flat_vector* v, size_t i){
+    return (char*)v->buff + i*v->element_size;
+}
+
+void flat_vector_destroy(flat_vector* v){
+    free(v->buff);
+    v->size = 0;
+    v->capacity = 0;
+    v->buff = NULL;
+}
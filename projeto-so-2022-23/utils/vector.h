@@ -13,4 +13,21 @@ void vector_push(vector* v, void* data);
 
 void vector_sort(vector* v, int(cmp_func)(const void*, const void*));
 
-void vector_destory(vector* v);
\ No newline at end of file
+void vector_destory(vector* v);
+
+// Elements stored inline, one after the other, instead of pointers to them,
+// with no limit on how many. Pointers into it are good until the next push
+typedef struct{
+    void* buff;
+    size_t size, capacity, element_size;
+} flat_vector;
+
+void flat_vector_create(flat_vector* v, size_t element_size, size_t initial_capacity);
+
+// flat_vector_reserve: make room for count more elements past the last one,
+// returns where they go, for the caller to fill and add to size
+void* flat_vector_reserve(flat_vector* v, size_t count);
+
+void* flat_vector_at(const flat_vector* v, size_t i);
+
+void flat_vector_destroy(flat_vector* v);